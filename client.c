@@ -39,7 +39,7 @@ static char *filename;
 static int quiet_opt = 0;
 
 static int parse_address(char *address, struct sockaddr_in *sin);
-static int get_nvt_line(int sd, char *line);
+static int get_nvt_line(int sd, char *line, size_t line_len);
 static void loop_until_end(int sd);
 
 
@@ -168,7 +168,7 @@ loop_until_end(int sd)
             break;
         }
 
-        if (get_nvt_line(sd, line) < 0)
+        if (get_nvt_line(sd, line, sizeof(line)) < 0)
         {
             perror("get_nvt_line");
             errcnd = 1;
@@ -338,36 +338,29 @@ cleanup:
  *  -1 on failure
  */
 static int
-get_nvt_line(int sd, char *line)
+get_nvt_line(int sd, char *line, size_t line_len)
 {
-    char last_char;
-    char this_char;
     int len;
 
-    last_char = '\0';
-    for (;;)
-    {
-        len = myread(sd, &this_char, sizeof(this_char));
-        if (len < 0)
-            return -1;
-
-        if (len == 0)
-        {
-            /* Connection ended before line terminator (or empty string) */
-            *line = '\0';
-            return 0;
-        }
-        /** fprintf(stderr, "read character %c\n", this_char); **/
+    /* the whole line is returned by a single call */
+    if ((len = myreadline(sd, line, line_len)) < 0)
+        return -1;
 
-        if (last_char == '\r' && this_char == '\n')
+    if (len < 2 || line[len - 2] != '\r' || line[len - 1] != '\n')
+    {
+        if (len == (int) line_len - 1)
         {
-            /* Reached the end of line. Already wrote \r into string, overwrite
-             * it with a NUL */
-            line[-1] = '\0';
-            return 0;
+            errno = EMSGSIZE;
+            return -1;  /* line too long */
         }
 
-        *line++ = this_char;
-        last_char = this_char;
+        /* Connection ended before line terminator (or empty string); any
+         * partial line is returned as is
+         */
+        return 0;
     }
+
+    /* Reached the end of line; overwrite the \r\n with a NUL */
+    line[len - 2] = '\0';
+    return 0;
 }
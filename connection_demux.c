@@ -11,6 +11,7 @@
 #include "network_io.h"
 #include "transport.h"
 #include "connection_demux.h"
+#include "mysock_epoll.h"
 
 
 
@@ -221,9 +222,8 @@ bool_t _mysock_enqueue_connection(mysock_context_t      *ctx,
         new_ctx = _mysock_get_context(queue_entry->sd);
         new_ctx->listen_sd = ctx->my_sd;
 
-        new_ctx->network_state.peer_addr       = *peer_addr;
-        new_ctx->network_state.peer_addr_len   = peer_addr_len;
-        new_ctx->network_state.peer_addr_valid = TRUE;
+        _network_set_peer_addr(&new_ctx->network_state,
+                               peer_addr, peer_addr_len);
 
         queue_entry->peer_addr     = *peer_addr;
         queue_entry->peer_addr_len = peer_addr_len;
@@ -259,13 +259,15 @@ done:
 
 void _mysock_passive_connection_complete(mysock_context_t *ctx)
 {
+    mysock_context_t *accept_ctx;
     listen_queue_t *q;
 
     assert(ctx);
 
     PTHREAD_CALL(pthread_rwlock_rdlock(&listen_lock));
     assert(ctx->listen_sd >= 0);
-    if ((q = _get_connection_queue(_mysock_get_context(ctx->listen_sd))))
+    accept_ctx = _mysock_get_context(ctx->listen_sd);
+    if ((q = _get_connection_queue(accept_ctx)))
     {
         completed_connect_t *tail, *new_entry;
         connect_request_t *connection_req = NULL;
@@ -300,7 +302,37 @@ void _mysock_passive_connection_complete(mysock_context_t *ctx)
         PTHREAD_CALL(pthread_mutex_unlock(&q->connection_lock));
         PTHREAD_CALL(pthread_cond_signal(&q->connection_cond));
     }
+    else
+    {
+        accept_ctx = NULL;
+    }
+    PTHREAD_CALL(pthread_rwlock_unlock(&listen_lock));
+
+    /* the listening mysocket is now ready for myaccept() */
+    if (accept_ctx)
+        _mysock_epoll_notify(accept_ctx);
+}
+
+/* returns TRUE if myaccept() on the given listening mysocket would return
+ * immediately.
+ */
+bool_t _mysock_has_completed_connection(mysock_context_t *accept_ctx)
+{
+    listen_queue_t *q;
+    bool_t result = FALSE;
+
+    assert(accept_ctx && accept_ctx->listening && accept_ctx->bound);
+
+    PTHREAD_CALL(pthread_rwlock_rdlock(&listen_lock));
+    if ((q = _get_connection_queue(accept_ctx)))
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&q->connection_lock));
+        result = (q->completed_queue != NULL);
+        PTHREAD_CALL(pthread_mutex_unlock(&q->connection_lock));
+    }
     PTHREAD_CALL(pthread_rwlock_unlock(&listen_lock));
+
+    return result;
 }
 
 /* called by mylisten() to specify the number of pending connection
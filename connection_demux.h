@@ -22,5 +22,7 @@ void _mysock_close_passive_socket(struct mysock_context *ctx);
 
 void _mysock_passive_connection_complete(struct mysock_context *new_ctx);
 
+bool_t _mysock_has_completed_connection(struct mysock_context *accept_ctx);
+
 #endif  /* __CONNECTION_DEMUX_H__ */
 
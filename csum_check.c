@@ -0,0 +1,249 @@
+/*
+ * csum_check.c
+ *
+ * Checks the checksum kernels in tcp_sum.c against the original 16-bit
+ * routine they replaced, over a range of lengths, alignments and iovec
+ * splits.  'make check' runs it as built normally and with -DNO_SIMD_CSUM.
+ * tcp_sum.c is included directly, so that each kernel the CPU supports can
+ * be called, rather than just the one picked at run time.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "tcp_sum.c"
+
+
+#define MAX_LEN         2100    /* every length up to this... */
+#define MAX_ALIGN       64      /* ...at every alignment up to this */
+#define MAX_PIECES      8
+
+#define SRC_ADDR        0x0100007f
+#define DST_ADDR        0x0200007f
+
+typedef struct
+{
+    const char *name;
+    sum_func_t  func;
+} kernel_t;
+
+static unsigned int num_checks = 0, num_failures = 0;
+
+
+/* tcp_sum.c refers to this, for checksums against a mysocket's peer */
+uint32_t _network_get_local_addr(network_context_t *ctx)
+{
+    assert(0);
+    return 0;
+}
+
+/* the original _mysock_tcp_checksum(), which needed the packet to be
+ * 32-bit aligned.  it's copied to an aligned buffer here instead, and the
+ * sum is unsigned, as a jumbo packet could overflow the original's.
+ */
+static uint16_t _ref_tcp_checksum(uint32_t src_addr, uint32_t dst_addr,
+                                  const void *buf, size_t len)
+{
+    struct
+    {
+        uint32_t src_addr;
+        uint32_t dst_addr;
+        uint8_t  zero;
+        uint8_t  protocol;
+        uint16_t len;
+    } __attribute__ ((packed)) pseudo_header =
+    {
+        src_addr, dst_addr, 0, IPPROTO_TCP, htons(len)
+    };
+
+    static uint32_t aligned[(65536 + 3) / 4];
+    const void *packet = aligned;
+    unsigned int k;
+    uint32_t sum = 0;
+
+    assert(len >= sizeof(struct tcphdr) && len <= sizeof(aligned));
+    memcpy(aligned, buf, len);
+
+    for (k = 0; k < sizeof(pseudo_header) / sizeof(uint16_t); ++k)
+        sum += ((uint16_t *) &pseudo_header)[k];
+
+    for (k = 0; k < (len >> 1); ++k)
+    {
+        if (k == (offsetof(struct tcphdr, th_sum) >> 1))
+            continue;   /* th_sum == 0 during checksum computation */
+        sum += ((uint16_t *) packet)[k];
+    }
+
+    if (len & 1)
+    {
+        uint16_t tmp = 0;
+        *(uint8_t *) &tmp = ((uint8_t *) packet)[len - 1];
+        sum += tmp;
+    }
+
+    sum = (sum >> 16) + (sum & 0xffff);
+    sum += (sum >> 16);
+
+    return (uint16_t) ~sum;
+}
+
+/* the sum of len bytes, in the same way, folded to 16 bits */
+static uint32_t _ref_sum(const void *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t *) buf;
+    uint32_t sum = 0;
+    uint16_t word;
+
+    for (; len >= 2; p += 2, len -= 2)
+    {
+        memcpy(&word, p, sizeof(word));
+        sum += word;
+    }
+
+    if (len)
+    {
+        word = 0;
+        *(uint8_t *) &word = *p;
+        sum += word;
+    }
+
+    while (sum >> 16)
+        sum = (sum >> 16) + (sum & 0xffff);
+    return sum;
+}
+
+static void _check(bool_t ok, const char *what, size_t len, size_t align)
+{
+    ++num_checks;
+    if (!ok && num_failures++ < 20)
+    {
+        fprintf(stderr, "csum_check: %s differs (len=%u, align=%u)\n",
+                what, (unsigned) len, (unsigned) align);
+    }
+}
+
+/* fill buf with one of a few patterns:  random bytes, or all ones or zeros
+ * (the worst cases for carries, and for a result of zero)
+ */
+static void _fill(uint8_t *buf, size_t len, int pattern)
+{
+    size_t k;
+
+    for (k = 0; k < len; ++k)
+    {
+        buf[k] = (pattern == 0) ? (uint8_t) rand() :
+                 (pattern == 1) ? 0xff : 0;
+    }
+}
+
+/* checks for a len byte buffer at the given offset into an aligned one */
+static void _check_buffer(const kernel_t *kernels, int num_kernels,
+                          size_t len, size_t align, int pattern)
+{
+    static uint8_t src_buf[65536 + MAX_ALIGN], dst_buf[65536 + MAX_ALIGN];
+    uint8_t *src = src_buf + align, *dst = dst_buf + align;
+    uint32_t ref_sum;
+    int k;
+
+    assert(len + align <= sizeof(src_buf));
+
+    _fill(src, len, pattern);
+    ref_sum = _ref_sum(src, len);
+
+    for (k = 0; k < num_kernels; ++k)
+        _check(kernels[k].func(src, len) == ref_sum, kernels[k].name,
+               len, align);
+
+    _check(_mysock_csum_partial(src, len) == ref_sum,
+           "_mysock_csum_partial()", len, align);
+
+    memset(dst, 0, len);
+    _check(_mysock_csum_and_copy(dst, src, len) == ref_sum &&
+               !memcmp(dst, src, len),
+           "_mysock_csum_and_copy()", len, align);
+
+    if (len >= sizeof(struct tcphdr))
+    {
+        uint16_t ref_csum = _ref_tcp_checksum(SRC_ADDR, DST_ADDR, src, len);
+        struct iovec iov[MAX_PIECES];
+        size_t offset;
+        int iovcnt;
+
+        _check(_mysock_tcp_checksum(SRC_ADDR, DST_ADDR, src, len) == ref_csum,
+               "_mysock_tcp_checksum()", len, align);
+
+        /* the same packet, split at random (including pieces of odd
+         * length, and empty ones)
+         */
+        for (iovcnt = 0, offset = 0; offset < len || iovcnt == 0; ++iovcnt)
+        {
+            size_t piece_len = (iovcnt == MAX_PIECES - 1) ? len - offset :
+                               (size_t) rand() % (len - offset + 1);
+
+            iov[iovcnt].iov_base = src + offset;
+            iov[iovcnt].iov_len  = piece_len;
+            offset += piece_len;
+        }
+
+        _check(_mysock_tcp_checksum_v(SRC_ADDR, DST_ADDR, iov, iovcnt) ==
+                   ref_csum,
+               "_mysock_tcp_checksum_v()", len, align);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    static const size_t long_lens[] =
+    {
+        4095, 4096, 4097, 9000, 65534, 65535
+    };
+
+    kernel_t kernels[3];
+    int num_kernels = 0, pattern;
+    size_t len, align, k;
+
+    srand(argc > 1 ? atoi(argv[1]) : 1);
+
+    kernels[num_kernels].name   = "_sum_words_64()";
+    kernels[num_kernels++].func = _sum_words_64;
+#ifdef CSUM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+    {
+        kernels[num_kernels].name   = "_sum_words_sse2()";
+        kernels[num_kernels++].func = _sum_words_sse2;
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        kernels[num_kernels].name   = "_sum_words_avx2()";
+        kernels[num_kernels++].func = _sum_words_avx2;
+    }
+#endif
+
+    for (pattern = 0; pattern < 3; ++pattern)
+    {
+        for (len = 0; len <= MAX_LEN; ++len)
+        {
+            for (align = 0; align < MAX_ALIGN; ++align)
+                _check_buffer(kernels, num_kernels, len, align, pattern);
+        }
+
+        for (k = 0; k < sizeof(long_lens) / sizeof(long_lens[0]); ++k)
+        {
+            for (align = 0; align < MAX_ALIGN; align += 7)
+            {
+                _check_buffer(kernels, num_kernels, long_lens[k], align,
+                              pattern);
+            }
+        }
+    }
+
+    printf("csum_check: %u of %u checks failed (%d kernels", num_failures,
+           num_checks, num_kernels);
+#ifdef NO_SIMD_CSUM
+    printf(", NO_SIMD_CSUM");
+#endif
+    printf(")\n");
+
+    return num_failures ? 1 : 0;
+}
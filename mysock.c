@@ -5,6 +5,7 @@
 #include <string.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <unistd.h>
 #include <netinet/in.h>
 #include <pthread.h>
 #include "mysock.h"
@@ -12,6 +13,9 @@
 #include "network_io.h"
 #include "stcp_api.h"
 #include "transport.h"
+#include "mysock_epoll.h"
+#include "tcp_sum.h"
+#include "network_emu.h"
 
 
 #ifdef NDEBUG
@@ -29,6 +33,12 @@ static void verify_mysocket_descriptor(mysock_context_t *comp_ctx,
                                        mysocket_t        my_sd);
 static mysock_context_t *_mysock_allocate_context(void);
 static bool_t _mysock_free_queue(mysock_context_t *ctx, packet_queue_t *pq);
+static void _mysock_append_node(packet_queue_t      *pq,
+                                packet_queue_node_t *node);
+static size_t _mysock_read_file_node(mysock_context_t *ctx,
+                                     packet_queue_t   *pq,
+                                     void             *dst,
+                                     size_t            max_len);
 
 
 /* mysocket descriptor table, one entry per STCP connection */
@@ -132,21 +142,403 @@ void _mysock_enqueue_buffer(mysock_context_t *ctx,
                             const void       *packet,
                             size_t            packet_len)
 {
-    packet_queue_node_t *node;
+    struct iovec iov;
 
     assert(ctx && pq && (packet || !packet_len));
 
-    node = (packet_queue_node_t *) calloc(1, sizeof(packet_queue_node_t));
+    iov.iov_base = (void *) packet;
+    iov.iov_len  = packet_len;
+    _mysock_enqueue_buffer_v(ctx, pq, &iov, 1);
+}
+
+/* as _mysock_enqueue_buffer(), but the buffer is gathered from iovcnt
+ * pieces.  the pieces are queued as a single node, so they are seen as one
+ * contiguous buffer by the consumer.
+ */
+void _mysock_enqueue_buffer_v(mysock_context_t   *ctx,
+                              packet_queue_t     *pq,
+                              const struct iovec *iov,
+                              int                 iovcnt)
+{
+    size_t packet_len = 0;
+    int k;
+
+    assert(ctx && pq && (iov || !iovcnt));
+
+    for (k = 0; k < iovcnt; ++k)
+        packet_len += iov[k].iov_len;
+
+    _mysock_enqueue_segments(ctx, pq, iov, iovcnt, 0, MAX(packet_len, 1));
+}
+
+/* as _mysock_enqueue_buffer_v(), but the data is split into nodes of at
+ * most seg_len bytes, each with headroom bytes reserved ahead of its data.
+ * this lets the transport layer take mywrite() data as is, prepending its
+ * header in place (see stcp_app_recv_buf()).  all the nodes are queued at
+ * once, so the consumer never sees only part of the data.
+ */
+void _mysock_enqueue_segments(mysock_context_t   *ctx,
+                              packet_queue_t     *pq,
+                              const struct iovec *iov,
+                              int                 iovcnt,
+                              size_t              headroom,
+                              size_t              seg_len)
+{
+    packet_queue_node_t *head = NULL, *tail = NULL;
+    size_t remaining = 0, iov_off = 0;
+    int k;
+
+    assert(ctx && pq && (iov || !iovcnt) && seg_len > 0);
+
+    for (k = 0; k < iovcnt; ++k)
+    {
+        assert(iov[k].iov_base || !iov[k].iov_len);
+        remaining += iov[k].iov_len;
+    }
+
+    /* an empty buffer is still queued, as a single zero-length node */
+    k = 0;
+    do
+    {
+        size_t len = MIN(seg_len, remaining);
+        packet_queue_node_t *node = _mysock_alloc_node(headroom, len);
+
+        while (node->data_len < len)
+        {
+            size_t piece_len;
+
+            assert(k < iovcnt);
+            piece_len = MIN(iov[k].iov_len - iov_off, len - node->data_len);
+
+            /* the data is checksummed as it's copied, so it needn't be
+             * read again when it's sent or received.
+             */
+            node->csum = _mysock_csum_add(
+                node->csum,
+                _mysock_csum_and_copy(node->data + node->data_len,
+                                      (const char *) iov[k].iov_base + iov_off,
+                                      piece_len),
+                node->data_len);
+            node->data_len += piece_len;
+
+            if ((iov_off += piece_len) == iov[k].iov_len)
+            {
+                ++k;
+                iov_off = 0;
+            }
+        }
+
+        node->csum_data = node->data;
+        node->csum_len  = node->data_len;
+
+        if (tail)
+            tail->next = node;
+        else
+            head = node;
+        tail = node;
+
+        remaining -= len;
+    } while (remaining > 0);
+
+    _mysock_enqueue_chain(ctx, pq, head);
+}
+
+/* allocate a queue node holding a copy of the packet gathered from the
+ * given pieces, which is checksummed as it's copied.
+ */
+packet_queue_node_t *_mysock_alloc_packet_node(const struct iovec *iov,
+                                               int                 iovcnt)
+{
+    packet_queue_node_t *node;
+    size_t len = 0;
+    int k;
+
+    assert(iov || !iovcnt);
+
+    for (k = 0; k < iovcnt; ++k)
+        len += iov[k].iov_len;
+
+    node = _mysock_alloc_node(0, len);
+    for (k = 0; k < iovcnt; ++k)
+    {
+        assert(iov[k].iov_base || !iov[k].iov_len);
+        node->csum = _mysock_csum_add(
+            node->csum,
+            _mysock_csum_and_copy(node->data + node->data_len,
+                                  iov[k].iov_base, iov[k].iov_len),
+            node->data_len);
+        node->data_len += iov[k].iov_len;
+    }
+
+    node->csum_data = node->data;
+    node->csum_len  = node->data_len;
+    return node;
+}
+
+/* allocate a queue node with room for len bytes of data, preceded by
+ * headroom bytes (e.g. for a header to be prepended later).  the buffer
+ * immediately follows the node, so a buffer handed out by
+ * _mysock_dequeue_node() can be mapped back to its node with
+ * _mysock_buffer_node().  data_len is initially zero, and the caller holds
+ * the only reference to the node.
+ */
+packet_queue_node_t *_mysock_alloc_node(size_t headroom, size_t len)
+{
+    packet_queue_node_t *node;
+
+    node = (packet_queue_node_t *) malloc(sizeof(packet_queue_node_t) +
+                                          headroom + len);
     assert(node);
 
-    node->data = (char *) malloc(packet_len * sizeof(char));
-    assert(node->data);
+    memset(node, 0, sizeof(*node));
+    node->buf    = (char *) (node + 1);
+    node->data   = node->buf + headroom;
+    node->refcnt = 1;
+    return node;
+}
+
+/* take an additional reference to a node, e.g. to keep a sent segment
+ * around for retransmission.  each reference is dropped with
+ * _mysock_free_node().
+ */
+void _mysock_hold_node(packet_queue_node_t *node)
+{
+    assert(node && node->refcnt > 0);
+    (void) __sync_add_and_fetch(&node->refcnt, 1);
+}
+
+/* add a node (from _mysock_alloc_node() or _mysock_dequeue_node()) to the
+ * tail of the given queue.  the queue takes over the caller's reference.
+ */
+void _mysock_enqueue_node(mysock_context_t    *ctx,
+                          packet_queue_t      *pq,
+                          packet_queue_node_t *node)
+{
+    assert(ctx && pq && node);
 
-    if (packet_len > 0)
-        memcpy(node->data, packet, packet_len);
-    node->data_len = packet_len;
+    node->next = NULL;
+    _mysock_enqueue_chain(ctx, pq, node);
+}
+
+/* append a NULL-terminated list of nodes to the given queue.  they are all
+ * queued at once, so the consumer is woken up once per list rather than
+ * once per node.
+ */
+void _mysock_enqueue_chain(mysock_context_t    *ctx,
+                           packet_queue_t      *pq,
+                           packet_queue_node_t *head)
+{
+    assert(ctx && pq && head);
 
     PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    while (head)
+    {
+        packet_queue_node_t *next = head->next;
+
+        head->next = NULL;
+        _mysock_append_node(pq, head);
+        head = next;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    PTHREAD_CALL(pthread_cond_broadcast(&ctx->data_ready_cond));
+
+    /* data (or EOF) for the application makes the mysocket readable */
+    if (pq == &ctx->app_send_queue)
+        _mysock_epoll_notify(ctx);
+}
+
+/* remove the node at the head of the given queue, blocking until the queue
+ * is non-empty.  the node (and its buffer) belongs to the caller, who must
+ * eventually requeue it or release it with _mysock_free_node().  this
+ * avoids any copying of the node's data.
+ */
+packet_queue_node_t *_mysock_dequeue_node(mysock_context_t *ctx,
+                                          packet_queue_t   *pq)
+{
+    packet_queue_node_t *node;
+
+    assert(ctx && pq);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    while (!pq->head)
+    {
+        PTHREAD_CALL(pthread_cond_wait(&ctx->data_ready_cond,
+                                       &ctx->data_ready_lock));
+    }
+
+    node = pq->head;
+    assert(!node->from_file);
+    if (!(pq->head = node->next))
+    {
+        assert(pq->tail == node);
+        pq->tail = NULL;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+    node->next = NULL;
+    return node;
+}
+
+/* as _mysock_dequeue_node(), but without blocking:  the head node is only
+ * removed if there is one and accept() returns TRUE for it.  accept() is
+ * called with the queue locked, so it should just look at the node.
+ * returns NULL if nothing was removed.
+ */
+packet_queue_node_t *_mysock_dequeue_node_if(mysock_context_t *ctx,
+                                             packet_queue_t   *pq,
+                                             bool_t (*accept)(
+                                                 const packet_queue_node_t *,
+                                                 void *),
+                                             void             *arg)
+{
+    packet_queue_node_t *node;
+
+    assert(ctx && pq && accept);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    if ((node = pq->head) != NULL)
+    {
+        if (!node->from_file && accept(node, arg))
+        {
+            if (!(pq->head = node->next))
+            {
+                assert(pq->tail == node);
+                pq->tail = NULL;
+            }
+            node->next = NULL;
+        }
+        else
+        {
+            node = NULL;
+        }
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+    return node;
+}
+
+/* as _mysock_dequeue_node(), but up to max_nodes nodes are removed from
+ * the head of the queue at once, taking the queue lock only once.  returns
+ * them as a NULL-terminated list in queue order, setting *num_nodes to its
+ * length.
+ */
+packet_queue_node_t *_mysock_dequeue_chain(mysock_context_t *ctx,
+                                           packet_queue_t   *pq,
+                                           int               max_nodes,
+                                           int              *num_nodes)
+{
+    packet_queue_node_t *head, *tail;
+    int count = 1;
+
+    assert(ctx && pq && max_nodes > 0 && num_nodes);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    while (!pq->head)
+    {
+        PTHREAD_CALL(pthread_cond_wait(&ctx->data_ready_cond,
+                                       &ctx->data_ready_lock));
+    }
+
+    head = tail = pq->head;
+    assert(!tail->from_file);
+    while (tail->next && count < max_nodes)
+    {
+        tail = tail->next;
+        assert(!tail->from_file);
+        ++count;
+    }
+
+    if (!(pq->head = tail->next))
+    {
+        assert(pq->tail == tail);
+        pq->tail = NULL;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+    tail->next = NULL;
+    *num_nodes = count;
+    return head;
+}
+
+/* remove up to max_len bytes from the head of the given queue, blocking
+ * until the queue is non-empty, and return them in a node with (exactly)
+ * headroom bytes ahead of the data.  a segment queued by
+ * _mysock_enqueue_segments() with the same headroom is returned as is if it
+ * fits; anything else (a partially consumed or oversized node, or file
+ * data) is copied (or read) into a new node.  a zero-length node is
+ * returned at EOF.
+ */
+packet_queue_node_t *_mysock_dequeue_segment(mysock_context_t *ctx,
+                                             packet_queue_t   *pq,
+                                             size_t            headroom,
+                                             size_t            max_len)
+{
+    packet_queue_node_t *node;
+
+    assert(ctx && pq && max_len > 0);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    while (!pq->head)
+    {
+        PTHREAD_CALL(pthread_cond_wait(&ctx->data_ready_cond,
+                                       &ctx->data_ready_lock));
+    }
+
+    node = pq->head;
+    if (!node->from_file && node->data_len <= max_len &&
+        node->data == node->buf + headroom)
+    {
+        if (!(pq->head = node->next))
+        {
+            assert(pq->tail == node);
+            pq->tail = NULL;
+        }
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+        node->next = NULL;
+        return node;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+    /* the head node belongs to us (the single consumer), so it can't go
+     * away in the meantime.
+     */
+    node = _mysock_alloc_node(headroom, max_len);
+    node->data_len = _mysock_dequeue_buffer(ctx, pq, node->data,
+                                            max_len, TRUE);
+    return node;
+}
+
+/* queue len bytes of the given file, starting at offset, without reading
+ * them.  the data is read directly into the consumer's buffer by
+ * dequeue_buffer(), so it is never copied into the queue.  fd is owned
+ * (and eventually closed) by the queue.
+ */
+void _mysock_enqueue_file(mysock_context_t *ctx,
+                          packet_queue_t   *pq,
+                          int               fd,
+                          off_t             offset,
+                          size_t            len)
+{
+    packet_queue_node_t *node;
+
+    assert(ctx && pq && fd >= 0 && len > 0);
+
+    node = _mysock_alloc_node(0, 0);
+
+    node->data_len    = len;
+    node->from_file   = TRUE;
+    node->file_fd     = fd;
+    node->file_offset = offset;
+
+    _mysock_enqueue_node(ctx, pq, node);
+}
+
+/* assumes calling code has locked the queue */
+static void _mysock_append_node(packet_queue_t *pq, packet_queue_node_t *node)
+{
+    assert(pq && node);
+
     if (!pq->head)
     {
         assert(!pq->tail);
@@ -160,8 +552,39 @@ void _mysock_enqueue_buffer(mysock_context_t *ctx,
         pq->tail->next = node;
         pq->tail = node;
     }
+}
+
+/* returns TRUE if nothing is waiting in the given queue.  this is only
+ * meaningful to the queue's (single) consumer, as a non-empty queue can't
+ * become empty behind its back.
+ */
+bool_t _mysock_queue_empty(mysock_context_t *ctx, packet_queue_t *pq)
+{
+    bool_t empty;
+
+    assert(ctx && pq);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    empty = (pq->head == NULL);
     PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
-    PTHREAD_CALL(pthread_cond_broadcast(&ctx->data_ready_cond));
+
+    return empty;
+}
+
+/* returns TRUE while the connection is still being established, i.e. until
+ * STCP calls stcp_unblock_application().
+ */
+bool_t _mysock_is_connecting(mysock_context_t *ctx)
+{
+    bool_t connecting;
+
+    assert(ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->blocking_lock));
+    connecting = ctx->blocking;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->blocking_lock));
+
+    return connecting;
 }
 
 /* remove one packet from the head of the waiting packet queue, copying the
@@ -190,6 +613,19 @@ size_t _mysock_dequeue_buffer(mysock_context_t *ctx,
                                        &ctx->data_ready_lock));
     }
 
+    if (pq->head->from_file)
+    {
+        /* mysendfile() data is read straight into the caller's buffer.
+         * if the file turned out to be shorter than expected, or couldn't
+         * be read, the rest of it is dropped and 0 returned; waiting for
+         * the next node instead could block the transport thread forever.
+         */
+        assert(remove_partial);
+        packet_len = _mysock_read_file_node(ctx, pq, dst, max_len);
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+        return packet_len;
+    }
+
     node = pq->head;
     assert(node && node->data);
 
@@ -201,7 +637,7 @@ size_t _mysock_dequeue_buffer(mysock_context_t *ctx,
         PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
 
         memcpy(dst, node->data, max_len);
-        memmove(node->data, node->data + max_len, node->data_len - max_len);
+        node->data     += max_len;
         node->data_len -= max_len;
         packet_len = max_len;
     }
@@ -218,15 +654,253 @@ size_t _mysock_dequeue_buffer(mysock_context_t *ctx,
         memcpy(dst, node->data, MIN(max_len, node->data_len));
         packet_len = node->data_len;
 
-        free(node->data);
-
-        memset(node, 0, sizeof(*node));
-        free(node);
+        _mysock_free_node(node);
     }
 
     return packet_len;
 }
 
+/* read the next portion of the mysendfile() node at the head of the queue
+ * into dst, dequeueing the node once it is exhausted.  the queue lock is
+ * held on entry and exit, but dropped during the read itself (the head
+ * node belongs to the queue's single consumer).  returns the number of
+ * bytes read, or 0 if the rest of the file couldn't be read (in which
+ * case the node is discarded).
+ */
+static size_t _mysock_read_file_node(mysock_context_t *ctx,
+                                     packet_queue_t   *pq,
+                                     void             *dst,
+                                     size_t            max_len)
+{
+    packet_queue_node_t *node = pq->head;
+    ssize_t rc;
+
+    assert(ctx && node && node->from_file && dst);
+
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    do
+    {
+        rc = pread(node->file_fd, dst, MIN(max_len, node->data_len),
+                   node->file_offset);
+    } while (rc < 0 && errno == EINTR);
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+
+    if (rc <= 0)
+    {
+        /* file was truncated, or an I/O error; discard what's left */
+        DEBUG_LOG(("mysendfile: pread failed (rc=%d, errno=%d)\n",
+                   (int) rc, errno));
+        rc = 0;
+        node->data_len = 0;
+    }
+    else
+    {
+        assert((size_t) rc <= node->data_len);
+        node->file_offset += rc;
+        node->data_len    -= rc;
+    }
+
+    if (node->data_len == 0)
+    {
+        if (!(pq->head = node->next))
+        {
+            assert(pq->tail == node);
+            pq->tail = NULL;
+        }
+        _mysock_free_node(node);
+    }
+
+    return rc;
+}
+
+/* scatter queued data into the given buffers, consuming as many queued
+ * nodes as fit, with a single acquisition of the queue lock.  this blocks
+ * until the queue is non-empty, but not thereafter.  a zero-length node
+ * (EOF) is only consumed if it is at the head of the queue, in which case
+ * zero is returned; otherwise, it is left for the next call.  returns the
+ * number of bytes copied.
+ */
+size_t _mysock_dequeue_buffer_v(mysock_context_t   *ctx,
+                                packet_queue_t     *pq,
+                                const struct iovec *iov,
+                                int                 iovcnt)
+{
+    packet_queue_node_t *node;
+    size_t total = 0, iov_off = 0;
+    int k = 0;
+
+    assert(ctx && pq && iov && iovcnt > 0);
+
+    /* block until queue is non-empty */
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    while (!pq->head)
+    {
+        PTHREAD_CALL(pthread_cond_wait(&ctx->data_ready_cond,
+                                       &ctx->data_ready_lock));
+    }
+
+    while ((node = pq->head) != NULL)
+    {
+        size_t node_off = 0;
+
+        assert(node->data && !node->from_file);
+        if (node->data_len == 0 && total > 0)
+            break;  /* leave EOF for the next call */
+
+        /* copy as much of this node as there's room for */
+        while (node_off < node->data_len && k < iovcnt)
+        {
+            size_t n = MIN(node->data_len - node_off,
+                           iov[k].iov_len - iov_off);
+
+            memcpy((char *) iov[k].iov_base + iov_off,
+                   node->data + node_off, n);
+            node_off += n;
+            iov_off  += n;
+            total    += n;
+
+            if (iov_off == iov[k].iov_len)
+            {
+                ++k;
+                iov_off = 0;
+            }
+        }
+
+        if (node_off < node->data_len)
+        {
+            /* out of room; leave the remainder at the head of the queue */
+            node->data     += node_off;
+            node->data_len -= node_off;
+            break;
+        }
+
+        /* the whole node was consumed */
+        if (!(pq->head = node->next))
+        {
+            assert(pq->tail == node);
+            pq->tail = NULL;
+        }
+
+        _mysock_free_node(node);
+
+        if (k == iovcnt || total == 0)
+            break;  /* out of room, or dequeued EOF */
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+    return total;
+}
+
+/* copy queued data into dst without dequeueing it, stopping at the end
+ * of the first occurrence of delim (if delim is non-NULL), at a zero-length
+ * node (EOF), or once max_len bytes have been copied.  the data may span
+ * several queued nodes.  if consume is TRUE, the copied bytes are then
+ * dequeued; EOF is never consumed here, so it is seen by the next
+ * myread().
+ *
+ * if block is TRUE, this waits until one of the above conditions holds (or,
+ * with delim NULL, until any data is available); otherwise it returns -1
+ * if it would have to wait.  returns the number of bytes copied, which is
+ * zero only at EOF.
+ */
+ssize_t _mysock_scan_buffer(mysock_context_t *ctx,
+                            packet_queue_t   *pq,
+                            void             *dst,
+                            size_t            max_len,
+                            const char       *delim,
+                            bool_t            consume,
+                            bool_t            block)
+{
+    size_t delim_len = delim ? strlen(delim) : 0;
+    size_t total;
+
+    assert(ctx && pq && dst && max_len > 0);
+    assert(!delim || delim_len > 0);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    for (;;)
+    {
+        packet_queue_node_t *node;
+        bool_t done = FALSE;
+
+        total = 0;
+        for (node = pq->head; node && !done; node = node->next)
+        {
+            size_t n = MIN(node->data_len, max_len - total);
+
+            assert(!node->from_file);
+            if (node->data_len == 0)
+            {
+                done = TRUE;    /* EOF */
+                break;
+            }
+
+            memcpy((char *) dst + total, node->data, n);
+
+            if (delim)
+            {
+                /* the delimiter may straddle the previous node */
+                size_t start = (total >= delim_len - 1)
+                    ? total - (delim_len - 1) : 0;
+                char *match = (char *) memmem((char *) dst + start,
+                                              total + n - start,
+                                              delim, delim_len);
+
+                if (match)
+                {
+                    n = (match + delim_len) - ((char *) dst + total);
+                    done = TRUE;
+                }
+            }
+
+            total += n;
+            if (total == max_len)
+                done = TRUE;
+        }
+
+        if (done || (total > 0 && !delim))
+            break;
+
+        if (!block)
+        {
+            PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+            return -1;
+        }
+
+        PTHREAD_CALL(pthread_cond_wait(&ctx->data_ready_cond,
+                                       &ctx->data_ready_lock));
+    }
+
+    if (consume)
+    {
+        size_t remaining = total;
+
+        while (remaining > 0)
+        {
+            packet_queue_node_t *node = pq->head;
+
+            assert(node && node->data_len > 0);
+            if (node->data_len > remaining)
+            {
+                node->data     += remaining;
+                node->data_len -= remaining;
+                break;
+            }
+
+            remaining -= node->data_len;
+            if (!(pq->head = node->next))
+            {
+                assert(pq->tail == node);
+                pq->tail = NULL;
+            }
+            _mysock_free_node(node);
+        }
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+    return total;
+}
+
 /* free any last buffers in the specified queue, discarding the contents.
  * this is called only when the mysocket context is being deallocated, so
  * there are no concerns about thread safety here.  returns TRUE if
@@ -246,8 +920,7 @@ static bool_t _mysock_free_queue(mysock_context_t *ctx, packet_queue_t *pq)
         if (node->data_len > 0)
             result = TRUE;
 
-        free(node->data);
-        free(node);
+        _mysock_free_node(node);
         node = next;
     }
 
@@ -255,6 +928,34 @@ static bool_t _mysock_free_queue(mysock_context_t *ctx, packet_queue_t *pq)
     return result;
 }
 
+/* drop a reference to a node that has been removed from its queue.  the
+ * node is freed along with its last reference.
+ */
+void _mysock_free_node(packet_queue_node_t *node)
+{
+    packet_queue_node_t *frag, *next;
+
+    assert(node);
+    assert(node->buf == (char *) (node + 1) && node->refcnt > 0);
+
+    if (__sync_sub_and_fetch(&node->refcnt, 1) > 0)
+        return;
+
+    if (node->from_file)
+        close(node->file_fd);
+
+    frag = node->frag_list;
+    memset(node, 0, sizeof(*node));
+    free(node);
+
+    for (; frag; frag = next)
+    {
+        next = frag->next;
+        frag->next = NULL;
+        _mysock_free_node(frag);
+    }
+}
+
 /* allocate a new connection context.  this keeps track of the working state
  * between the transport and network layers for a particular connection.  the
  * context is subsequently freed on the network layer's exit.
@@ -308,6 +1009,9 @@ void _mysock_free_context(mysock_context_t *ctx)
 
     assert(ctx);
 
+    /* drop any packets still held by the network emulator */
+    _network_emu_forget(ctx);
+
     PTHREAD_CALL(pthread_cond_destroy(&ctx->blocking_cond));
     PTHREAD_CALL(pthread_mutex_destroy(&ctx->blocking_lock));
 
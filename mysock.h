@@ -13,6 +13,8 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <fcntl.h>
 
 
 #ifndef FALSE
@@ -43,11 +45,89 @@ extern int myaccept(mysocket_t sd, struct sockaddr* addr, int *addrlen);
 extern int myclose(mysocket_t sd);
 extern int myread(mysocket_t sd, void *buffer, size_t length);
 extern int mywrite(mysocket_t sd, const void *buffer, size_t length);
+
+/* vectored versions of myread() and mywrite().  mywritev() gathers the
+ * iovec as if it were a single buffer; myreadv() may return data from
+ * several mywrite() calls by the peer.
+ */
+extern int myreadv(mysocket_t sd, const struct iovec *iov, int iovcnt);
+extern int mywritev(mysocket_t sd, const struct iovec *iov, int iovcnt);
+
+/* buffered reads.  mypeek() returns queued data without consuming it,
+ * blocking only until some data (or EOF) is available.  myreadline()
+ * consumes and returns one line, including its terminating "\r\n", as a
+ * NUL-terminated string; the line is truncated to length - 1 bytes, and
+ * may be unterminated at EOF.  both return 0 at EOF.
+ */
+extern int mypeek(mysocket_t sd, void *buffer, size_t length);
+extern int myreadline(mysocket_t sd, char *buffer, size_t length);
+
+/* zero-copy read.  myrecv_zc() points *data at the next queued buffer
+ * received from the peer, and returns its length (0 at EOF, with *data
+ * and *handle set to NULL).  the buffer remains valid until it's returned
+ * with myrecv_zc_release(sd, *handle), which must be done before the
+ * mysocket is closed.  it may be mixed freely with the other read calls.
+ */
+extern int myrecv_zc(mysocket_t sd, const void **data, void **handle);
+extern int myrecv_zc_release(mysocket_t sd, void *handle);
+
+/* send count bytes of the (regular) file fd, starting at offset, without
+ * copying them through an application buffer.  the data is read from the
+ * file as the transport layer sends it, so the file contents should not
+ * change in the meantime; fd may be closed as soon as this returns.
+ * returns the number of bytes queued, which is less than count if the
+ * file is shorter.
+ */
+extern ssize_t mysendfile(mysocket_t sd, int fd, off_t offset, size_t count);
 extern int mygetsockname(mysocket_t sd, struct sockaddr *addr,
                          socklen_t *addrlen);
 extern int mygetpeername(mysocket_t sd, struct sockaddr *addr,
                          socklen_t *addrlen);
 
+/* like fcntl(), but only F_GETFL and F_SETFL are supported, and O_NONBLOCK
+ * is the only recognised flag.  on a non-blocking mysocket, myread() and
+ * myaccept() fail with EAGAIN instead of blocking, and myconnect() fails
+ * with EINPROGRESS; the connection is complete once the mysocket is
+ * reported writable by myepoll_wait().
+ */
+extern int myfcntl(mysocket_t sd, int cmd, ...);
+
+
+/* readiness notification, modelled after epoll(7).  events are
+ * level-triggered:  a mysocket is reported for as long as it remains ready.
+ */
+#define MYEPOLLIN   0x001   /* myread() or myaccept() won't block */
+#define MYEPOLLOUT  0x004   /* connection established, mywrite() allowed */
+#define MYEPOLLERR  0x008   /* connection attempt failed */
+
+#define MYEPOLL_CTL_ADD 1
+#define MYEPOLL_CTL_DEL 2
+#define MYEPOLL_CTL_MOD 3
+
+struct myepoll_event
+{
+    uint32_t   events;  /* MYEPOLLIN, MYEPOLLOUT, MYEPOLLERR */
+    mysocket_t sd;      /* filled in by myepoll_wait() */
+    void      *data;    /* user data, returned verbatim by myepoll_wait() */
+};
+
+struct mypollfd
+{
+    mysocket_t sd;
+    uint32_t   events;  /* requested events */
+    uint32_t   revents; /* returned events */
+};
+
+extern int myepoll_create();
+extern int myepoll_ctl(int epd, int op, mysocket_t sd,
+                       struct myepoll_event *event);
+/* timeout is in milliseconds; -1 blocks indefinitely */
+extern int myepoll_wait(int epd, struct myepoll_event *events,
+                        int max_events, int timeout);
+extern int myepoll_close(int epd);
+
+extern int mypoll(struct mypollfd *fds, unsigned int nfds, int timeout);
+
 /* return IP address of interface on which packets to/from peer_addr are
  * delivered.  peer_addr is in network byte order.
  */
@@ -1,10 +1,13 @@
 /* mysock_api.c--application interface to the mysocket layer */
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <assert.h>
 #include <unistd.h>
+#include <limits.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -12,13 +15,8 @@
 #include "mysock_impl.h"
 #include "network_io.h"
 #include "connection_demux.h"
-
-
-/* MYSOCK_CHECK(cond,rc) checks that 'cond' is true; if it isn't, error
- * 'rc' is indicated to the caller.
- */
-#define MYSOCK_ERROR_EXIT(rc) { errno = rc; return -1; }
-#define MYSOCK_CHECK(cond,rc)   { if (!(cond)) MYSOCK_ERROR_EXIT(rc); }
+#include "mysock_epoll.h"
+#include "transport.h"  /* STCP_HEADROOM */
 
 
 /* create a new mysocket; returns the corresponding mysocket descriptor */
@@ -49,6 +47,16 @@ int myconnect(mysocket_t sd, struct sockaddr *name, int namelen)
     mysock_context_t *ctx = _mysock_get_context(sd);
 
     MYSOCK_CHECK(ctx != NULL, EINVAL);
+
+    if (ctx->nonblocking && ctx->transport_thread_started && ctx->is_active)
+    {
+        /* repeated myconnect() on a non-blocking mysocket reports the
+         * outcome of the original connection attempt.
+         */
+        MYSOCK_CHECK(!_mysock_is_connecting(ctx), EALREADY);
+        return _mysock_wait_for_connection(ctx);
+    }
+
     MYSOCK_CHECK((ctx->network_state.peer_addr_len == 0), EISCONN);
 
 #ifdef DEBUG
@@ -58,9 +66,7 @@ int myconnect(mysocket_t sd, struct sockaddr *name, int namelen)
     fflush(stderr);
 #endif  /*DEBUG*/
 
-    ctx->network_state.peer_addr       = *name;
-    ctx->network_state.peer_addr_len   = namelen;
-    ctx->network_state.peer_addr_valid = TRUE;
+    _network_set_peer_addr(&ctx->network_state, name, namelen);
 
     /* record connection setup for demultiplexing */
     if (!ctx->bound)
@@ -80,6 +86,9 @@ int myconnect(mysocket_t sd, struct sockaddr *name, int namelen)
     /* time for kick off */
     _mysock_transport_init(sd, TRUE);
 
+    /* completion is signaled to myepoll_wait() callers as MYEPOLLOUT */
+    MYSOCK_CHECK(!ctx->nonblocking, EINPROGRESS);
+
     /* block until connection is established, or we hit an error */
     return _mysock_wait_for_connection(ctx);
 }
@@ -91,6 +100,8 @@ mysocket_t myaccept(mysocket_t sd, struct sockaddr *addr, int *addrlen)
 
     MYSOCK_CHECK(accept_ctx != NULL, EBADF);
     MYSOCK_CHECK(accept_ctx->listening, EINVAL);
+    MYSOCK_CHECK(!accept_ctx->nonblocking ||
+                 _mysock_has_completed_connection(accept_ctx), EAGAIN);
 
 #ifdef DEBUG
     fprintf(stderr, "\n####Accepting a new connection at port# %hu#### "
@@ -165,6 +176,9 @@ int myclose(mysocket_t sd)
     DEBUG_LOG(("***myclose(%d)***\n", sd));
     MYSOCK_CHECK(ctx != NULL, EBADF);
 
+    /* the descriptor may be reused as soon as we return */
+    _mysock_epoll_forget(ctx);
+
     /* stcp_wait_for_event() needs to wake up on a socket close request */
     PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
     ctx->close_requested = TRUE;
@@ -198,12 +212,18 @@ int myclose(mysocket_t sd)
 int mywrite(mysocket_t sd, const void *buf, size_t buf_len)
 {
     mysock_context_t *ctx = _mysock_get_context(sd);
+    struct iovec iov;
 
     MYSOCK_CHECK(ctx != NULL, EBADF);
     MYSOCK_CHECK(!ctx->listening, EINVAL);
 
+    iov.iov_base = (void *) buf;
+    iov.iov_len  = buf_len;
+
+    /* queued ready for STCP to send, without any further copies */
     assert(!ctx->close_requested);
-    _mysock_enqueue_buffer(ctx, &ctx->app_recv_queue, buf, buf_len);
+    _mysock_enqueue_segments(ctx, &ctx->app_recv_queue, &iov, 1,
+                             STCP_HEADROOM, STCP_MAX_PAYLOAD);
 
     /* XXX: all bytes are queued, irrespective of current sender window */
     return buf_len;
@@ -222,6 +242,9 @@ int myread(mysocket_t sd, void *buf, size_t buf_len)
     if (ctx->eof)
         return 0;
 
+    MYSOCK_CHECK(!ctx->nonblocking ||
+                 !_mysock_queue_empty(ctx, &ctx->app_send_queue), EAGAIN);
+
     if ((len = _mysock_dequeue_buffer(ctx, &ctx->app_send_queue,
                                       buf, buf_len, TRUE)) == 0)
     {
@@ -232,6 +255,202 @@ int myread(mysocket_t sd, void *buf, size_t buf_len)
     return len;
 }
 
+int mywritev(mysocket_t sd, const struct iovec *iov, int iovcnt)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    size_t total = 0;
+    int k;
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(!ctx->listening, EINVAL);
+    MYSOCK_CHECK(iov != NULL || iovcnt == 0, EFAULT);
+    MYSOCK_CHECK(iovcnt >= 0 && iovcnt <= IOV_MAX, EINVAL);
+
+    for (k = 0; k < iovcnt; ++k)
+        total += iov[k].iov_len;
+
+    assert(!ctx->close_requested);
+    _mysock_enqueue_segments(ctx, &ctx->app_recv_queue, iov, iovcnt,
+                             STCP_HEADROOM, STCP_MAX_PAYLOAD);
+
+    /* XXX: all bytes are queued, irrespective of current sender window */
+    return total;
+}
+
+ssize_t mysendfile(mysocket_t sd, int fd, off_t offset, size_t count)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    struct stat st;
+    int file_fd;
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(!ctx->listening, EINVAL);
+    MYSOCK_CHECK(fd >= 0 && fstat(fd, &st) == 0, EBADF);
+    MYSOCK_CHECK(S_ISREG(st.st_mode) && offset >= 0, EINVAL);
+
+    if (offset >= st.st_size)
+        return 0;
+    count = MIN(count, (size_t) (st.st_size - offset));
+    if (count == 0)
+        return 0;
+
+    /* the queue keeps its own descriptor, as the data is only read once
+     * STCP gets around to sending it.
+     */
+    MYSOCK_CHECK((file_fd = dup(fd)) >= 0, errno);
+
+    assert(!ctx->close_requested);
+    _mysock_enqueue_file(ctx, &ctx->app_recv_queue, file_fd, offset, count);
+    return count;
+}
+
+int myreadv(mysocket_t sd, const struct iovec *iov, int iovcnt)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    size_t total = 0;
+    int len, k;
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(!ctx->listening, EINVAL);
+    MYSOCK_CHECK(iov != NULL, EFAULT);
+    MYSOCK_CHECK(iovcnt > 0 && iovcnt <= IOV_MAX, EINVAL);
+
+    assert(!ctx->close_requested);
+
+    for (k = 0; k < iovcnt; ++k)
+        total += iov[k].iov_len;
+
+    /* as with readv(), asking for nothing reads nothing (and isn't EOF) */
+    if (ctx->eof || total == 0)
+        return 0;
+
+    MYSOCK_CHECK(!ctx->nonblocking ||
+                 !_mysock_queue_empty(ctx, &ctx->app_send_queue), EAGAIN);
+
+    if ((len = _mysock_dequeue_buffer_v(ctx, &ctx->app_send_queue,
+                                        iov, iovcnt)) == 0)
+    {
+        /* make sure repeated calls to myreadv() return 0 on EOF */
+        ctx->eof = TRUE;
+    }
+
+    return len;
+}
+
+int mypeek(mysocket_t sd, void *buf, size_t buf_len)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    int len;
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(!ctx->listening, EINVAL);
+    MYSOCK_CHECK(buf != NULL, EFAULT);
+
+    if (ctx->eof || buf_len == 0)
+        return 0;
+
+    if ((len = _mysock_scan_buffer(ctx, &ctx->app_send_queue, buf, buf_len,
+                                   NULL, FALSE, !ctx->nonblocking)) < 0)
+    {
+        MYSOCK_ERROR_EXIT(EAGAIN);
+    }
+
+    return len;
+}
+
+int myreadline(mysocket_t sd, char *buf, size_t buf_len)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    int len;
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(!ctx->listening, EINVAL);
+    MYSOCK_CHECK(buf != NULL, EFAULT);
+    MYSOCK_CHECK(buf_len > 0, EINVAL);
+
+    *buf = '\0';
+    if (ctx->eof || buf_len == 1)
+        return 0;
+
+    /* the line is searched for in place, amongst the queued buffers */
+    if ((len = _mysock_scan_buffer(ctx, &ctx->app_send_queue,
+                                   buf, buf_len - 1, "\r\n",
+                                   TRUE, !ctx->nonblocking)) < 0)
+    {
+        MYSOCK_ERROR_EXIT(EAGAIN);
+    }
+
+    buf[len] = '\0';
+    return len;
+}
+
+int myrecv_zc(mysocket_t sd, const void **data, void **handle)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    packet_queue_node_t *node;
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(!ctx->listening, EINVAL);
+    MYSOCK_CHECK(data != NULL && handle != NULL, EFAULT);
+
+    *data = *handle = NULL;
+    if (ctx->eof)
+        return 0;
+
+    MYSOCK_CHECK(!ctx->nonblocking ||
+                 !_mysock_queue_empty(ctx, &ctx->app_send_queue), EAGAIN);
+
+    /* the application gets the queued buffer itself */
+    node = _mysock_dequeue_node(ctx, &ctx->app_send_queue);
+    if (node->data_len == 0)
+    {
+        /* make sure repeated calls to myrecv_zc() return 0 on EOF */
+        _mysock_free_node(node);
+        ctx->eof = TRUE;
+        return 0;
+    }
+
+    *data   = node->data;
+    *handle = node;
+    return (int) node->data_len;
+}
+
+int myrecv_zc_release(mysocket_t sd, void *handle)
+{
+    MYSOCK_CHECK(_mysock_get_context(sd) != NULL, EBADF);
+
+    if (handle)
+        _mysock_free_node((packet_queue_node_t *) handle);
+    return 0;
+}
+
+/* only O_NONBLOCK may be changed; see mysock.h */
+int myfcntl(mysocket_t sd, int cmd, ...)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    va_list argptr;
+    int flags;
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+
+    switch (cmd)
+    {
+    case F_GETFL:
+        return O_RDWR | (ctx->nonblocking ? O_NONBLOCK : 0);
+
+    case F_SETFL:
+        va_start(argptr, cmd);
+        flags = va_arg(argptr, int);
+        va_end(argptr);
+
+        ctx->nonblocking = (flags & O_NONBLOCK) ? TRUE : FALSE;
+        return 0;
+
+    default:
+        MYSOCK_ERROR_EXIT(EINVAL);
+    }
+}
+
 /* fills in addr with current port associated with the mysocket descriptor.
  * like the regular getsockname(), this does not fill in the local IP
  * address unless it's known.
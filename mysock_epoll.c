@@ -0,0 +1,451 @@
+/* mysock_epoll.c--readiness notification for non-blocking mysockets */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include "mysock.h"
+#include "mysock_impl.h"
+#include "connection_demux.h"
+#include "mysock_epoll.h"
+
+
+/* maximum number of myepoll instances per process */
+#define MAX_NUM_EPOLL_INSTANCES MAX_NUM_CONNECTIONS
+
+
+/* per-mysocket state maintained by a myepoll instance */
+typedef struct
+{
+    bool_t   registered;
+    uint32_t events;    /* events of interest */
+    void    *data;      /* user data */
+
+    /* set when the mysocket may have become ready; the mysocket's readiness
+     * is (re-)evaluated by the next myepoll_wait() only if this is set.
+     */
+    bool_t   pending;
+} epoll_interest_t;
+
+typedef struct
+{
+    pthread_mutex_t  lock;
+    pthread_cond_t   cond;      /* signaled on any notification */
+    unsigned int     notify_seq;
+    epoll_interest_t interest[MAX_NUM_CONNECTIONS]; /* indexed by mysocket */
+} epoll_instance_t;
+
+
+/* myepoll descriptor table.  epoll_table_lock is held for reading while
+ * notifying or evaluating readiness, and for writing while adding or
+ * removing mysockets; so a registered mysocket can't be freed while
+ * myepoll_wait() is looking at it.
+ *
+ * lock ordering:  epoll_table_lock, then the instance lock or the mysocket
+ * locks (never both at once).
+ */
+static epoll_instance_t *epoll_table[MAX_NUM_EPOLL_INSTANCES];
+static pthread_rwlock_t  epoll_table_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static epoll_instance_t *_epoll_get_instance(int epd);
+static uint32_t _epoll_get_events(mysock_context_t *ctx);
+
+
+/* create a new myepoll instance; returns the corresponding descriptor */
+int myepoll_create()
+{
+    epoll_instance_t *ep;
+    int k;
+
+    ep = (epoll_instance_t *) calloc(1, sizeof(epoll_instance_t));
+    MYSOCK_CHECK(ep != NULL, ENOMEM);
+
+    PTHREAD_CALL(pthread_mutex_init(&ep->lock, NULL));
+    PTHREAD_CALL(pthread_cond_init(&ep->cond, NULL));
+
+    PTHREAD_CALL(pthread_rwlock_wrlock(&epoll_table_lock));
+    for (k = 0; k < MAX_NUM_EPOLL_INSTANCES; ++k)
+    {
+        if (!epoll_table[k])
+        {
+            epoll_table[k] = ep;
+            break;
+        }
+    }
+    PTHREAD_CALL(pthread_rwlock_unlock(&epoll_table_lock));
+
+    if (k == MAX_NUM_EPOLL_INSTANCES)
+    {
+        PTHREAD_CALL(pthread_cond_destroy(&ep->cond));
+        PTHREAD_CALL(pthread_mutex_destroy(&ep->lock));
+        free(ep);
+        MYSOCK_ERROR_EXIT(EMFILE);
+    }
+
+    return k;
+}
+
+/* add, modify, or remove interest in the given mysocket */
+int myepoll_ctl(int epd, int op, mysocket_t sd, struct myepoll_event *event)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    epoll_instance_t *ep;
+    epoll_interest_t *e;
+    int rc = 0;
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(op == MYEPOLL_CTL_DEL || event != NULL, EFAULT);
+
+    PTHREAD_CALL(pthread_rwlock_wrlock(&epoll_table_lock));
+    if (!(ep = _epoll_get_instance(epd)))
+    {
+        PTHREAD_CALL(pthread_rwlock_unlock(&epoll_table_lock));
+        MYSOCK_ERROR_EXIT(EBADF);
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&ep->lock));
+    e = &ep->interest[sd];
+    switch (op)
+    {
+    case MYEPOLL_CTL_ADD:
+        if (e->registered)
+        {
+            rc = EEXIST;
+            break;
+        }
+        e->registered = TRUE;
+        ++ctx->epoll_refs;
+        /* fall through */
+
+    case MYEPOLL_CTL_MOD:
+        if (!e->registered)
+        {
+            rc = ENOENT;
+            break;
+        }
+        e->events  = event->events;
+        e->data    = event->data;
+        e->pending = TRUE;  /* the mysocket may be ready already */
+        ++ep->notify_seq;
+        break;
+
+    case MYEPOLL_CTL_DEL:
+        if (!e->registered)
+        {
+            rc = ENOENT;
+            break;
+        }
+        assert(ctx->epoll_refs > 0);
+        --ctx->epoll_refs;
+        memset(e, 0, sizeof(*e));
+        break;
+
+    default:
+        rc = EINVAL;
+        break;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ep->lock));
+    PTHREAD_CALL(pthread_cond_broadcast(&ep->cond));
+    PTHREAD_CALL(pthread_rwlock_unlock(&epoll_table_lock));
+
+    MYSOCK_CHECK(rc == 0, rc);
+    return 0;
+}
+
+/* wait for at least one of the mysockets in the given instance to become
+ * ready, or for the timeout (in milliseconds) to expire.  returns the
+ * number of events filled in, or 0 on timeout.
+ *
+ * myepoll_close() must not be called on the instance while another thread
+ * is blocked here.
+ */
+int myepoll_wait(int epd, struct myepoll_event *events,
+                 int max_events, int timeout)
+{
+    struct timespec abstime;
+    int num_events = 0;
+
+    MYSOCK_CHECK(events != NULL, EFAULT);
+    MYSOCK_CHECK(max_events > 0, EINVAL);
+
+    if (timeout > 0)
+    {
+        struct timeval now;
+
+        gettimeofday(&now, NULL);
+        abstime.tv_sec  = now.tv_sec + timeout / 1000;
+        abstime.tv_nsec = now.tv_usec * 1000 + (timeout % 1000) * 1000000;
+        abstime.tv_sec += abstime.tv_nsec / 1000000000;
+        abstime.tv_nsec %= 1000000000;
+    }
+
+    for (;;)
+    {
+        mysocket_t   pending_sd[MAX_NUM_CONNECTIONS];
+        uint32_t     pending_events[MAX_NUM_CONNECTIONS];
+        unsigned int num_pending = 0, seq, k;
+        epoll_instance_t *ep;
+
+        PTHREAD_CALL(pthread_rwlock_rdlock(&epoll_table_lock));
+        if (!(ep = _epoll_get_instance(epd)))
+        {
+            PTHREAD_CALL(pthread_rwlock_unlock(&epoll_table_lock));
+            MYSOCK_ERROR_EXIT(EBADF);
+        }
+
+        /* grab the mysockets with outstanding notifications */
+        PTHREAD_CALL(pthread_mutex_lock(&ep->lock));
+        for (k = 0; k < MAX_NUM_CONNECTIONS; ++k)
+        {
+            epoll_interest_t *e = &ep->interest[k];
+
+            if (e->registered && e->pending)
+            {
+                e->pending = FALSE;
+                pending_sd[num_pending++] = k;
+            }
+        }
+        seq = ep->notify_seq;
+        PTHREAD_CALL(pthread_mutex_unlock(&ep->lock));
+
+        /* evaluate their readiness without the instance lock held, as this
+         * needs the mysocket (and connection queue) locks.
+         */
+        for (k = 0; k < num_pending; ++k)
+        {
+            pending_events[k] =
+                _epoll_get_events(_mysock_get_context(pending_sd[k]));
+        }
+
+        PTHREAD_CALL(pthread_mutex_lock(&ep->lock));
+        for (k = 0; k < num_pending; ++k)
+        {
+            epoll_interest_t *e = &ep->interest[pending_sd[k]];
+            uint32_t ready;
+
+            if (!e->registered)
+                continue;
+
+            ready = pending_events[k] & (e->events | MYEPOLLERR);
+            if (!ready)
+                continue;
+
+            /* level-triggered:  check the mysocket again next time */
+            e->pending = TRUE;
+
+            if (num_events < max_events)
+            {
+                events[num_events].events = ready;
+                events[num_events].sd     = pending_sd[k];
+                events[num_events].data   = e->data;
+                ++num_events;
+            }
+        }
+
+        if (num_events > 0 || timeout == 0)
+        {
+            PTHREAD_CALL(pthread_mutex_unlock(&ep->lock));
+            PTHREAD_CALL(pthread_rwlock_unlock(&epoll_table_lock));
+            break;
+        }
+
+        /* nothing ready; block until the next notification */
+        PTHREAD_CALL(pthread_rwlock_unlock(&epoll_table_lock));
+        while (seq == ep->notify_seq)
+        {
+            if (timeout < 0)
+            {
+                PTHREAD_CALL(pthread_cond_wait(&ep->cond, &ep->lock));
+            }
+            else if (pthread_cond_timedwait(&ep->cond, &ep->lock,
+                                            &abstime) == ETIMEDOUT)
+            {
+                timeout = 0;    /* make one last pass */
+                break;
+            }
+        }
+        PTHREAD_CALL(pthread_mutex_unlock(&ep->lock));
+    }
+
+    return num_events;
+}
+
+/* destroy a myepoll instance */
+int myepoll_close(int epd)
+{
+    epoll_instance_t *ep;
+    int k;
+
+    PTHREAD_CALL(pthread_rwlock_wrlock(&epoll_table_lock));
+    if (!(ep = _epoll_get_instance(epd)))
+    {
+        PTHREAD_CALL(pthread_rwlock_unlock(&epoll_table_lock));
+        MYSOCK_ERROR_EXIT(EBADF);
+    }
+
+    for (k = 0; k < MAX_NUM_CONNECTIONS; ++k)
+    {
+        if (ep->interest[k].registered)
+        {
+            mysock_context_t *ctx = _mysock_get_context(k);
+
+            assert(ctx && ctx->epoll_refs > 0);
+            --ctx->epoll_refs;
+        }
+    }
+    epoll_table[epd] = NULL;
+    PTHREAD_CALL(pthread_rwlock_unlock(&epoll_table_lock));
+
+    PTHREAD_CALL(pthread_cond_destroy(&ep->cond));
+    PTHREAD_CALL(pthread_mutex_destroy(&ep->lock));
+    memset(ep, 0, sizeof(*ep));
+    free(ep);
+    return 0;
+}
+
+/* poll(2) equivalent, implemented with a temporary myepoll instance.
+ * returns the number of mysockets with non-zero revents.
+ */
+int mypoll(struct mypollfd *fds, unsigned int nfds, int timeout)
+{
+    struct myepoll_event events[MAX_NUM_CONNECTIONS];
+    unsigned int k;
+    int epd, num_events, rc = 0;
+
+    MYSOCK_CHECK(fds != NULL || nfds == 0, EFAULT);
+    MYSOCK_CHECK(nfds <= MAX_NUM_CONNECTIONS, EINVAL);
+
+    if ((epd = myepoll_create()) < 0)
+        return -1;
+
+    for (k = 0; k < nfds; ++k)
+    {
+        struct myepoll_event ev;
+
+        ev.events = fds[k].events;
+        ev.sd     = fds[k].sd;
+        ev.data   = &fds[k];
+
+        fds[k].revents = 0;
+        if (myepoll_ctl(epd, MYEPOLL_CTL_ADD, fds[k].sd, &ev) < 0)
+        {
+            int saved_errno = errno;
+
+            (void) myepoll_close(epd);
+            MYSOCK_ERROR_EXIT(saved_errno);
+        }
+    }
+
+    if ((num_events = myepoll_wait(epd, events, ARRAY_DIM(events),
+                                   timeout)) < 0)
+    {
+        rc = -1;
+    }
+    else
+    {
+        int i;
+
+        for (i = 0; i < num_events; ++i)
+            ((struct mypollfd *) events[i].data)->revents = events[i].events;
+        rc = num_events;
+    }
+
+    (void) myepoll_close(epd);
+    return rc;
+}
+
+/* wake up any myepoll_wait() callers interested in the given mysocket */
+void _mysock_epoll_notify(mysock_context_t *ctx)
+{
+    int k;
+
+    assert(ctx);
+
+    /* fast path for the (common) case of a blocking mysocket.  epoll_refs
+     * only changes while the application is adding/removing the mysocket,
+     * so a stale read here is harmless:  the ADD marks the mysocket pending
+     * anyway.
+     */
+    if (!ctx->epoll_refs)
+        return;
+
+    PTHREAD_CALL(pthread_rwlock_rdlock(&epoll_table_lock));
+    for (k = 0; k < MAX_NUM_EPOLL_INSTANCES; ++k)
+    {
+        epoll_instance_t *ep = epoll_table[k];
+
+        if (!ep)
+            continue;
+
+        PTHREAD_CALL(pthread_mutex_lock(&ep->lock));
+        if (ep->interest[ctx->my_sd].registered)
+        {
+            ep->interest[ctx->my_sd].pending = TRUE;
+            ++ep->notify_seq;
+            PTHREAD_CALL(pthread_cond_broadcast(&ep->cond));
+        }
+        PTHREAD_CALL(pthread_mutex_unlock(&ep->lock));
+    }
+    PTHREAD_CALL(pthread_rwlock_unlock(&epoll_table_lock));
+}
+
+void _mysock_epoll_forget(mysock_context_t *ctx)
+{
+    int k;
+
+    assert(ctx);
+
+    /* N.B. this must not take epoll_table_lock for mysockets that were never
+     * registered, as _mysock_close_passive_socket() closes pending
+     * connections with the listen table locked.
+     */
+    if (!ctx->epoll_refs)
+        return;
+
+    PTHREAD_CALL(pthread_rwlock_wrlock(&epoll_table_lock));
+    for (k = 0; k < MAX_NUM_EPOLL_INSTANCES; ++k)
+    {
+        epoll_instance_t *ep = epoll_table[k];
+
+        if (ep && ep->interest[ctx->my_sd].registered)
+        {
+            memset(&ep->interest[ctx->my_sd], 0, sizeof(epoll_interest_t));
+            --ctx->epoll_refs;
+        }
+    }
+    assert(!ctx->epoll_refs);
+    PTHREAD_CALL(pthread_rwlock_unlock(&epoll_table_lock));
+}
+
+
+/* assumes calling code has locked the myepoll descriptor table */
+static epoll_instance_t *_epoll_get_instance(int epd)
+{
+    return (epd >= 0 && epd < MAX_NUM_EPOLL_INSTANCES)
+        ? epoll_table[epd] : NULL;
+}
+
+/* returns the events for which the given mysocket is currently ready */
+static uint32_t _epoll_get_events(mysock_context_t *ctx)
+{
+    uint32_t events = 0;
+
+    assert(ctx);
+
+    if (ctx->listening)
+        return _mysock_has_completed_connection(ctx) ? MYEPOLLIN : 0;
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->blocking_lock));
+    if (!ctx->blocking)
+        events |= (ctx->stcp_errno) ? MYEPOLLERR : MYEPOLLOUT;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->blocking_lock));
+
+    /* data waiting for myread(), or end-of-file */
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    if (ctx->app_send_queue.head || ctx->eof)
+        events |= MYEPOLLIN;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+    return events;
+}
@@ -0,0 +1,19 @@
+/* mysock_epoll.h--readiness notification for non-blocking mysockets.
+ * this is an internal header, used only by the mysocket layer.
+ */
+
+#ifndef __MYSOCK_EPOLL_H__
+#define __MYSOCK_EPOLL_H__
+
+struct mysock_context;
+
+/* called whenever a mysocket may have become readable or writable, e.g.
+ * when data is queued for the application or the connection completes.
+ * this must not be called with any of the mysocket's locks held.
+ */
+void _mysock_epoll_notify(struct mysock_context *ctx);
+
+/* called by myclose() to remove the mysocket from any myepoll instances */
+void _mysock_epoll_forget(struct mysock_context *ctx);
+
+#endif  /* __MYSOCK_EPOLL_H__ */
@@ -12,6 +12,7 @@
 #include <errno.h>
 #include <assert.h>
 #include <pthread.h>
+#include <sys/uio.h>
 #include "mysock.h"
 #include "network_io.h"
 
@@ -40,6 +41,16 @@ static INLINE void _pthread_call(int pthread_retval)
     #define MIN(a,b)    ((a) < (b) ? (a) : (b))
 #endif
 
+#ifndef MAX
+    #define MAX(a,b)    ((a) > (b) ? (a) : (b))
+#endif
+
+/* MYSOCK_CHECK(cond,rc) checks that 'cond' is true; if it isn't, error
+ * 'rc' is indicated to the caller.
+ */
+#define MYSOCK_ERROR_EXIT(rc) { errno = rc; return -1; }
+#define MYSOCK_CHECK(cond,rc)   { if (!(cond)) MYSOCK_ERROR_EXIT(rc); }
+
 #ifdef DEBUG
     /* usage:  DEBUG_LOG((fmt string, args, ...)) */
     #define DEBUG_LOG(args) { printf args; fflush(stdout); }
@@ -48,11 +59,45 @@ static INLINE void _pthread_call(int pthread_retval)
 #endif
 
 
-/* packet/buffer queue */
+/* packet/buffer queue.  a node is also the buffer type passed between the
+ * layers:  it is reference counted, so that (e.g.) the transport layer can
+ * hold on to a segment it has sent while it awaits acknowledgement.
+ */
 typedef struct packet_queue_node
 {
-    char                     *data;
+    char                     *buf;      /* buffer, allocated with the node */
+    char                     *data;     /* unconsumed data, within buf */
     size_t                    data_len;
+    unsigned int              refcnt;
+
+    /* one's complement sum of the data, taken as it was copied into the
+     * node (see _mysock_node_csum_valid()).
+     */
+    uint32_t                  csum;
+    const char               *csum_data;
+    size_t                    csum_len;
+
+    /* header (with th_sum zeroed) and checksum last sent from this buffer
+     * by stcp_network_send_buf(), so a resend needs only an incremental
+     * checksum update.  sent_len is 0 if the buffer hasn't been sent.
+     */
+    uint16_t                  sent_header[10];  /* struct tcphdr */
+    uint16_t                  sent_sum;
+    size_t                    sent_len;
+
+    /* nodes queued by mysendfile() carry no data; data_len bytes are read
+     * from file_fd, starting at file_offset, as the node is dequeued.
+     */
+    bool_t                    from_file;
+    int                       file_fd;
+    off_t                     file_offset;
+
+    /* segments coalesced behind this one by stcp_network_recv_buf(), with
+     * their headers stripped and linked through next.  data_len only
+     * covers this node's own data.  they're freed along with the node.
+     */
+    struct packet_queue_node *frag_list;
+
     struct packet_queue_node *next;
 } packet_queue_node_t;
 
@@ -79,6 +124,7 @@ typedef struct mysock_context
     network_context_t network_state;
     bool_t            bound;        /* true if bound to a local address */
     bool_t            listening;    /* true if mysocket used for myaccept() */
+    bool_t            nonblocking;  /* O_NONBLOCK set with myfcntl()? */
 
     /* mysocket descriptor (index into our context table) */
     mysocket_t my_sd;
@@ -112,6 +158,9 @@ typedef struct mysock_context
     packet_queue_t  network_recv_queue; /* data coming from peer */
     packet_queue_t  app_send_queue; /* data to be passed up to app */
     packet_queue_t  app_recv_queue; /* data coming from app */
+
+    /* number of myepoll instances watching this mysocket */
+    unsigned int    epoll_refs;
 } mysock_context_t;
 
 
@@ -131,12 +180,99 @@ void _mysock_enqueue_buffer(mysock_context_t *ctx,
                             const void       *packet,
                             size_t            packet_len);
 
+void _mysock_enqueue_buffer_v(mysock_context_t   *ctx,
+                              packet_queue_t     *pq,
+                              const struct iovec *iov,
+                              int                 iovcnt);
+
+void _mysock_enqueue_segments(mysock_context_t   *ctx,
+                              packet_queue_t     *pq,
+                              const struct iovec *iov,
+                              int                 iovcnt,
+                              size_t              headroom,
+                              size_t              seg_len);
+
+void _mysock_enqueue_chain(mysock_context_t    *ctx,
+                           packet_queue_t      *pq,
+                           packet_queue_node_t *head);
+
+packet_queue_node_t *_mysock_alloc_node(size_t headroom, size_t len);
+
+packet_queue_node_t *_mysock_alloc_packet_node(const struct iovec *iov,
+                                               int                 iovcnt);
+
+void _mysock_hold_node(packet_queue_node_t *node);
+
+void _mysock_enqueue_node(mysock_context_t    *ctx,
+                          packet_queue_t      *pq,
+                          packet_queue_node_t *node);
+
+packet_queue_node_t *_mysock_dequeue_node(mysock_context_t *ctx,
+                                          packet_queue_t   *pq);
+
+packet_queue_node_t *_mysock_dequeue_node_if(mysock_context_t *ctx,
+                                             packet_queue_t   *pq,
+                                             bool_t (*accept)(
+                                                 const packet_queue_node_t *,
+                                                 void *),
+                                             void             *arg);
+
+packet_queue_node_t *_mysock_dequeue_chain(mysock_context_t *ctx,
+                                           packet_queue_t   *pq,
+                                           int               max_nodes,
+                                           int              *num_nodes);
+
+packet_queue_node_t *_mysock_dequeue_segment(mysock_context_t *ctx,
+                                             packet_queue_t   *pq,
+                                             size_t            headroom,
+                                             size_t            max_len);
+
+void _mysock_free_node(packet_queue_node_t *node);
+
+/* returns TRUE if csum is the sum of the node's (remaining) data */
+static INLINE bool_t _mysock_node_csum_valid(const packet_queue_node_t *node)
+{
+    return node->csum_data == node->data && node->csum_len == node->data_len;
+}
+
+/* map a buffer from _mysock_alloc_node() back to its node */
+static INLINE packet_queue_node_t *_mysock_buffer_node(void *buf)
+{
+    packet_queue_node_t *node = ((packet_queue_node_t *) buf) - 1;
+
+    assert(buf && node->buf == (char *) buf);
+    return node;
+}
+
+void _mysock_enqueue_file(mysock_context_t *ctx,
+                          packet_queue_t   *pq,
+                          int               fd,
+                          off_t             offset,
+                          size_t            len);
+
+bool_t _mysock_queue_empty(mysock_context_t *ctx, packet_queue_t *pq);
+
+bool_t _mysock_is_connecting(mysock_context_t *ctx);
+
 size_t _mysock_dequeue_buffer(mysock_context_t *ctx,
                               packet_queue_t   *pq,
                               void             *dst,
                               size_t            max_len,
                               bool_t            remove_partial);
 
+size_t _mysock_dequeue_buffer_v(mysock_context_t   *ctx,
+                                packet_queue_t     *pq,
+                                const struct iovec *iov,
+                                int                 iovcnt);
+
+ssize_t _mysock_scan_buffer(mysock_context_t *ctx,
+                            packet_queue_t   *pq,
+                            void             *dst,
+                            size_t            max_len,
+                            const char       *delim,
+                            bool_t            consume,
+                            bool_t            block);
+
 int _mysock_bind_ephemeral(mysock_context_t *ctx);
 
 pthread_t _mysock_create_thread(void *(*start)(void *args), void *args,                                         bool_t create_detached);
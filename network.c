@@ -14,10 +14,31 @@
 #include "network.h"
 #include "network_io.h"
 #include "transport.h"  /* for dprintf() */
+#include "tcp_sum.h"
 
 
 
 
+#ifdef RECV_COALESCE
+/* receive coalescing (see _network_coalesce()) is enabled by building with
+ * -DRECV_COALESCE.  a run stops after this many segments, or once the
+ * merged segment would be larger than the network layer's max_packet_len.
+ */
+#define COALESCE_MAX_SEGMENTS   64
+
+typedef struct
+{
+    struct tcphdr header;   /* merged header so far */
+    tcp_seq       next_seq; /* host byte order */
+    size_t        len;      /* merged segment length so far */
+    size_t        max_len;
+} coalesce_state_t;
+
+static size_t _network_coalesce(mysock_context_t *ctx,
+                                packet_queue_node_t *node);
+#endif
+
+
 /* helper function for stcp_network_send(); */
 int _network_send(mysocket_t sd, const void *buf, size_t len)
 {
@@ -30,6 +51,26 @@ int _network_send(mysocket_t sd, const void *buf, size_t len)
     return _network_send_packet(ctx, buf, len);
 }
 
+/* helper function for stcp_network_sendv() */
+int _network_sendv(mysocket_t sd, const struct iovec *iov, int iovcnt)
+{
+    mysock_context_t *sock_ctx = _mysock_get_context(sd);
+
+    assert(sock_ctx && iov);
+    return _network_send_packetv(&sock_ctx->network_state, iov, iovcnt);
+}
+
+/* helper function for stcp_network_send_gso() */
+int _network_sendv_packets(mysocket_t sd, const struct iovec *iov, int iovcnt,
+                           int num_packets)
+{
+    mysock_context_t *sock_ctx = _mysock_get_context(sd);
+
+    assert(sock_ctx && iov);
+    return _network_send_packets(&sock_ctx->network_state,
+                                 iov, iovcnt, num_packets);
+}
+
 /* helper function for stcp_network_recv() */
 int _network_recv(mysocket_t sd, void *dst, size_t max_len)
 {
@@ -37,9 +78,215 @@ int _network_recv(mysocket_t sd, void *dst, size_t max_len)
     mysock_context_t *ctx = _mysock_get_context(sd);
 
     assert(ctx && dst);
+
+    /* anything held back by the network layer must go out before we
+     * (potentially) block
+     */
+    (void) _network_flush(&ctx->network_state);
+
     len = _mysock_dequeue_buffer(ctx, &ctx->network_recv_queue,
                                  dst, max_len, FALSE);
 
     return len;
 }
 
+/* helper function for stcp_network_recv_buf().  rather than copying the
+ * packet out of the queue, the queued buffer itself is handed to the
+ * caller, who must release it with stcp_free_buf() (or pass it on with
+ * stcp_app_send_buf()).  *packet is set to NULL if nothing is returned.
+ */
+int _network_recv_buf(mysocket_t sd, void **packet)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    packet_queue_node_t *node;
+    int len;
+
+    assert(ctx && packet);
+
+    (void) _network_flush(&ctx->network_state);  /* as above */
+
+    node = _mysock_dequeue_node(ctx, &ctx->network_recv_queue);
+    assert(node->data == node->buf);    /* packets are never split */
+
+    if ((len = (int) node->data_len) == 0)
+    {
+        _mysock_free_node(node);
+        *packet = NULL;
+    }
+    else
+    {
+#ifdef RECV_COALESCE
+        len = (int) _network_coalesce(ctx, node);
+#endif
+        *packet = node->data;
+    }
+
+    return len;
+}
+
+/* helper function for stcp_network_recv_batch().  as _network_recv_buf(),
+ * but up to max_packets queued buffers are handed over at once, as they
+ * arrived (i.e. without coalescing).  returns the number of packets.
+ */
+int _network_recv_batch(mysocket_t sd, struct iovec *packets, int max_packets)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    packet_queue_node_t *node, *next;
+    int num_packets, k;
+
+    assert(ctx && packets && max_packets > 0);
+
+    (void) _network_flush(&ctx->network_state);  /* as above */
+
+    node = _mysock_dequeue_chain(ctx, &ctx->network_recv_queue,
+                                 max_packets, &num_packets);
+    for (k = 0; node; node = next, ++k)
+    {
+        next = node->next;
+        node->next = NULL;
+        assert(k < num_packets && node->data == node->buf);
+
+        if ((packets[k].iov_len = node->data_len) == 0)
+        {
+            _mysock_free_node(node);
+            packets[k].iov_base = NULL;
+        }
+        else
+        {
+            packets[k].iov_base = node->data;
+        }
+    }
+
+    return num_packets;
+}
+
+#ifdef RECV_COALESCE
+/* TRUE if the given data segment carries on where the merged run of
+ * segments in state leaves off, and can be added to it.  this is called
+ * with the receive queue locked.
+ */
+static bool_t _network_can_coalesce(const packet_queue_node_t *node,
+                                    void *arg)
+{
+    const coalesce_state_t *state = (const coalesce_state_t *) arg;
+    const struct tcphdr *header = (const struct tcphdr *) node->data;
+
+    return node->data == node->buf && !node->frag_list &&
+           node->data_len > sizeof(*header) &&
+           state->len + node->data_len - sizeof(*header) <= state->max_len &&
+           header->th_off == state->header.th_off &&
+           (header->th_flags & ~TH_PUSH) ==
+               (state->header.th_flags & ~TH_PUSH) &&
+           ntohl(header->th_seq) == state->next_seq;
+}
+
+/* receive coalescing (like GRO):  in-order data segments queued behind the
+ * given one are chained to it, as its frag_list, so that the transport
+ * layer processes them (and acknowledges them) once rather than once per
+ * packet.  nothing is copied:  each segment's header is stripped, and the
+ * given node's header is rewritten to cover the run, with the first
+ * segment's sequence number and the last one's acknowledgement and window.
+ * a TH_PUSH ends the run.  segments with options or with any flags other
+ * than TH_ACK and TH_PUSH are left alone.  returns the length of the
+ * merged segment.
+ */
+static size_t _network_coalesce(mysock_context_t *ctx,
+                                packet_queue_node_t *node)
+{
+    packet_queue_node_t *frag, **tail = &node->frag_list;
+    struct tcphdr *header = (struct tcphdr *) node->data;
+    coalesce_state_t state;
+    const size_t header_len = sizeof(struct tcphdr);
+    uint16_t old_len, new_len, th_sum;
+    uint32_t sum;
+    bool_t update_sum;
+    int num_run = 1;
+
+    assert(ctx && node && !node->frag_list);
+
+    if (node->data_len <= header_len)
+        return node->data_len;  /* not a data segment */
+
+    memcpy(&state.header, header, header_len);
+    if (TCP_DATA_START(&state.header) > header_len ||
+        (state.header.th_flags & ~TH_ACK))
+    {
+        return node->data_len;
+    }
+
+    state.len      = node->data_len;
+    state.next_seq = ntohl(state.header.th_seq) + state.len - header_len;
+    state.max_len  = _network_get_caps(&ctx->network_state)->max_packet_len;
+
+    /* th_sum is kept valid for the merged segment, unless it was never
+     * filled in (see network_io.h).  the sum of the data that's added to
+     * it is taken from each segment's own, computed as it was received.
+     */
+    update_sum = !_network_get_caps(&ctx->network_state)->csum_offload;
+    sum = (uint16_t) ~header->th_sum;
+
+    while (num_run < COALESCE_MAX_SEGMENTS &&
+           !(state.header.th_flags & TH_PUSH) &&
+           (frag = _mysock_dequeue_node_if(ctx, &ctx->network_recv_queue,
+                                           _network_can_coalesce,
+                                           &state)) != NULL)
+    {
+        const struct tcphdr *frag_header = (const struct tcphdr *) frag->data;
+        size_t len = frag->data_len - header_len;
+
+        if (update_sum)
+        {
+            uint32_t data_sum;
+
+            if (_mysock_node_csum_valid(frag))
+            {
+                data_sum = _mysock_csum_add(
+                    frag->csum,
+                    (uint16_t) ~_mysock_csum_partial(frag_header, header_len),
+                    0);
+            }
+            else
+            {
+                data_sum = _mysock_csum_partial(frag->data + header_len, len);
+            }
+
+            sum = _mysock_csum_add(sum, data_sum, state.len);
+        }
+
+        state.header.th_ack    = frag_header->th_ack;
+        state.header.th_win    = frag_header->th_win;
+        state.header.th_flags |= frag_header->th_flags;
+        state.len      += len;
+        state.next_seq += len;
+        ++num_run;
+
+        frag->data     += header_len;
+        frag->data_len  = len;
+        *tail = frag;
+        tail  = &frag->next;
+    }
+
+    if (num_run == 1)
+        return node->data_len;
+
+    if (update_sum)
+    {
+        /* the pseudo header's length changes along with the header.  th_sum
+         * itself is the same in both headers, so it's left out.
+         */
+        old_len = htons(node->data_len);
+        new_len = htons(state.len);
+        th_sum = _mysock_csum_update((uint16_t) ~sum, &old_len, &new_len,
+                                     sizeof(old_len));
+        th_sum = _mysock_csum_update(th_sum, header, &state.header,
+                                     header_len);
+        state.header.th_sum = th_sum;
+    }
+
+    memcpy(header, &state.header, header_len);
+    node->csum_data = NULL;     /* node->csum is no longer its header's */
+
+    return state.len;
+}
+#endif  /* RECV_COALESCE */
+
@@ -5,10 +5,16 @@
 #ifndef __NETWORK_H__
 #define __NETWORK_H__
 
+#include <sys/uio.h>
 #include "mysock.h"
 
 int _network_send(mysocket_t sd, const void *buf, size_t len);
+int _network_sendv(mysocket_t sd, const struct iovec *iov, int iovcnt);
+int _network_sendv_packets(mysocket_t sd, const struct iovec *iov, int iovcnt,
+                           int num_packets);
 int _network_recv(mysocket_t sd, void *dst, size_t max_len);
+int _network_recv_buf(mysocket_t sd, void **packet);
+int _network_recv_batch(mysocket_t sd, struct iovec *packets, int max_packets);
 
 #endif  /* __NETWORK_H__ */
 
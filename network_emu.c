@@ -0,0 +1,359 @@
+/* network_emu.c--network impairment emulation
+ *
+ * this sits between every network layer and the mysocket layer:  packets
+ * received from the peer are delayed, dropped, reordered or duplicated
+ * before they're queued for the transport layer (see _network_deliver()).
+ * as each side impairs what it receives, both directions are impaired if
+ * both peers enable emulation.  connection requests (SYNs on a listening
+ * mysocket) are not impaired.
+ *
+ * impairments are configured by the STCP_NETEM environment variable, a
+ * comma-separated list of any of:
+ *
+ *   delay=<ms>      fixed one-way delay
+ *   jitter=<ms>     delay varies uniformly by up to this much either way
+ *   loss=<%>        probability of dropping a packet
+ *   reorder=<%>     probability of a packet skipping the delay, so that it
+ *                   overtakes those before it (as with Linux netem)
+ *   dup=<%>         probability of delivering a packet twice
+ *   rate=<kbit/s>   token bucket bandwidth cap
+ *   burst=<bytes>   token bucket depth (default: two full-size packets)
+ *   seed=<n>        random seed
+ *
+ * e.g. STCP_NETEM="delay=50,jitter=10,loss=1,rate=10000".  each mysocket
+ * has its own random number generator, seeded from the given seed and the
+ * mysocket descriptor, so runs are repeatable.  EOF is never impaired, and
+ * is delivered after any packets still held.
+ *
+ * held packets are kept in a single list, ordered by release time, and
+ * queued by a dedicated thread as they come due.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
+#include "mysock_impl.h"
+#include "network_io.h"
+#include "network_emu.h"
+
+
+#ifndef MAX
+    #define MAX(a,b)    ((a) > (b) ? (a) : (b))
+#endif
+
+#define USEC_PER_SEC  1000000ULL
+#define USEC_PER_MSEC 1000ULL
+
+typedef struct
+{
+    bool_t   enabled;
+    uint64_t delay;         /* usec */
+    uint64_t jitter;        /* usec */
+    double   loss;          /* probabilities, 0..1 */
+    double   reorder;
+    double   duplicate;
+    double   rate;          /* bytes/usec; 0 if unlimited */
+    double   burst;         /* bytes */
+    unsigned int seed;
+} emu_config_t;
+
+/* a packet awaiting release */
+typedef struct emu_entry
+{
+    mysock_context_t    *ctx;
+    packet_queue_node_t *node;
+    uint64_t             release;   /* usec */
+    struct emu_entry    *next;
+} emu_entry_t;
+
+static emu_config_t emu_config;
+static pthread_once_t emu_once = PTHREAD_ONCE_INIT;
+
+static emu_entry_t *emu_list = NULL;   /* ordered by release time */
+static pthread_mutex_t emu_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t emu_cond = PTHREAD_COND_INITIALIZER;
+
+static void _emu_init(void);
+static uint64_t _emu_now(void);
+static double _emu_random(network_context_t *net_ctx);
+static void _emu_schedule(mysock_context_t *ctx, packet_queue_node_t *node,
+                          uint64_t release);
+static void *emu_thread_func(void *arg_ptr);
+
+
+bool_t _network_emu_enabled(void)
+{
+    PTHREAD_CALL(pthread_once(&emu_once, _emu_init));
+    return emu_config.enabled;
+}
+
+void _network_emu_deliver(mysock_context_t *ctx, packet_queue_node_t *node)
+{
+    network_context_t *net_ctx;
+    uint64_t now, release;
+    size_t len;
+
+    assert(ctx && node);
+    assert(emu_config.enabled);
+
+    net_ctx = &ctx->network_state;
+    len = node->data_len;
+
+    PTHREAD_CALL(pthread_mutex_lock(&emu_lock));
+    now = _emu_now();
+
+    if (!net_ctx->emu_seeded)
+    {
+        net_ctx->random_seed       = emu_config.seed + ctx->my_sd;
+        net_ctx->emu_bucket_time   = now;
+        net_ctx->emu_bucket_tokens = emu_config.burst;
+        net_ctx->emu_seeded        = TRUE;
+    }
+
+    if (len == 0)
+    {
+        /* EOF follows everything already on its way */
+        _emu_schedule(ctx, node, MAX(now, net_ctx->emu_last_release));
+        PTHREAD_CALL(pthread_mutex_unlock(&emu_lock));
+        return;
+    }
+
+    if (_emu_random(net_ctx) < emu_config.loss)
+    {
+        DEBUG_LOG(("network emulator: dropping packet (len=%u)\n",
+                   (unsigned) len));
+        _mysock_free_node(node);
+        PTHREAD_CALL(pthread_mutex_unlock(&emu_lock));
+        return;
+    }
+
+    /* token bucket:  packets leave in order, each once there are enough
+     * tokens for it.
+     */
+    release = MAX(now, net_ctx->emu_bucket_time);
+    if (emu_config.rate > 0)
+    {
+        double tokens = net_ctx->emu_bucket_tokens +
+            emu_config.rate * (double) (release - net_ctx->emu_bucket_time);
+
+        tokens = MIN(tokens, emu_config.burst);
+        if (tokens < (double) len)
+        {
+            release += (uint64_t) (((double) len - tokens) /
+                                   emu_config.rate + 0.5);
+            tokens = (double) len;
+        }
+
+        net_ctx->emu_bucket_tokens = tokens - (double) len;
+        net_ctx->emu_bucket_time   = release;
+    }
+
+    /* propagation delay, unless the packet is to jump the queue */
+    if (_emu_random(net_ctx) >= emu_config.reorder)
+    {
+        release += emu_config.delay;
+        if (emu_config.jitter > 0)
+        {
+            double offset = (2.0 * _emu_random(net_ctx) - 1.0) *
+                            (double) emu_config.jitter;
+
+            release = (offset < 0 && (uint64_t) -offset > release) ? 0 :
+                      (uint64_t) ((double) release + offset);
+            release = MAX(release, now);
+        }
+    }
+
+    if (_emu_random(net_ctx) < emu_config.duplicate)
+    {
+        struct iovec iov;
+
+        iov.iov_base = node->data;
+        iov.iov_len  = len;
+        _emu_schedule(ctx, _mysock_alloc_packet_node(&iov, 1), release);
+    }
+
+    _emu_schedule(ctx, node, release);
+    PTHREAD_CALL(pthread_mutex_unlock(&emu_lock));
+}
+
+void _network_emu_forget(mysock_context_t *ctx)
+{
+    emu_entry_t **prev;
+
+    assert(ctx);
+
+    if (!_network_emu_enabled())
+        return;
+
+    PTHREAD_CALL(pthread_mutex_lock(&emu_lock));
+    for (prev = &emu_list; *prev; )
+    {
+        emu_entry_t *entry = *prev;
+
+        if (entry->ctx == ctx)
+        {
+            *prev = entry->next;
+            _mysock_free_node(entry->node);
+            free(entry);
+        }
+        else
+        {
+            prev = &entry->next;
+        }
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&emu_lock));
+}
+
+
+/* parse STCP_NETEM, and start the release thread if it's needed */
+static void _emu_init(void)
+{
+    const char *config = getenv("STCP_NETEM");
+    char *copy, *item, *saveptr = NULL;
+    double rate_kbit = 0, burst = 0;
+
+    memset(&emu_config, 0, sizeof(emu_config));
+    if (!config || !*config)
+        return;
+
+    copy = strdup(config);
+    assert(copy);
+
+    for (item = strtok_r(copy, ",", &saveptr); item;
+         item = strtok_r(NULL, ",", &saveptr))
+    {
+        char *value = strchr(item, '=');
+        double v;
+
+        if (!value || sscanf(value + 1, "%lf", &v) != 1 || v < 0)
+        {
+            fprintf(stderr, "STCP_NETEM: ignoring '%s'\n", item);
+            continue;
+        }
+        *value = '\0';
+
+        if (!strcmp(item, "delay"))
+            emu_config.delay = (uint64_t) (v * USEC_PER_MSEC);
+        else if (!strcmp(item, "jitter"))
+            emu_config.jitter = (uint64_t) (v * USEC_PER_MSEC);
+        else if (!strcmp(item, "loss"))
+            emu_config.loss = v / 100.0;
+        else if (!strcmp(item, "reorder"))
+            emu_config.reorder = v / 100.0;
+        else if (!strcmp(item, "dup"))
+            emu_config.duplicate = v / 100.0;
+        else if (!strcmp(item, "rate"))
+            rate_kbit = v;
+        else if (!strcmp(item, "burst"))
+            burst = v;
+        else if (!strcmp(item, "seed"))
+            emu_config.seed = (unsigned int) v;
+        else
+            fprintf(stderr, "STCP_NETEM: unknown setting '%s'\n", item);
+    }
+    free(copy);
+
+    /* kbit/s to bytes/usec */
+    emu_config.rate  = rate_kbit * 1000.0 / 8.0 / (double) USEC_PER_SEC;
+    emu_config.burst = (burst > 0) ? burst :
+        2.0 * _network_max_packet_len(MAX_JUMBO_PACKET_LEN);
+    emu_config.enabled = TRUE;
+
+    (void) _mysock_create_thread(emu_thread_func, NULL, TRUE);
+}
+
+/* current (wall clock) time, in usec, as for pthread_cond_timedwait() */
+static uint64_t _emu_now(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_REALTIME, &ts) < 0)
+    {
+        assert(0);
+        return 0;
+    }
+
+    return (uint64_t) ts.tv_sec * USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+/* uniform on [0, 1).  emu_lock must be held. */
+static double _emu_random(network_context_t *net_ctx)
+{
+    assert(net_ctx);
+    return rand_r(&net_ctx->random_seed) / (RAND_MAX + 1.0);
+}
+
+/* add a packet to the release list.  emu_lock must be held. */
+static void _emu_schedule(mysock_context_t *ctx, packet_queue_node_t *node,
+                          uint64_t release)
+{
+    emu_entry_t *entry, **prev;
+
+    assert(ctx && node);
+
+    entry = (emu_entry_t *) malloc(sizeof(*entry));
+    assert(entry);
+
+    entry->ctx     = ctx;
+    entry->node    = node;
+    entry->release = release;
+
+    /* after anything due at the same time, so as not to reorder needlessly */
+    for (prev = &emu_list; *prev && (*prev)->release <= release;
+         prev = &(*prev)->next)
+        ;
+
+    entry->next = *prev;
+    *prev = entry;
+
+    ctx->network_state.emu_last_release =
+        MAX(ctx->network_state.emu_last_release, release);
+
+    if (emu_list == entry)
+        PTHREAD_CALL(pthread_cond_signal(&emu_cond));
+}
+
+/* queue each held packet on its mysocket's network_recv_queue once it's
+ * due.  the packet is queued with emu_lock held, so that the mysocket
+ * can't be freed meanwhile (see _network_emu_forget()).
+ */
+static void *emu_thread_func(void *arg_ptr)
+{
+    PTHREAD_CALL(pthread_mutex_lock(&emu_lock));
+    for (;;)
+    {
+        uint64_t now = _emu_now();
+
+        if (!emu_list)
+        {
+            PTHREAD_CALL(pthread_cond_wait(&emu_cond, &emu_lock));
+        }
+        else if (emu_list->release > now)
+        {
+            struct timespec abstime;
+            int rc;
+
+            abstime.tv_sec  = emu_list->release / USEC_PER_SEC;
+            abstime.tv_nsec = (emu_list->release % USEC_PER_SEC) * 1000;
+
+            rc = pthread_cond_timedwait(&emu_cond, &emu_lock, &abstime);
+            assert(rc == 0 || rc == ETIMEDOUT || rc == EINTR);
+        }
+        else
+        {
+            emu_entry_t *entry = emu_list;
+
+            emu_list = entry->next;
+            _mysock_enqueue_node(entry->ctx, &entry->ctx->network_recv_queue,
+                                 entry->node);
+            free(entry);
+        }
+    }
+
+    PTHREAD_CALL(pthread_mutex_unlock(&emu_lock));
+    return NULL;
+}
@@ -0,0 +1,24 @@
+/* network_emu.h--network impairment emulation (delay, loss, reordering,
+ * duplication, bandwidth).  this is an internal header, used only by the
+ * mysocket layer.
+ */
+
+#ifndef __NETWORK_EMU_H__
+#define __NETWORK_EMU_H__
+
+#include "mysock.h"
+#include "mysock_impl.h"
+
+/* returns TRUE if impairments are configured (see network_emu.c) */
+bool_t _network_emu_enabled(void);
+
+/* subject a received packet to the configured impairments, then queue it
+ * on the mysocket's network_recv_queue.  the emulator takes over the
+ * caller's reference to the node.
+ */
+void _network_emu_deliver(mysock_context_t *ctx, packet_queue_node_t *node);
+
+/* discard any packets held for the given mysocket */
+void _network_emu_forget(mysock_context_t *ctx);
+
+#endif  /* __NETWORK_EMU_H__ */
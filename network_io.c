@@ -1,9 +1,90 @@
 /* network_io.c:  routines shared amongst all network layer instantiations */
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
+#include <pthread.h>
 #include <netinet/in.h>
 #include "mysock_impl.h"
 #include "network_io.h"
+#include "tcp_sum.h"
+#include "transport.h"
+#include "network_emu.h"
+
+
+/* process-wide cache of _network_get_interface_ip() results, so the
+ * resolver is consulted once per peer rather than once per connection (or
+ * worse, once per packet).  entries are replaced round-robin.
+ */
+#define INTERFACE_CACHE_SIZE 16
+
+typedef struct
+{
+    uint32_t peer_addr;     /* network byte order; 0 if entry is unused */
+    uint32_t local_addr;    /* network byte order */
+} interface_cache_entry_t;
+
+static interface_cache_entry_t interface_cache[INTERFACE_CACHE_SIZE];
+static unsigned int interface_cache_next = 0;
+static pthread_mutex_t interface_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* packet size configured by STCP_MTU, or 0 if it's not set */
+static size_t configured_packet_len = 0;
+static pthread_once_t configured_packet_len_once = PTHREAD_ONCE_INIT;
+
+/* set once an oversized packet has been reported */
+static int oversized_reported = 0;
+
+static uint32_t _network_lookup_interface_ip(uint32_t peer_addr);
+static void _network_read_packet_len(void);
+
+
+size_t _network_max_packet_len(size_t limit)
+{
+    assert(limit >= MAX_IP_PAYLOAD_LEN);
+
+    PTHREAD_CALL(pthread_once(&configured_packet_len_once,
+                              _network_read_packet_len));
+
+    if (!configured_packet_len)
+        return MAX_IP_PAYLOAD_LEN;
+    return MIN(configured_packet_len, limit);
+}
+
+static void _network_read_packet_len(void)
+{
+    const char *config = getenv("STCP_MTU");
+    unsigned long len;
+    char *end;
+
+    if (!config || !*config)
+        return;
+
+    len = strtoul(config, &end, 10);
+    if (*end || len <= sizeof(struct tcphdr) || len > MAX_JUMBO_PACKET_LEN)
+    {
+        fprintf(stderr, "STCP_MTU: ignoring '%s' (must be %u-%u)\n", config,
+                (unsigned) sizeof(struct tcphdr) + 1,
+                (unsigned) MAX_JUMBO_PACKET_LEN);
+        return;
+    }
+
+    configured_packet_len = len;
+}
+
+void _network_report_oversized(size_t len, size_t max_len)
+{
+    DEBUG_LOG(("dropping oversized packet (len=%u, max=%u)\n",
+               (unsigned) len, (unsigned) max_len));
+
+    /* the peer will probably keep sending them, so this is only said once */
+    if (!__sync_lock_test_and_set(&oversized_reported, 1))
+    {
+        fprintf(stderr, "STCP_MTU: dropping %u-byte packet from peer, over "
+                "the limit of %u here; are both ends set the same?\n",
+                (unsigned) len, (unsigned) max_len);
+    }
+}
 
 
 /* return local IP address associated with the given mysocket.
@@ -25,7 +106,152 @@ uint32_t _network_get_local_addr(network_context_t *ctx)
     assert(ctx->peer_addr_len > 0);
     assert(ctx->peer_addr.sa_family == AF_INET);
 
-    return _network_get_interface_ip(
+    if (ctx->local_ip)
+        return ctx->local_ip;
+
+    /* peer_addr was set without _network_set_peer_addr() */
+    return _network_lookup_interface_ip(
         ((struct sockaddr_in *) &ctx->peer_addr)->sin_addr.s_addr);
 }
 
+void _network_set_peer_addr(network_context_t *ctx,
+                            const struct sockaddr *addr, socklen_t addr_len)
+{
+    assert(ctx && addr);
+
+    ctx->peer_addr       = *addr;
+    ctx->peer_addr_len   = addr_len;
+    ctx->peer_addr_valid = TRUE;
+
+    ctx->local_ip = (addr->sa_family != AF_INET) ? 0 :
+        _network_lookup_interface_ip(
+            ((const struct sockaddr_in *) addr)->sin_addr.s_addr);
+}
+
+/* _network_get_interface_ip(), via the process-wide cache */
+static uint32_t _network_lookup_interface_ip(uint32_t peer_addr)
+{
+    uint32_t local_addr = 0;
+    unsigned int k;
+
+    PTHREAD_CALL(pthread_mutex_lock(&interface_cache_lock));
+    for (k = 0; k < INTERFACE_CACHE_SIZE; ++k)
+    {
+        if (interface_cache[k].peer_addr == peer_addr && peer_addr)
+        {
+            local_addr = interface_cache[k].local_addr;
+            break;
+        }
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&interface_cache_lock));
+
+    if (local_addr)
+        return local_addr;
+
+    /* the lookup itself is done without the lock held, as it may block on
+     * the resolver.  a concurrent miss for the same peer just results in a
+     * duplicate entry.
+     */
+    if (!(local_addr = _network_get_interface_ip(peer_addr)))
+        return 0;
+
+    PTHREAD_CALL(pthread_mutex_lock(&interface_cache_lock));
+    interface_cache[interface_cache_next].peer_addr  = peer_addr;
+    interface_cache[interface_cache_next].local_addr = local_addr;
+    interface_cache_next = (interface_cache_next + 1) % INTERFACE_CACHE_SIZE;
+    PTHREAD_CALL(pthread_mutex_unlock(&interface_cache_lock));
+
+    return local_addr;
+}
+
+
+/* the packet is checked against whichever peer it was received from, which
+ * for a listening mysocket needn't be the peer of any connection yet.  (a
+ * connected mysocket's packets are instead checked by _network_deliver().)
+ */
+bool_t _network_verify_packet(mysock_context_t *ctx,
+                              const void *packet, size_t len)
+{
+    network_context_t *net_ctx;
+    uint32_t peer_ip;
+
+    assert(ctx && packet);
+    net_ctx = &ctx->network_state;
+
+    if (_network_get_caps(net_ctx)->csum_offload)
+        return TRUE;
+
+    assert(net_ctx->peer_addr.sa_family == AF_INET);
+    peer_ip = ((struct sockaddr_in *) &net_ctx->peer_addr)->sin_addr.s_addr;
+
+    if (len < sizeof(struct tcphdr) ||
+        _mysock_tcp_checksum(peer_ip, /*src*/
+                             net_ctx->local_ip ? net_ctx->local_ip :
+                                 _network_lookup_interface_ip(peer_ip), /*dst*/
+                             packet, len) !=
+            ((const struct tcphdr *) packet)->th_sum)
+    {
+        DEBUG_LOG(("dropping packet with bad checksum (len=%u)\n",
+                   (unsigned) len));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* each packet is checked from the sum computed as it's copied into its
+ * node, so it's only read once.  corrupt packets are dropped, as by a real
+ * network.
+ */
+void _network_deliver(mysock_context_t *ctx,
+                      const struct iovec *packets, int num_packets)
+{
+    packet_queue_node_t *head = NULL, *tail = NULL;
+    bool_t verify;
+    int k;
+
+    assert(ctx && packets && num_packets > 0);
+
+    verify = !_network_get_caps(&ctx->network_state)->csum_offload;
+
+    for (k = 0; k < num_packets; ++k)
+    {
+        packet_queue_node_t *node = _mysock_alloc_packet_node(&packets[k], 1);
+
+        if (verify &&
+            (node->data_len < sizeof(struct tcphdr) ||
+             !_mysock_verify_checksum_partial(ctx, node->data,
+                                              node->data_len, node->csum)))
+        {
+            DEBUG_LOG(("dropping packet with bad checksum (len=%u)\n",
+                       (unsigned) node->data_len));
+            _mysock_free_node(node);
+        }
+        else if (_network_emu_enabled())
+        {
+            _network_emu_deliver(ctx, node);
+        }
+        else
+        {
+            if (tail)
+                tail->next = node;
+            else
+                head = node;
+            tail = node;
+        }
+    }
+
+    if (head)
+        _mysock_enqueue_chain(ctx, &ctx->network_recv_queue, head);
+}
+
+void _network_deliver_v(mysock_context_t *ctx,
+                        const struct iovec *iov, int iovcnt)
+{
+    assert(ctx && (iov || !iovcnt));
+
+    if (!_network_emu_enabled())
+        _mysock_enqueue_buffer_v(ctx, &ctx->network_recv_queue, iov, iovcnt);
+    else
+        _network_emu_deliver(ctx, _mysock_alloc_packet_node(iov, iovcnt));
+}
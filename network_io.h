@@ -9,13 +9,43 @@
 #ifdef LINUX
 #include <stdint.h>
 #endif
+#include <sys/uio.h>
 #include "mysock.h"
 
 #define MAX_IP_PAYLOAD_LEN 1500
 
+/* largest packet any network layer can be configured to carry (see
+ * _network_max_packet_len()).  the stream-based network layers frame each
+ * packet with a 16-bit length.
+ */
+#define MAX_JUMBO_PACKET_LEN 65535
+
 
 struct mysock_context;
 
+/* capabilities of an underlying network I/O library, which the mysocket
+ * layer may take advantage of.
+ */
+typedef struct
+{
+    /* TRUE if packets are delivered intact or not at all (e.g. the network
+     * layer runs over a reliable, checksummed stream), in which case the
+     * STCP checksum is neither computed nor verified.  th_sum then goes
+     * out as zero, so a peer that does check it drops every packet; the
+     * tcp network layer therefore only offloads when built with
+     * -DCSUM_OFFLOAD.
+     */
+    bool_t csum_offload;
+
+    /* largest STCP packet (header and payload) that can be carried */
+    size_t max_packet_len;
+
+    /* segmentation offload:  the number of max_packet_len packets that may
+     * be handed to the network layer in one go.  1 if unsupported.
+     */
+    unsigned int max_segments;
+} network_caps_t;
+
 /* network layer context, one instance per mysocket */
 typedef struct
 {
@@ -27,21 +57,50 @@ typedef struct
     socklen_t       peer_addr_len;
     bool_t          peer_addr_valid;
 
+    /* local interface address for peer_addr (network byte order), looked
+     * up once by _network_set_peer_addr().  0 if unknown.
+     */
+    uint32_t        local_ip;
+
+    /* local port (network byte order), cached by _network_get_port().  0
+     * until known; reset whenever the underlying socket may change.
+     */
+    uint16_t        local_port;
+
     /* additional (opaque) data used by underlying I/O implementation */
     void *impl_data;
 
-    /* packet reordering/duplication simulation */
+    /* network impairment emulation state (see network_emu.c) */
     unsigned int random_seed;
-    bool_t       copied;
-    char         copy_buffer[MAX_IP_PAYLOAD_LEN];
-    size_t       copy_buf_len;
+    bool_t       emu_seeded;
+    uint64_t     emu_bucket_time;   /* usec */
+    double       emu_bucket_tokens; /* bytes */
+    uint64_t     emu_last_release;  /* usec */
 } network_context_t;
 
 
+/* maximum packet size (max_packet_len) for a network layer with no MTU of
+ * its own, which can carry packets of up to limit bytes.  this is taken
+ * from the STCP_MTU environment variable (e.g. STCP_MTU=9000), so that
+ * local and emulated links can use jumbo packets; MAX_IP_PAYLOAD_LEN by
+ * default.  as with any link's MTU, it isn't negotiated with the peer, so
+ * both ends must be given the same value.
+ */
+size_t _network_max_packet_len(size_t limit);
+
+/* called by a network layer when it drops a packet from the peer that's
+ * larger than max_len, as happens if the peers' STCP_MTU settings differ.
+ * the first such packet is reported on stderr.
+ */
+void _network_report_oversized(size_t len, size_t max_len);
+
 /* open/close network layer resources for a mysocket */
 int _network_init(struct mysock_context *ctx, network_context_t *net_ctx);
 void _network_close(network_context_t *ctx);
 
+/* return the capabilities of the network layer for the given mysocket */
+const network_caps_t *_network_get_caps(network_context_t *ctx);
+
 /* bind a local port to the given mysocket */
 int _network_bind(network_context_t *ctx, struct sockaddr *addr, int addrlen);
 
@@ -56,6 +115,12 @@ int _network_get_port(network_context_t *ctx);
  */
 uint32_t _network_get_local_addr(network_context_t *ctx);
 
+/* record the address of the peer, and look up the corresponding local
+ * address (see _network_get_local_addr()).
+ */
+void _network_set_peer_addr(network_context_t *ctx,
+                            const struct sockaddr *addr, socklen_t addr_len);
+
 /* return local address associated with whichever interface delivers
  * packets to/from peer_addr (network byte order).
  */
@@ -65,6 +130,45 @@ uint32_t _network_get_interface_ip(uint32_t peer_addr);
 ssize_t _network_send_packet(network_context_t *ctx,
                              const void *src, size_t len);
 
+/* as above, for a packet gathered from iovcnt pieces */
+ssize_t _network_send_packetv(network_context_t *ctx,
+                              const struct iovec *iov, int iovcnt);
+
+/* send num_packets packets, each gathered from iovcnt consecutive pieces of
+ * iov, in as few operations as the network layer can manage.  num_packets
+ * may be at most the max_segments capability.  returns the total length
+ * sent, or -1 on error.
+ */
+ssize_t _network_send_packets(network_context_t *ctx,
+                              const struct iovec *iov, int iovcnt,
+                              int num_packets);
+
+/* send any packets the network layer has held back (see TCP_SEND_BATCH in
+ * network_io_tcp.c).  this must be called before the sender blocks.
+ */
+int _network_flush(network_context_t *ctx);
+
+/* hand packets received from the peer to the mysocket layer, via the
+ * network impairment emulator if it's enabled.  each iovec in packets is a
+ * complete packet; _network_deliver_v() delivers a single packet gathered
+ * from iovcnt pieces.  a zero-length packet signals EOF or an error, as
+ * for _mysock_enqueue_buffer().  _network_deliver() drops any packet with
+ * a bad checksum, unless the network layer guarantees its integrity;
+ * _network_deliver_v() doesn't check.
+ */
+void _network_deliver(struct mysock_context *ctx,
+                      const struct iovec *packets, int num_packets);
+void _network_deliver_v(struct mysock_context *ctx,
+                        const struct iovec *iov, int iovcnt);
+
+/* check an incoming packet's checksum, unless the network layer guarantees
+ * its integrity.  packets failing this should be dropped.  this is only
+ * needed for packets not passed to _network_deliver(), e.g. those received
+ * by a listening mysocket.
+ */
+bool_t _network_verify_packet(struct mysock_context *ctx,
+                              const void *packet, size_t len);
+
 /* start/stop per-mysocket network receive thread.  the stop() interface
  * must not return until the network receive thread has exited.
  */
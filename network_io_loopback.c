@@ -0,0 +1,489 @@
+/* network_io_loopback.c: in-process instantiation of the underlying
+ * datagram service.
+ */
+
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "mysock_impl.h"
+#include "network_io.h"
+#include "connection_demux.h"
+
+
+/* a few words about the loopback network layer...
+ *
+ * this connects mysockets within a single process, without any system
+ * calls, so that the cost of the transport layer itself can be measured.
+ * all mysockets have the address 127.0.0.1, and ports are allocated from
+ * a process-wide table.
+ *
+ *   - once a connection is established, each side sends by queueing the
+ *     packet straight onto its peer's network_recv_queue.  no receive
+ *     thread is needed.
+ *   - before that, the active side's packets (i.e. its SYN) are queued on
+ *     the network_recv_queue of the mysocket listening on the destination
+ *     port, prefixed by the sender's port.  the listening mysocket's
+ *     receive thread dispatches them with _mysock_enqueue_connection(), as
+ *     for any other network layer; _network_update_passive_state() then
+ *     pairs the new context with the active one.
+ *   - when either side stops receiving, its peer sees EOF, just as with
+ *     the TCP network layer.
+ *
+ * loopback_lock protects the port table and the peer pointers, and is
+ * held while a packet is queued so that the receiving mysocket can't go
+ * away underneath the sender.  it is taken after listen_lock (see
+ * connection_demux.c), and before the network emulator's lock and any
+ * mysocket's data_ready_lock.
+ */
+
+#define LOOPBACK_EPHEMERAL_MIN 49152
+#define LOOPBACK_NUM_PORTS     65536
+
+typedef struct
+{
+    mysock_context_t *sock_ctx;
+    uint16_t          port;         /* host byte order; 0 if unbound */
+
+    /* the other end of the connection; NULL until the connection is set
+     * up, and again once either side has gone away.
+     */
+    mysock_context_t *peer;
+    bool_t            paired;       /* TRUE once peer has been set */
+
+    /* the receive thread only runs for a listening mysocket */
+    pthread_t         recv_thread;
+    bool_t            recv_thread_started;
+} network_context_loopback_t;
+
+#define GET_LOOPBACK(net_ctx) \
+    ((network_context_loopback_t *) (net_ctx)->impl_data)
+
+static network_caps_t loopback_caps =
+{
+    TRUE,               /* csum_offload */
+    0,                  /* max_packet_len (see _loopback_init_caps()) */
+    1                   /* max_segments */
+};
+static pthread_once_t loopback_caps_once = PTHREAD_ONCE_INIT;
+
+static mysock_context_t *port_table[LOOPBACK_NUM_PORTS];
+static unsigned int next_ephemeral_port = LOOPBACK_EPHEMERAL_MIN;
+static pthread_mutex_t loopback_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void _loopback_init_caps(void);
+static void _loopback_unpair(network_context_loopback_t *lb_ctx);
+static void _loopback_release_port(network_context_loopback_t *lb_ctx);
+static void *loopback_listen_thread_func(void *arg_ptr);
+
+
+int _network_init(mysock_context_t *sock_ctx, network_context_t *net_ctx)
+{
+    network_context_loopback_t *lb_ctx;
+
+    assert(sock_ctx && net_ctx);
+
+    PTHREAD_CALL(pthread_once(&loopback_caps_once, _loopback_init_caps));
+
+    memset(net_ctx, 0, sizeof(*net_ctx));
+    net_ctx->random_seed = 0x632a;
+
+    lb_ctx = (network_context_loopback_t *) calloc(1, sizeof(*lb_ctx));
+    assert(lb_ctx);
+
+    lb_ctx->sock_ctx = sock_ctx;
+    net_ctx->impl_data = lb_ctx;
+    return 0;
+}
+
+void _network_close(network_context_t *ctx)
+{
+    network_context_loopback_t *lb_ctx;
+
+    assert(ctx);
+
+    lb_ctx = GET_LOOPBACK(ctx);
+    assert(lb_ctx);
+    assert(!lb_ctx->recv_thread_started);
+
+    PTHREAD_CALL(pthread_mutex_lock(&loopback_lock));
+    _loopback_unpair(lb_ctx);
+    _loopback_release_port(lb_ctx);
+    PTHREAD_CALL(pthread_mutex_unlock(&loopback_lock));
+
+    free(lb_ctx);
+    ctx->impl_data = NULL;
+}
+
+const network_caps_t *_network_get_caps(network_context_t *ctx)
+{
+    assert(ctx);
+    return &loopback_caps;
+}
+
+/* reserve the given port (or an ephemeral port, if it's 0) */
+int _network_bind(network_context_t *ctx, struct sockaddr *addr, int addrlen)
+{
+    network_context_loopback_t *lb_ctx;
+    unsigned int port;
+    int rc = 0;
+
+    assert(ctx && addr);
+
+    lb_ctx = GET_LOOPBACK(ctx);
+    assert(lb_ctx);
+
+    if (addr->sa_family != AF_INET || addrlen < (int) sizeof(struct sockaddr_in))
+    {
+        errno = EAFNOSUPPORT;
+        return -1;
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&loopback_lock));
+    if (lb_ctx->port)
+    {
+        errno = EINVAL;     /* already bound */
+        rc = -1;
+    }
+    else if ((port = ntohs(((struct sockaddr_in *) addr)->sin_port)) != 0)
+    {
+        if (port_table[port])
+        {
+            errno = EADDRINUSE;
+            rc = -1;
+        }
+    }
+    else
+    {
+        unsigned int k;
+
+        for (k = 0; k < LOOPBACK_NUM_PORTS - LOOPBACK_EPHEMERAL_MIN; ++k)
+        {
+            port = next_ephemeral_port;
+            if (++next_ephemeral_port == LOOPBACK_NUM_PORTS)
+                next_ephemeral_port = LOOPBACK_EPHEMERAL_MIN;
+
+            if (!port_table[port])
+                break;
+        }
+
+        if (port_table[port])
+        {
+            errno = EADDRINUSE;
+            rc = -1;
+        }
+    }
+
+    if (rc == 0)
+    {
+        port_table[port] = lb_ctx->sock_ctx;
+        lb_ctx->port = port;
+        ctx->local_port = htons(port);
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&loopback_lock));
+
+    return rc;
+}
+
+int _network_listen(network_context_t *ctx, int backlog)
+{
+    assert(ctx);
+    assert(GET_LOOPBACK(ctx)->port);
+
+    return 0;
+}
+
+int _network_get_port(network_context_t *ctx)
+{
+    assert(ctx && GET_LOOPBACK(ctx));
+    return htons(GET_LOOPBACK(ctx)->port);
+}
+
+/* everything is local */
+uint32_t _network_get_interface_ip(uint32_t peer_addr)
+{
+    return htonl(INADDR_LOOPBACK);
+}
+
+/* pair the new context with the active side that sent the SYN */
+void _network_update_passive_state(network_context_t *new_ctx,
+                                   network_context_t *accept_ctx,
+                                   void *user_data,
+                                   const void *syn_packet, size_t syn_len)
+{
+    network_context_loopback_t *new_lb_ctx;
+    mysock_context_t *active_ctx;
+    unsigned int port;
+
+    assert(new_ctx && accept_ctx && syn_packet);
+    assert(!user_data);
+    assert(new_ctx->peer_addr.sa_family == AF_INET);
+
+    new_lb_ctx = GET_LOOPBACK(new_ctx);
+    assert(new_lb_ctx);
+
+    /* the new context shares the listening port, as with TCP; it isn't
+     * entered in the port table though.
+     */
+    port = ntohs(((struct sockaddr_in *) &new_ctx->peer_addr)->sin_port);
+    new_ctx->local_port = htons(GET_LOOPBACK(accept_ctx)->port);
+
+    PTHREAD_CALL(pthread_mutex_lock(&loopback_lock));
+    if ((active_ctx = port_table[port]) != NULL &&
+        !GET_LOOPBACK(&active_ctx->network_state)->paired)
+    {
+        network_context_loopback_t *active_lb_ctx =
+            GET_LOOPBACK(&active_ctx->network_state);
+
+        active_lb_ctx->peer   = new_lb_ctx->sock_ctx;
+        active_lb_ctx->paired = TRUE;
+        new_lb_ctx->peer      = active_ctx;
+    }
+    else
+    {
+        /* the active side has gone away already; the new connection will
+         * just time out.
+         */
+        DEBUG_LOG(("no active mysocket on port %u\n", port));
+    }
+    new_lb_ctx->paired = TRUE;
+    PTHREAD_CALL(pthread_mutex_unlock(&loopback_lock));
+}
+
+
+/* send the given packet to the peer */
+ssize_t _network_send_packet(network_context_t *ctx,
+                             const void *src, size_t len)
+{
+    struct iovec iov;
+
+    assert(src);
+
+    iov.iov_base = (void *) src;
+    iov.iov_len  = len;
+    return _network_send_packetv(ctx, &iov, 1);
+}
+
+/* queue the packet gathered from the given pieces for the peer.  if
+ * there's nobody to receive it, it's silently dropped.
+ */
+ssize_t _network_send_packetv(network_context_t *ctx,
+                              const struct iovec *iov, int iovcnt)
+{
+    network_context_loopback_t *lb_ctx;
+    size_t len = 0;
+    int k;
+
+    assert(ctx && iov && iovcnt > 0);
+    assert(ctx->peer_addr_len > 0);
+    assert(ctx->peer_addr.sa_family == AF_INET);
+
+    lb_ctx = GET_LOOPBACK(ctx);
+    assert(lb_ctx);
+
+    for (k = 0; k < iovcnt; ++k)
+        len += iov[k].iov_len;
+    assert(len <= loopback_caps.max_packet_len);
+
+    PTHREAD_CALL(pthread_mutex_lock(&loopback_lock));
+    if (lb_ctx->peer)
+    {
+        _network_deliver_v(lb_ctx->peer, iov, iovcnt);
+    }
+    else if (!lb_ctx->paired)
+    {
+        mysock_context_t *listen_ctx;
+        unsigned int port =
+            ntohs(((struct sockaddr_in *) &ctx->peer_addr)->sin_port);
+
+        if ((listen_ctx = port_table[port]) != NULL &&
+            listen_ctx->listening &&
+            GET_LOOPBACK(&listen_ctx->network_state)->recv_thread_started)
+        {
+            struct iovec *syn_iov;
+            uint16_t src_port = lb_ctx->port;   /* host byte order */
+
+            assert(src_port);
+            syn_iov = (struct iovec *)
+                malloc((iovcnt + 1) * sizeof(struct iovec));
+            assert(syn_iov);
+
+            syn_iov[0].iov_base = &src_port;
+            syn_iov[0].iov_len  = sizeof(src_port);
+            memcpy(syn_iov + 1, iov, iovcnt * sizeof(struct iovec));
+
+            _mysock_enqueue_buffer_v(listen_ctx,
+                                     &listen_ctx->network_recv_queue,
+                                     syn_iov, iovcnt + 1);
+            free(syn_iov);
+        }
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&loopback_lock));
+
+    return len;
+}
+
+/* hand each of the given packets to the peer in turn */
+ssize_t _network_send_packets(network_context_t *ctx,
+                              const struct iovec *iov, int iovcnt,
+                              int num_packets)
+{
+    ssize_t total = 0;
+    int j;
+
+    assert(ctx && iov && iovcnt > 0);
+    assert(num_packets > 0 &&
+           (unsigned int) num_packets <= loopback_caps.max_segments);
+
+    for (j = 0; j < num_packets; ++j, iov += iovcnt)
+    {
+        ssize_t len;
+
+        if ((len = _network_send_packetv(ctx, iov, iovcnt)) < 0)
+            return -1;
+        total += len;
+    }
+
+    return total;
+}
+
+/* packets are never held back */
+int _network_flush(network_context_t *ctx)
+{
+    assert(ctx);
+    return 0;
+}
+
+/* only a listening mysocket needs a receive thread, to dispatch SYNs */
+int _network_start_recv_thread(mysock_context_t *ctx)
+{
+    network_context_loopback_t *lb_ctx;
+
+    assert(ctx);
+
+    lb_ctx = GET_LOOPBACK(&ctx->network_state);
+    assert(lb_ctx);
+
+    if (ctx->listening)
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&loopback_lock));
+        lb_ctx->recv_thread = _mysock_create_thread(
+            loopback_listen_thread_func, ctx, FALSE);
+        lb_ctx->recv_thread_started = TRUE;
+        PTHREAD_CALL(pthread_mutex_unlock(&loopback_lock));
+    }
+
+    return 0;
+}
+
+/* stop receiving packets; the peer (if any) sees EOF */
+void _network_stop_recv_thread(mysock_context_t *ctx)
+{
+    network_context_loopback_t *lb_ctx;
+    bool_t thread_started;
+
+    assert(ctx);
+
+    lb_ctx = GET_LOOPBACK(&ctx->network_state);
+    assert(lb_ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&loopback_lock));
+    _loopback_unpair(lb_ctx);
+    if ((thread_started = lb_ctx->recv_thread_started))
+    {
+        /* no more SYNs will be queued; wake the thread with EOF */
+        lb_ctx->recv_thread_started = FALSE;
+        _mysock_enqueue_buffer(ctx, &ctx->network_recv_queue, NULL, 0);
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&loopback_lock));
+
+    if (thread_started)
+        PTHREAD_CALL(pthread_join(lb_ctx->recv_thread, NULL));
+}
+
+
+/* packets are just copied from one mysocket to the other, so can be as
+ * large as any network layer allows
+ */
+static void _loopback_init_caps(void)
+{
+    loopback_caps.max_packet_len =
+        _network_max_packet_len(MAX_JUMBO_PACKET_LEN);
+}
+
+/* dissolve the connection, if any.  loopback_lock must be held. */
+static void _loopback_unpair(network_context_loopback_t *lb_ctx)
+{
+    mysock_context_t *peer;
+
+    assert(lb_ctx);
+
+    if ((peer = lb_ctx->peer) != NULL)
+    {
+        network_context_loopback_t *peer_lb_ctx =
+            GET_LOOPBACK(&peer->network_state);
+
+        assert(peer_lb_ctx && peer_lb_ctx->peer == lb_ctx->sock_ctx);
+        peer_lb_ctx->peer = NULL;
+        lb_ctx->peer = NULL;
+
+        /* signal EOF to the peer */
+        _network_deliver_v(peer, NULL, 0);
+    }
+}
+
+/* give up the mysocket's port.  loopback_lock must be held. */
+static void _loopback_release_port(network_context_loopback_t *lb_ctx)
+{
+    assert(lb_ctx);
+
+    if (lb_ctx->port && port_table[lb_ctx->port] == lb_ctx->sock_ctx)
+        port_table[lb_ctx->port] = NULL;
+    lb_ctx->port = 0;
+}
+
+/* dispatch SYNs queued for a listening mysocket, until EOF */
+static void *loopback_listen_thread_func(void *arg_ptr)
+{
+    mysock_context_t *ctx = (mysock_context_t *) arg_ptr;
+
+    assert(ctx && ctx->listening);
+
+    for (;;)
+    {
+        packet_queue_node_t *node;
+        struct sockaddr_in peer_addr;
+        uint16_t src_port;
+
+        node = _mysock_dequeue_node(ctx, &ctx->network_recv_queue);
+        if (node->data_len == 0)
+        {
+            _mysock_free_node(node);
+            break;
+        }
+
+        assert(node->data_len >= sizeof(src_port));
+        memcpy(&src_port, node->data, sizeof(src_port));
+
+        memset(&peer_addr, 0, sizeof(peer_addr));
+        peer_addr.sin_family      = AF_INET;
+        peer_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        peer_addr.sin_port        = htons(src_port);
+
+        memcpy(&ctx->network_state.peer_addr, &peer_addr, sizeof(peer_addr));
+        ctx->network_state.peer_addr_len = sizeof(peer_addr);
+
+        _mysock_enqueue_connection(ctx, node->data + sizeof(src_port),
+                                   node->data_len - sizeof(src_port),
+                                   (struct sockaddr *) &peer_addr,
+                                   sizeof(peer_addr), NULL);
+        _mysock_free_node(node);
+    }
+
+    return NULL;
+}
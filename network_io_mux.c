@@ -0,0 +1,1152 @@
+/* network_io_mux.c: instantiation of the underlying datagram service in
+ * which all STCP connections between two endpoints share a single TCP
+ * connection.
+ */
+
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <alloca.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <pthread.h>
+#include "mysock_impl.h"
+#include "mysock_hash.h"
+#include "network_io.h"
+#include "connection_demux.h"
+
+
+/* a few words about the multiplexing network layer...
+ *
+ * the TCP network layer uses a kernel TCP connection (and a receive
+ * thread) per mysocket.  here, a process instead opens one TCP connection,
+ * or channel, to each remote endpoint it connects to, and all of its
+ * mysockets connected to that endpoint share it.  packets on a channel
+ * are demultiplexed by their STCP port pair.
+ *
+ *   - a mysocket bound before it has a peer (i.e. one that may listen)
+ *     gets a kernel TCP socket bound to the same port, on which
+ *     connections from peers are accepted.  a mysocket bound implicitly by
+ *     myconnect() has no kernel socket at all; its port only needs to be
+ *     unique within the process, and is allocated from a process-wide
+ *     table.
+ *   - the active side's first packet (its SYN) goes over the channel to
+ *     the peer's address, which is connected if there isn't one already.
+ *     the peer's channel receive thread finds no mysocket for the port
+ *     pair, so hands the SYN to the mysocket listening on the destination
+ *     port with _mysock_enqueue_connection(), as for any other network
+ *     layer; _network_update_passive_state() then attaches the new
+ *     context to the channel.
+ *   - each packet is preceded by a mux_header_t giving its length and
+ *     ports.  a header with zero length tells the peer that the sending
+ *     mysocket has stopped receiving, so that it sees EOF, just as with
+ *     the TCP network layer.  if the channel itself is lost, all of its
+ *     mysockets see EOF.
+ *   - a channel is closed by the side that connected it, once its last
+ *     mysocket has gone away.
+ *
+ * mux_lock protects the port table, the channel list, the demultiplexing
+ * table, and each channel's list of mysockets.  it is held while a packet
+ * is delivered, so that the receiving mysocket can't go away underneath
+ * the channel's receive thread, and is taken after listen_lock (see
+ * connection_demux.c), and before the network emulator's lock and any
+ * mysocket's data_ready_lock.  nothing is written to a channel with
+ * mux_lock held.
+ */
+
+#define MUX_EPHEMERAL_MIN 49152
+#define MUX_NUM_PORTS     65536
+#define MUX_BIND_TRIES    16        /* see _mux_bind_kernel() */
+
+/* size of each channel's receive buffer; it must hold at least one
+ * framed packet of MAX_JUMBO_PACKET_LEN.
+ */
+#define MUX_RECV_BUF_LEN  131072
+
+/* maximum number of packets delivered to a mysocket at a time */
+#define MUX_DELIVER_BATCH 32
+
+/* precedes each packet on a channel (network byte order) */
+typedef struct
+{
+    uint16_t len;       /* 0 if the sender has stopped receiving */
+    uint16_t src_port;
+    uint16_t dst_port;
+} __attribute__ ((packed)) mux_header_t;
+
+struct network_context_mux;
+
+typedef struct mux_channel
+{
+    int          sd;
+    uint32_t     peer_ip;       /* network byte order */
+    uint16_t     peer_port;     /* network byte order */
+    bool_t       active;        /* we connected it */
+
+    /* the channel's mysockets (linked through next_conn), plus one for the
+     * receive thread.  the channel is freed once this drops to zero.
+     */
+    unsigned int refs;
+    struct network_context_mux *conns;
+
+    bool_t       closing;       /* shut down, or about to be */
+    bool_t       closed;        /* the receive thread has seen EOF */
+
+    /* serialises writers, so that packets aren't interleaved */
+    pthread_mutex_t send_lock;
+
+    struct mux_channel *next;   /* in channel_list (active channels) */
+
+    /* used only by the receive thread */
+    size_t       recv_start, recv_end;
+    char         recv_buf[MUX_RECV_BUF_LEN];
+} mux_channel_t;
+
+typedef struct network_context_mux
+{
+    mysock_context_t *sock_ctx;
+    uint16_t          port;         /* host byte order; 0 if unbound */
+    int               listen_sd;    /* -1 unless bound without a peer */
+
+    /* the channel, once attached, and the mysocket's place on it */
+    mux_channel_t    *channel;
+    uint16_t          peer_port;    /* host byte order */
+    bool_t            demuxed;      /* entered in conn_table */
+    bool_t            attach_failed;
+    struct network_context_mux *prev_conn, *next_conn;
+
+    /* listening mysockets only.  SYNs are dispatched (by channel receive
+     * threads) only while accepting is set.
+     */
+    int               exit_pipe[2];
+    pthread_t         accept_thread;
+    bool_t            accept_thread_started;
+    bool_t            accepting;
+    unsigned int      dispatching;  /* # of SYNs being dispatched */
+} network_context_mux_t;
+
+#define GET_MUX(net_ctx) ((network_context_mux_t *) (net_ctx)->impl_data)
+
+/* key for conn_table */
+typedef struct
+{
+    mux_channel_t *channel;
+    uint16_t       local_port;      /* host byte order */
+    uint16_t       peer_port;       /* host byte order */
+} mux_conn_key_t;
+
+static bool_t _mux_key_equal(mux_conn_key_t a, mux_conn_key_t b)
+{
+    return a.channel == b.channel &&
+           a.local_port == b.local_port && a.peer_port == b.peer_port;
+}
+
+static unsigned int _mux_key_hash(mux_conn_key_t key, unsigned int size)
+{
+    return ((unsigned int) ((uintptr_t) key.channel / sizeof(void *)) ^
+            ((unsigned int) key.local_port << 16) ^ key.peer_port) % size;
+}
+
+HASH_TABLE_DECLARE_EXTENDED(conn_table, mux_conn_key_t, mysock_context_t *,
+                            _mux_key_hash, _mux_key_equal,
+                            MAX_NUM_CONNECTIONS);
+
+static network_caps_t mux_caps =
+{
+    TRUE,               /* csum_offload */
+    0,                  /* max_packet_len (see _mux_init_caps()) */
+    64                  /* max_segments */
+};
+static pthread_once_t mux_caps_once = PTHREAD_ONCE_INIT;
+
+static mysock_context_t *port_table[MUX_NUM_PORTS];
+static unsigned int next_ephemeral_port = MUX_EPHEMERAL_MIN;
+static mux_channel_t *channel_list = NULL;
+static pthread_mutex_t mux_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mux_cond = PTHREAD_COND_INITIALIZER;
+
+/* serialises the connection of new channels, so that mysockets connecting
+ * to the same endpoint at once share a channel
+ */
+static pthread_mutex_t connect_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void _mux_init_caps(void);
+static int _mux_bind_kernel(network_context_mux_t *mux_ctx,
+                            struct sockaddr *addr, int addrlen);
+static int _mux_attach_active(network_context_t *ctx);
+static void _mux_attach(network_context_mux_t *mux_ctx,
+                        mux_channel_t *channel, uint16_t peer_port);
+static void _mux_detach(network_context_mux_t *mux_ctx);
+static mux_channel_t *_mux_new_channel(int sd, const struct sockaddr_in *peer,
+                                       bool_t active);
+static void _mux_release_channel(mux_channel_t *channel);
+static int _mux_send(mux_channel_t *channel, struct iovec *iov, int iovcnt);
+static void _mux_dispatch(mux_channel_t *channel);
+static void _mux_set_nodelay(int sd);
+static void *mux_channel_thread_func(void *arg_ptr);
+static void *mux_accept_thread_func(void *arg_ptr);
+
+
+int _network_init(mysock_context_t *sock_ctx, network_context_t *net_ctx)
+{
+    network_context_mux_t *mux_ctx;
+
+    assert(sock_ctx && net_ctx);
+
+    PTHREAD_CALL(pthread_once(&mux_caps_once, _mux_init_caps));
+
+    memset(net_ctx, 0, sizeof(*net_ctx));
+    net_ctx->random_seed = 0x632a;
+
+    mux_ctx = (network_context_mux_t *) calloc(1, sizeof(*mux_ctx));
+    assert(mux_ctx);
+
+    mux_ctx->sock_ctx     = sock_ctx;
+    mux_ctx->listen_sd    = -1;
+    mux_ctx->exit_pipe[0] = mux_ctx->exit_pipe[1] = -1;
+    net_ctx->impl_data = mux_ctx;
+    return 0;
+}
+
+void _network_close(network_context_t *ctx)
+{
+    network_context_mux_t *mux_ctx;
+
+    assert(ctx);
+
+    mux_ctx = GET_MUX(ctx);
+    assert(mux_ctx);
+    assert(!mux_ctx->accept_thread_started);
+
+    _mux_detach(mux_ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&mux_lock));
+    if (mux_ctx->port && port_table[mux_ctx->port] == mux_ctx->sock_ctx)
+        port_table[mux_ctx->port] = NULL;
+    mux_ctx->port = 0;
+    PTHREAD_CALL(pthread_mutex_unlock(&mux_lock));
+
+    if (mux_ctx->listen_sd != -1)
+        close(mux_ctx->listen_sd);
+    if (mux_ctx->exit_pipe[0] != -1)
+    {
+        close(mux_ctx->exit_pipe[0]);
+        close(mux_ctx->exit_pipe[1]);
+    }
+
+    free(mux_ctx);
+    ctx->impl_data = NULL;
+}
+
+const network_caps_t *_network_get_caps(network_context_t *ctx)
+{
+    assert(ctx);
+    return &mux_caps;
+}
+
+/* reserve the given port (or an ephemeral port, if it's 0).  a mysocket
+ * without a peer might listen, so the port is reserved with the kernel as
+ * well.
+ */
+int _network_bind(network_context_t *ctx, struct sockaddr *addr, int addrlen)
+{
+    network_context_mux_t *mux_ctx;
+    unsigned int port = 0;
+    int rc = 0;
+
+    assert(ctx && addr);
+
+    mux_ctx = GET_MUX(ctx);
+    assert(mux_ctx);
+
+    if (addr->sa_family != AF_INET || addrlen < (int) sizeof(struct sockaddr_in))
+    {
+        errno = EAFNOSUPPORT;
+        return -1;
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&mux_lock));
+    if (mux_ctx->port)
+    {
+        errno = EINVAL;     /* already bound */
+        rc = -1;
+    }
+    else if (!ctx->peer_addr_valid)
+    {
+        rc = _mux_bind_kernel(mux_ctx, addr, addrlen);
+        port = mux_ctx->port;
+    }
+    else if ((port = ntohs(((struct sockaddr_in *) addr)->sin_port)) != 0)
+    {
+        if (port_table[port])
+        {
+            errno = EADDRINUSE;
+            rc = -1;
+        }
+    }
+    else
+    {
+        unsigned int k;
+
+        for (k = 0; k < MUX_NUM_PORTS - MUX_EPHEMERAL_MIN; ++k)
+        {
+            port = next_ephemeral_port;
+            if (++next_ephemeral_port == MUX_NUM_PORTS)
+                next_ephemeral_port = MUX_EPHEMERAL_MIN;
+
+            if (!port_table[port])
+                break;
+        }
+
+        if (port_table[port])
+        {
+            errno = EADDRINUSE;
+            rc = -1;
+        }
+    }
+
+    if (rc == 0)
+    {
+        port_table[port] = mux_ctx->sock_ctx;
+        mux_ctx->port = port;
+        ctx->local_port = htons(port);
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&mux_lock));
+
+    return rc;
+}
+
+int _network_listen(network_context_t *ctx, int backlog)
+{
+    network_context_mux_t *mux_ctx;
+
+    assert(ctx);
+
+    mux_ctx = GET_MUX(ctx);
+    assert(mux_ctx && mux_ctx->port);
+
+    if (mux_ctx->listen_sd == -1)
+    {
+        errno = EOPNOTSUPP;     /* bound by myconnect() */
+        return -1;
+    }
+
+    if (mux_ctx->exit_pipe[0] == -1 && pipe(mux_ctx->exit_pipe) < 0)
+    {
+        perror("pipe (network_io_mux)");
+        assert(0);
+        return -1;
+    }
+
+    return listen(mux_ctx->listen_sd, backlog);
+}
+
+int _network_get_port(network_context_t *ctx)
+{
+    assert(ctx && GET_MUX(ctx));
+    return htons(GET_MUX(ctx)->port);
+}
+
+/* the kernel picks the source address for a connected UDP socket, without
+ * anything being sent.
+ */
+uint32_t _network_get_interface_ip(uint32_t peer_addr)
+{
+    struct sockaddr_in sin;
+    socklen_t sin_len = sizeof(sin);
+    uint32_t local_addr = 0;
+    int sd;
+
+    if ((sd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    {
+        perror("socket (network_io_mux)");
+        assert(0);
+        return 0;
+    }
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family      = AF_INET;
+    sin.sin_addr.s_addr = peer_addr;
+    sin.sin_port        = htons(9);     /* discard; any port would do */
+
+    if (connect(sd, (struct sockaddr *) &sin, sizeof(sin)) < 0 ||
+        getsockname(sd, (struct sockaddr *) &sin, &sin_len) < 0)
+    {
+        perror("_network_get_interface_ip");
+        assert(0);
+    }
+    else
+    {
+        local_addr = sin.sin_addr.s_addr;
+    }
+
+    close(sd);
+    return local_addr;
+}
+
+/* attach the new context to the channel that the SYN arrived on (passed
+ * as user_data)
+ */
+void _network_update_passive_state(network_context_t *new_ctx,
+                                   network_context_t *accept_ctx,
+                                   void *user_data,
+                                   const void *syn_packet, size_t syn_len)
+{
+    network_context_mux_t *new_mux_ctx;
+
+    assert(new_ctx && accept_ctx && user_data && syn_packet);
+    assert(new_ctx->peer_addr.sa_family == AF_INET);
+
+    new_mux_ctx = GET_MUX(new_ctx);
+    assert(new_mux_ctx && !new_mux_ctx->channel);
+
+    /* the new context shares the listening port, as with TCP; it isn't
+     * entered in the port table though.
+     */
+    new_mux_ctx->port = GET_MUX(accept_ctx)->port;
+    new_ctx->local_port = htons(new_mux_ctx->port);
+
+    PTHREAD_CALL(pthread_mutex_lock(&mux_lock));
+    _mux_attach(new_mux_ctx, (mux_channel_t *) user_data,
+                ntohs(((struct sockaddr_in *) &new_ctx->peer_addr)->sin_port));
+    PTHREAD_CALL(pthread_mutex_unlock(&mux_lock));
+}
+
+
+/* send the given packet to the peer */
+ssize_t _network_send_packet(network_context_t *ctx,
+                             const void *src, size_t len)
+{
+    struct iovec iov;
+
+    assert(src);
+
+    iov.iov_base = (void *) src;
+    iov.iov_len  = len;
+    return _network_send_packetv(ctx, &iov, 1);
+}
+
+/* send the packet gathered from the given pieces to the peer */
+ssize_t _network_send_packetv(network_context_t *ctx,
+                              const struct iovec *iov, int iovcnt)
+{
+    return _network_send_packets(ctx, iov, iovcnt, 1);
+}
+
+/* send the packets gathered from the given pieces to the peer, over the
+ * channel to its endpoint (which is connected first, if need be).  all
+ * the frames go out together, under a single hold of the send lock.
+ */
+ssize_t _network_send_packets(network_context_t *ctx,
+                              const struct iovec *iov, int iovcnt,
+                              int num_packets)
+{
+    network_context_mux_t *mux_ctx;
+    mux_header_t *headers;
+    struct iovec *io_iov;
+    size_t total = 0;
+    int j, k;
+
+    assert(ctx && iov && iovcnt > 0);
+    assert(num_packets > 0 &&
+           (unsigned int) num_packets <= mux_caps.max_segments);
+    assert(ctx->peer_addr_len > 0);
+    assert(ctx->peer_addr.sa_family == AF_INET);
+
+    mux_ctx = GET_MUX(ctx);
+    assert(mux_ctx);
+
+    if (!mux_ctx->channel && _mux_attach_active(ctx) < 0)
+        return -1;
+    assert(mux_ctx->channel);
+
+    /* _mux_send() consumes its iovec, so work on a copy */
+    headers = (mux_header_t *) alloca(num_packets * sizeof(mux_header_t));
+    io_iov  = (struct iovec *)
+        alloca(num_packets * (iovcnt + 1) * sizeof(struct iovec));
+
+    for (j = 0; j < num_packets; ++j)
+    {
+        struct iovec *frame_iov = io_iov + j * (iovcnt + 1);
+        size_t len = 0;
+
+        for (k = 0; k < iovcnt; ++k)
+        {
+            frame_iov[k + 1] = iov[j * iovcnt + k];
+            len += frame_iov[k + 1].iov_len;
+        }
+        assert(len > 0 && len <= mux_caps.max_packet_len);
+
+        headers[j].len      = htons(len);
+        headers[j].src_port = htons(mux_ctx->port);
+        headers[j].dst_port = htons(mux_ctx->peer_port);
+        frame_iov[0].iov_base = &headers[j];
+        frame_iov[0].iov_len  = sizeof(headers[j]);
+
+        total += len;
+    }
+
+    if (_mux_send(mux_ctx->channel, io_iov, num_packets * (iovcnt + 1)) < 0)
+        return -1;
+
+    return total;
+}
+
+/* packets are never held back */
+int _network_flush(network_context_t *ctx)
+{
+    assert(ctx);
+    return 0;
+}
+
+/* only a listening mysocket needs a thread of its own, to accept channels;
+ * everything else is received by the channels' threads.
+ */
+int _network_start_recv_thread(mysock_context_t *ctx)
+{
+    network_context_mux_t *mux_ctx;
+
+    assert(ctx);
+
+    mux_ctx = GET_MUX(&ctx->network_state);
+    assert(mux_ctx);
+
+    if (ctx->listening)
+    {
+        assert(mux_ctx->listen_sd != -1 && mux_ctx->exit_pipe[0] != -1);
+
+        PTHREAD_CALL(pthread_mutex_lock(&mux_lock));
+        mux_ctx->accepting = TRUE;
+        PTHREAD_CALL(pthread_mutex_unlock(&mux_lock));
+
+        mux_ctx->accept_thread = _mysock_create_thread(
+            mux_accept_thread_func, ctx, FALSE);
+        mux_ctx->accept_thread_started = TRUE;
+    }
+
+    return 0;
+}
+
+/* stop receiving packets; the peer (if any) sees EOF */
+void _network_stop_recv_thread(mysock_context_t *ctx)
+{
+    network_context_mux_t *mux_ctx;
+
+    assert(ctx);
+
+    mux_ctx = GET_MUX(&ctx->network_state);
+    assert(mux_ctx);
+
+    _mux_detach(mux_ctx);
+
+    if (mux_ctx->accept_thread_started)
+    {
+        char dummy = 'X';
+
+        /* no more SYNs are dispatched once those in progress are done */
+        PTHREAD_CALL(pthread_mutex_lock(&mux_lock));
+        mux_ctx->accepting = FALSE;
+        while (mux_ctx->dispatching > 0)
+            PTHREAD_CALL(pthread_cond_wait(&mux_cond, &mux_lock));
+        PTHREAD_CALL(pthread_mutex_unlock(&mux_lock));
+
+        if (write(mux_ctx->exit_pipe[1], &dummy, sizeof(dummy)) < 0)
+        {
+            assert(0);
+            abort();
+        }
+
+        PTHREAD_CALL(pthread_join(mux_ctx->accept_thread, NULL));
+        mux_ctx->accept_thread_started = FALSE;
+    }
+}
+
+
+/* bind a kernel TCP socket to the given address, and reserve the same
+ * port.  if the kernel picks a port that's taken by a mysocket without a
+ * kernel socket, another is tried.  mux_lock must be held.
+ */
+static int _mux_bind_kernel(network_context_mux_t *mux_ctx,
+                            struct sockaddr *addr, int addrlen)
+{
+    unsigned int k;
+
+    assert(mux_ctx && addr && mux_ctx->listen_sd == -1);
+
+    for (k = 0; k < MUX_BIND_TRIES; ++k)
+    {
+        struct sockaddr_in sin;
+        socklen_t sin_len = sizeof(sin);
+        int sd;
+
+        if ((sd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+            return -1;
+
+        if (bind(sd, addr, addrlen) < 0 ||
+            getsockname(sd, (struct sockaddr *) &sin, &sin_len) < 0)
+        {
+            int saved_errno = errno;
+
+            close(sd);
+            errno = saved_errno;
+            return -1;
+        }
+
+        if (!port_table[ntohs(sin.sin_port)])
+        {
+            mux_ctx->listen_sd = sd;
+            mux_ctx->port = ntohs(sin.sin_port);
+            return 0;
+        }
+
+        close(sd);
+        if (((struct sockaddr_in *) addr)->sin_port != 0)
+            break;
+    }
+
+    errno = EADDRINUSE;
+    return -1;
+}
+
+/* attach an active mysocket to the channel to its peer's endpoint,
+ * connecting one if there isn't one already.  if this fails, the
+ * mysocket sees EOF.
+ */
+static int _mux_attach_active(network_context_t *ctx)
+{
+    network_context_mux_t *mux_ctx;
+    const struct sockaddr_in *peer;
+    mux_channel_t *channel;
+
+    assert(ctx);
+
+    mux_ctx = GET_MUX(ctx);
+    assert(mux_ctx && mux_ctx->port);
+
+    if (mux_ctx->attach_failed)
+    {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    peer = (const struct sockaddr_in *) &ctx->peer_addr;
+    assert(peer->sin_port > 0);
+
+    PTHREAD_CALL(pthread_mutex_lock(&connect_lock));
+    PTHREAD_CALL(pthread_mutex_lock(&mux_lock));
+    for (channel = channel_list; channel; channel = channel->next)
+    {
+        if (channel->peer_ip == peer->sin_addr.s_addr &&
+            channel->peer_port == peer->sin_port && !channel->closing)
+        {
+            _mux_attach(mux_ctx, channel, ntohs(peer->sin_port));
+            break;
+        }
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&mux_lock));
+
+    if (!channel)
+    {
+        int sd;
+
+        DEBUG_LOG(("connecting new channel for my_sd=%d...\n",
+                   mux_ctx->sock_ctx->my_sd));
+
+        if ((sd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+            connect(sd, (const struct sockaddr *) peer, sizeof(*peer)) < 0)
+        {
+            int saved_errno = errno;
+
+            perror("connect (_mux_attach_active)");
+            if (sd >= 0)
+                close(sd);
+            PTHREAD_CALL(pthread_mutex_unlock(&connect_lock));
+
+            mux_ctx->attach_failed = TRUE;
+            _network_deliver_v(mux_ctx->sock_ctx, NULL, 0);
+            errno = saved_errno;
+            return -1;
+        }
+
+        _mux_set_nodelay(sd);
+        channel = _mux_new_channel(sd, peer, TRUE);
+
+        /* (nobody else can find it until connect_lock is released, but
+         * the peer may have closed it already)
+         */
+        PTHREAD_CALL(pthread_mutex_lock(&mux_lock));
+        if (!channel->closed)
+            _mux_attach(mux_ctx, channel, ntohs(peer->sin_port));
+        PTHREAD_CALL(pthread_mutex_unlock(&mux_lock));
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&connect_lock));
+
+    if (!mux_ctx->channel)
+    {
+        /* lost before we could use it */
+        mux_ctx->attach_failed = TRUE;
+        _network_deliver_v(mux_ctx->sock_ctx, NULL, 0);
+        errno = ECONNRESET;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* add the mysocket to the channel, for packets from peer_port.  mux_lock
+ * must be held.
+ */
+static void _mux_attach(network_context_mux_t *mux_ctx,
+                        mux_channel_t *channel, uint16_t peer_port)
+{
+    mux_conn_key_t key;
+
+    assert(mux_ctx && channel && !mux_ctx->channel);
+    assert(!channel->closed);
+
+    key.channel    = channel;
+    key.local_port = mux_ctx->port;
+    key.peer_port  = peer_port;
+
+    if (HASH_LOOKUP_PTR(conn_table, key))
+    {
+        /* as on a real network, the packets of a stale connection are
+         * just dropped once a new one has taken its place
+         */
+        DEBUG_LOG(("replacing connection %u:%u on channel\n",
+                   (unsigned) key.local_port, (unsigned) peer_port));
+        HASH_DELETE(conn_table, key);
+    }
+    HASH_INSERT(conn_table, key, mux_ctx->sock_ctx);
+
+    mux_ctx->channel   = channel;
+    mux_ctx->peer_port = peer_port;
+    mux_ctx->demuxed   = TRUE;
+
+    mux_ctx->prev_conn = NULL;
+    mux_ctx->next_conn = channel->conns;
+    if (channel->conns)
+        channel->conns->prev_conn = mux_ctx;
+    channel->conns = mux_ctx;
+    ++channel->refs;
+}
+
+/* remove the mysocket from its channel (if any), telling the peer.  an
+ * active channel is closed once nothing is left on it.
+ */
+static void _mux_detach(network_context_mux_t *mux_ctx)
+{
+    mux_channel_t *channel;
+    bool_t notify_peer;
+
+    assert(mux_ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&mux_lock));
+    if (!(channel = mux_ctx->channel))
+    {
+        PTHREAD_CALL(pthread_mutex_unlock(&mux_lock));
+        return;
+    }
+
+    notify_peer = mux_ctx->demuxed && !channel->closed;
+    if (mux_ctx->demuxed)
+    {
+        mux_conn_key_t key;
+
+        key.channel    = channel;
+        key.local_port = mux_ctx->port;
+        key.peer_port  = mux_ctx->peer_port;
+        if (HASH_LOOKUP_PTR(conn_table, key) == mux_ctx->sock_ctx)
+            HASH_DELETE(conn_table, key);
+        mux_ctx->demuxed = FALSE;
+    }
+
+    if (mux_ctx->prev_conn)
+        mux_ctx->prev_conn->next_conn = mux_ctx->next_conn;
+    else
+        channel->conns = mux_ctx->next_conn;
+    if (mux_ctx->next_conn)
+        mux_ctx->next_conn->prev_conn = mux_ctx->prev_conn;
+    mux_ctx->prev_conn = mux_ctx->next_conn = NULL;
+    mux_ctx->channel = NULL;
+    PTHREAD_CALL(pthread_mutex_unlock(&mux_lock));
+
+    /* the channel can't go away while we still hold our reference */
+    if (notify_peer)
+    {
+        mux_header_t header;
+        struct iovec iov;
+
+        header.len      = 0;
+        header.src_port = htons(mux_ctx->port);
+        header.dst_port = htons(mux_ctx->peer_port);
+        iov.iov_base = &header;
+        iov.iov_len  = sizeof(header);
+        (void) _mux_send(channel, &iov, 1);
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&mux_lock));
+    if (channel->active && !channel->conns && !channel->closing)
+    {
+        /* the receive thread sees EOF, and drops the last reference */
+        DEBUG_LOG(("closing idle channel...\n"));
+        channel->closing = TRUE;
+        (void) shutdown(channel->sd, SHUT_RDWR);
+    }
+    _mux_release_channel(channel);
+    PTHREAD_CALL(pthread_mutex_unlock(&mux_lock));
+}
+
+/* set up a channel over the given connected socket, and start its receive
+ * thread
+ */
+static mux_channel_t *_mux_new_channel(int sd, const struct sockaddr_in *peer,
+                                       bool_t active)
+{
+    mux_channel_t *channel;
+
+    assert(sd >= 0 && peer);
+
+    channel = (mux_channel_t *) calloc(1, sizeof(*channel));
+    assert(channel);
+
+    channel->sd        = sd;
+    channel->peer_ip   = peer->sin_addr.s_addr;
+    channel->peer_port = peer->sin_port;
+    channel->active    = active;
+    channel->refs      = 1;     /* the receive thread's */
+    PTHREAD_CALL(pthread_mutex_init(&channel->send_lock, NULL));
+
+    if (active)
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&mux_lock));
+        channel->next = channel_list;
+        channel_list = channel;
+        PTHREAD_CALL(pthread_mutex_unlock(&mux_lock));
+    }
+
+    (void) _mysock_create_thread(mux_channel_thread_func, channel, TRUE);
+    return channel;
+}
+
+/* drop a reference to the channel, freeing it if it was the last.  mux_lock
+ * must be held.
+ */
+static void _mux_release_channel(mux_channel_t *channel)
+{
+    assert(channel && channel->refs > 0);
+
+    if (--channel->refs > 0)
+        return;
+
+    assert(channel->closed && !channel->conns);
+    close(channel->sd);
+    PTHREAD_CALL(pthread_mutex_destroy(&channel->send_lock));
+    free(channel);
+}
+
+/* write all of the given iovec to the channel, which is updated as data is
+ * written
+ */
+static int _mux_send(mux_channel_t *channel, struct iovec *iov, int iovcnt)
+{
+    int rc = 0;
+
+    assert(channel && iov && iovcnt > 0);
+
+    PTHREAD_CALL(pthread_mutex_lock(&channel->send_lock));
+    while (iovcnt > 0)
+    {
+        struct msghdr msg;
+        ssize_t len;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov    = iov;
+        msg.msg_iovlen = MIN(iovcnt, IOV_MAX);
+
+        if ((len = sendmsg(channel->sd, &msg, MSG_NOSIGNAL)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            DEBUG_LOG(("_mux_send failed (errno=%d)\n", errno));
+            rc = -1;
+            break;
+        }
+
+        /* skip past whatever was written */
+        for (; iovcnt > 0 && (size_t) len >= iov->iov_len; ++iov, --iovcnt)
+            len -= iov->iov_len;
+
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *) iov->iov_base + len;
+            iov->iov_len -= len;
+        }
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&channel->send_lock));
+
+    return rc;
+}
+
+/* hand each complete packet in the channel's receive buffer to its
+ * mysocket, or to the listening mysocket if it's not (yet) known.
+ * consecutive packets for the same mysocket are delivered together.
+ */
+static void _mux_dispatch(mux_channel_t *channel)
+{
+    struct iovec batch[MUX_DELIVER_BATCH];
+    mysock_context_t *batch_ctx = NULL;
+    int batch_len = 0;
+
+    assert(channel);
+
+    PTHREAD_CALL(pthread_mutex_lock(&mux_lock));
+    for (;;)
+    {
+        size_t avail = channel->recv_end - channel->recv_start;
+        char *packet = channel->recv_buf + channel->recv_start;
+        mysock_context_t *sock_ctx;
+        mux_header_t header;
+        mux_conn_key_t key;
+        uint16_t len;
+
+        if (avail < sizeof(header))
+            break;
+
+        memcpy(&header, packet, sizeof(header));
+        len = ntohs(header.len);
+
+        if (avail < sizeof(header) + len)
+            break;
+
+        packet += sizeof(header);
+        channel->recv_start += sizeof(header) + len;
+
+        /* (recv_buf holds a packet of any length the header allows, so an
+         * oversized one can just be skipped)
+         */
+        if (len > mux_caps.max_packet_len)
+        {
+            _network_report_oversized(len, mux_caps.max_packet_len);
+            continue;
+        }
+
+        key.channel    = channel;
+        key.local_port = ntohs(header.dst_port);
+        key.peer_port  = ntohs(header.src_port);
+        sock_ctx = HASH_LOOKUP_PTR(conn_table, key);
+
+        if (batch_len > 0 && (sock_ctx != batch_ctx || len == 0 ||
+                              batch_len == MUX_DELIVER_BATCH))
+        {
+            _network_deliver(batch_ctx, batch, batch_len);
+            batch_len = 0;
+        }
+
+        if (sock_ctx && len > 0)
+        {
+            batch_ctx = sock_ctx;
+            batch[batch_len].iov_base = packet;
+            batch[batch_len].iov_len  = len;
+            ++batch_len;
+        }
+        else if (sock_ctx)
+        {
+            /* the peer has stopped receiving */
+            GET_MUX(&sock_ctx->network_state)->demuxed = FALSE;
+            HASH_DELETE(conn_table, key);
+            _network_deliver_v(sock_ctx, NULL, 0);
+        }
+        else if (len > 0)
+        {
+            mysock_context_t *listen_ctx = port_table[key.local_port];
+            network_context_mux_t *listen_mux_ctx;
+            struct sockaddr_in peer_addr;
+
+            if (!listen_ctx || !listen_ctx->listening ||
+                !(listen_mux_ctx = GET_MUX(&listen_ctx->network_state))->
+                    accepting)
+            {
+                DEBUG_LOG(("no mysocket for port %u\n",
+                           (unsigned) key.local_port));
+                continue;
+            }
+
+            memset(&peer_addr, 0, sizeof(peer_addr));
+            peer_addr.sin_family      = AF_INET;
+            peer_addr.sin_addr.s_addr = channel->peer_ip;
+            peer_addr.sin_port        = header.src_port;
+
+            /* the listening mysocket can't be closed while its SYN is
+             * dispatched (see _network_stop_recv_thread()), but mux_lock
+             * can't be held as listen_lock is taken
+             */
+            ++listen_mux_ctx->dispatching;
+            PTHREAD_CALL(pthread_mutex_unlock(&mux_lock));
+
+            (void) _mysock_enqueue_connection(listen_ctx, packet, len,
+                                              (struct sockaddr *) &peer_addr,
+                                              sizeof(peer_addr), channel);
+
+            PTHREAD_CALL(pthread_mutex_lock(&mux_lock));
+            if (--listen_mux_ctx->dispatching == 0)
+                PTHREAD_CALL(pthread_cond_broadcast(&mux_cond));
+        }
+    }
+
+    if (batch_len > 0)
+        _network_deliver(batch_ctx, batch, batch_len);
+    PTHREAD_CALL(pthread_mutex_unlock(&mux_lock));
+}
+
+/* there's no MTU on a channel, so packets can be as large as the frame
+ * header allows
+ */
+static void _mux_init_caps(void)
+{
+    mux_caps.max_packet_len = _network_max_packet_len(MAX_JUMBO_PACKET_LEN);
+}
+
+/* Nagle's algorithm is disabled, as for the TCP network layer */
+static void _mux_set_nodelay(int sd)
+{
+    int on = 1;
+
+    if (setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0)
+    {
+        DEBUG_LOG(("couldn't set TCP_NODELAY on socket %d (errno=%d)\n",
+                   sd, errno));
+    }
+}
+
+/* read packets from the channel until it's closed, then signal EOF to
+ * whatever is still on it
+ */
+static void *mux_channel_thread_func(void *arg_ptr)
+{
+    mux_channel_t *channel = (mux_channel_t *) arg_ptr;
+    network_context_mux_t *mux_ctx;
+
+    assert(channel);
+    DEBUG_LOG(("started channel receive thread\n"));
+
+    for (;;)
+    {
+        ssize_t rc;
+
+        /* packets dispatched by the last pass have been consumed, so the
+         * buffer can be compacted before reading more
+         */
+        if (channel->recv_start > 0)
+        {
+            memmove(channel->recv_buf,
+                    channel->recv_buf + channel->recv_start,
+                    channel->recv_end - channel->recv_start);
+            channel->recv_end  -= channel->recv_start;
+            channel->recv_start = 0;
+        }
+
+        assert(channel->recv_end < sizeof(channel->recv_buf));
+        if ((rc = read(channel->sd, channel->recv_buf + channel->recv_end,
+                       sizeof(channel->recv_buf) - channel->recv_end)) <= 0)
+        {
+            if (rc < 0 && errno == EINTR)
+                continue;
+
+            DEBUG_LOG(("channel closed: %d\n", (int) rc));
+            break;  /* EOF or error */
+        }
+
+        channel->recv_end += rc;
+        _mux_dispatch(channel);
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&mux_lock));
+    channel->closing = channel->closed = TRUE;
+
+    if (channel->active)
+    {
+        mux_channel_t **iter;
+
+        for (iter = &channel_list; *iter != channel; iter = &(*iter)->next)
+            assert(*iter);
+        *iter = channel->next;
+    }
+
+    for (mux_ctx = channel->conns; mux_ctx; mux_ctx = mux_ctx->next_conn)
+    {
+        if (mux_ctx->demuxed)
+        {
+            mux_conn_key_t key;
+
+            key.channel    = channel;
+            key.local_port = mux_ctx->port;
+            key.peer_port  = mux_ctx->peer_port;
+            HASH_DELETE(conn_table, key);
+            mux_ctx->demuxed = FALSE;
+            _network_deliver_v(mux_ctx->sock_ctx, NULL, 0);
+        }
+    }
+
+    _mux_release_channel(channel);
+    PTHREAD_CALL(pthread_mutex_unlock(&mux_lock));
+
+    return NULL;
+}
+
+/* accept channels from peers, until the exit request */
+static void *mux_accept_thread_func(void *arg_ptr)
+{
+    mysock_context_t *ctx = (mysock_context_t *) arg_ptr;
+    network_context_mux_t *mux_ctx;
+
+    assert(ctx && ctx->listening);
+
+    mux_ctx = GET_MUX(&ctx->network_state);
+    assert(mux_ctx);
+
+    for (;;)
+    {
+        struct pollfd fds[] =
+        {
+            { mux_ctx->exit_pipe[0], POLLIN, 0 },
+            { mux_ctx->listen_sd, POLLIN, 0 }
+        };
+        struct sockaddr_in peer_addr;
+        socklen_t peer_addr_len = sizeof(peer_addr);
+        int sd;
+
+        if (poll(fds, sizeof(fds) / sizeof(fds[0]), -1) < 0)
+        {
+            assert(errno == EINTR);
+            continue;
+        }
+
+        if (fds[0].revents)
+            break;
+        if (!fds[1].revents)
+            continue;
+
+        if ((sd = accept(mux_ctx->listen_sd, (struct sockaddr *) &peer_addr,
+                         &peer_addr_len)) < 0)
+        {
+            DEBUG_LOG(("accept failed (errno=%d)\n", errno));
+            continue;
+        }
+
+        DEBUG_LOG(("accepted channel, sd=%d...\n", sd));
+        _mux_set_nodelay(sd);
+        (void) _mux_new_channel(sd, &peer_addr, FALSE);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,1095 @@
+/* network_io_shm.c: shared memory instantiation of the underlying datagram
+ * service, for peers running on the same host.
+ */
+
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "mysock_impl.h"
+#include "network_io.h"
+#include "connection_demux.h"
+
+
+/* a few words about the shared memory network layer...
+ *
+ * packets are passed between processes on the same host through shared
+ * memory, without any copies through the kernel.  all mysockets have the
+ * address 127.0.0.1; ports are allocated by creating a POSIX shared memory
+ * segment named after the port (see SHM_NAME_FORMAT), so they're unique
+ * across processes.
+ *
+ *   - a listening mysocket's segment holds SHM_MAX_CONNECTIONS connection
+ *     slots, each with a pair of packet rings (one per direction).  the
+ *     active side maps the segment, claims a free slot, and writes its SYN
+ *     to the slot's ring.  the listening mysocket's receive thread
+ *     dispatches the SYN with _mysock_enqueue_connection(), as for any
+ *     other network layer; _network_update_passive_state() then maps the
+ *     segment again for the new mysocket, which reads the rest of the
+ *     connection's packets.
+ *   - each ring has a single producer (the sending mysocket's transport
+ *     thread) and a single consumer (the receiving mysocket's receive
+ *     thread), so needs no locks.  a side waiting for the ring to become
+ *     non-empty (or non-full) sleeps on a futex "doorbell" in the ring,
+ *     which is only rung if it's known to be waiting.  (eventfds can't be
+ *     shared between unrelated processes without a socket to pass them
+ *     over).
+ *   - when either side stops receiving, its peer sees EOF once it has read
+ *     everything already sent, just as with the TCP network layer.  the
+ *     slot is freed once both sides have finished with it.  a peer that
+ *     dies without closing is noticed within SHM_PEER_CHECK_SECS.
+ *
+ * this is Linux-only, as it relies on futexes.
+ */
+
+#define SHM_NAME_FORMAT        "/stcp-shm.%u"
+#define SHM_NAME_LEN           32
+#define SHM_MAGIC              0x5354434dU
+
+#define SHM_EPHEMERAL_MIN      49152
+#define SHM_NUM_PORTS          65536
+
+#define SHM_MAX_CONNECTIONS    16
+#define SHM_RING_LEN           64       /* packets; must be a power of 2 */
+#define SHM_RECV_BATCH_SIZE    32
+#define SHM_PEER_CHECK_SECS    1
+#define SHM_CACHE_LINE         64
+
+/* size of each ring slot, and so the largest packet that can be carried
+ * at any STCP_MTU.  only the part of a slot that's used is ever touched,
+ * so the (sparse) segment costs little more than with smaller slots.
+ */
+#define SHM_MAX_PACKET_LEN     MAX_JUMBO_PACKET_LEN
+
+/* connection slot states */
+#define SHM_CONN_FREE          0
+#define SHM_CONN_CLAIMED       1    /* being set up by the active side */
+#define SHM_CONN_CONNECTING    2    /* waiting for the listener */
+#define SHM_CONN_ACCEPTED      3
+
+/* bits in shm_connection_t.closed */
+#define SHM_ACTIVE_CLOSED      1
+#define SHM_PASSIVE_CLOSED     2
+
+/* ring indices in shm_connection_t */
+#define SHM_TO_PASSIVE         0
+#define SHM_TO_ACTIVE          1
+
+typedef struct
+{
+    uint32_t len;
+    char     data[SHM_MAX_PACKET_LEN];
+} shm_packet_t;
+
+/* single-producer, single-consumer packet ring.  head and tail count the
+ * packets written and read so far.
+ */
+typedef struct
+{
+    /* written by the producer */
+    uint32_t head;
+    uint32_t data_doorbell;     /* rung when head moves on... */
+    uint32_t data_waiting;      /* ...if the consumer has set this */
+    char     pad1[SHM_CACHE_LINE - 3 * sizeof(uint32_t)];
+
+    /* written by the consumer */
+    uint32_t tail;
+    uint32_t space_doorbell;    /* rung when tail moves on... */
+    uint32_t space_waiting;     /* ...if the producer has set this */
+    char     pad2[SHM_CACHE_LINE - 3 * sizeof(uint32_t)];
+
+    shm_packet_t packets[SHM_RING_LEN];
+} shm_ring_t;
+
+typedef struct
+{
+    uint32_t   state;
+    uint32_t   closed;
+    pid_t      active_pid;
+    uint32_t   active_port;     /* host byte order */
+    char       pad[SHM_CACHE_LINE - 3 * sizeof(uint32_t) - sizeof(pid_t)];
+
+    shm_ring_t rings[2];        /* SHM_TO_PASSIVE, SHM_TO_ACTIVE */
+} shm_connection_t;
+
+/* the segment published for each bound port */
+typedef struct
+{
+    uint32_t magic;             /* set once the segment is initialised */
+    pid_t    owner;
+    uint32_t listening;
+    uint32_t accept_doorbell;   /* rung whenever a SYN is written */
+    char     pad[SHM_CACHE_LINE - 3 * sizeof(uint32_t) - sizeof(pid_t)];
+
+    shm_connection_t connections[SHM_MAX_CONNECTIONS];
+} shm_segment_t;
+
+typedef struct
+{
+    mysock_context_t *sock_ctx;
+    uint16_t          port;         /* host byte order; 0 if unbound */
+
+    /* the segment published for our port */
+    int               shm_fd;
+    shm_segment_t    *segment;
+
+    /* the connection, once set up.  it lies within conn_segment, our
+     * mapping of the listening mysocket's segment.  conn, rx_ring and
+     * tx_ring are only set with lock held.
+     */
+    shm_segment_t    *conn_segment;
+    shm_connection_t *conn;
+    shm_ring_t       *rx_ring, *tx_ring;
+    uint32_t          closed_flag, peer_closed_flag;
+    pid_t             peer_pid;
+    bool_t            closed;       /* closed_flag has been set */
+
+    /* the receive thread of an active mysocket waits on cond until the
+     * connection is set up.
+     */
+    pthread_mutex_t   lock;
+    pthread_cond_t    cond;
+    uint32_t          stopping;
+
+    pthread_t         recv_thread;
+    bool_t            recv_thread_started;
+} network_context_shm_t;
+
+#define GET_SHM(net_ctx) ((network_context_shm_t *) (net_ctx)->impl_data)
+
+static network_caps_t shm_caps =
+{
+    TRUE,               /* csum_offload */
+    0,                  /* max_packet_len (see _shm_init_caps()) */
+    1                   /* max_segments */
+};
+static pthread_once_t shm_caps_once = PTHREAD_ONCE_INIT;
+
+static unsigned int next_ephemeral_port = SHM_EPHEMERAL_MIN;
+static pthread_mutex_t shm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void _shm_init_caps(void);
+static int _shm_publish(network_context_shm_t *shm_ctx, unsigned int port);
+static bool_t _shm_is_stale(const char *name);
+static shm_segment_t *_shm_map(int fd);
+static int _shm_connect(network_context_t *ctx);
+static void _shm_attach(network_context_shm_t *shm_ctx,
+                        shm_segment_t *segment, int index, bool_t is_active);
+static void _shm_close_connection(shm_connection_t *conn, uint32_t flag);
+static void _shm_close_for_peer(network_context_shm_t *shm_ctx);
+static void _shm_connection_closed(shm_connection_t *conn, uint32_t closed);
+static bool_t _shm_ring_put(network_context_shm_t *shm_ctx,
+                            const struct iovec *iov, int iovcnt, size_t len);
+static int _shm_ring_peek(shm_ring_t *ring,
+                          struct iovec *packets, int max_packets);
+static void _shm_ring_consume(shm_ring_t *ring, int num_packets);
+static void _shm_ring_doorbell(uint32_t *doorbell, uint32_t *waiting);
+static void _shm_kick(uint32_t *doorbell);
+static bool_t _shm_futex_wait(uint32_t *addr, uint32_t val);
+static bool_t _shm_peer_alive(pid_t pid);
+static void *shm_recv_thread_func(void *arg_ptr);
+static void *shm_listen_thread_func(void *arg_ptr);
+
+
+int _network_init(mysock_context_t *sock_ctx, network_context_t *net_ctx)
+{
+    network_context_shm_t *shm_ctx;
+
+    assert(sock_ctx && net_ctx);
+
+    PTHREAD_CALL(pthread_once(&shm_caps_once, _shm_init_caps));
+
+    memset(net_ctx, 0, sizeof(*net_ctx));
+    net_ctx->random_seed = 0x632a;
+
+    shm_ctx = (network_context_shm_t *) calloc(1, sizeof(*shm_ctx));
+    assert(shm_ctx);
+
+    shm_ctx->sock_ctx = sock_ctx;
+    shm_ctx->shm_fd   = -1;
+    PTHREAD_CALL(pthread_mutex_init(&shm_ctx->lock, NULL));
+    PTHREAD_CALL(pthread_cond_init(&shm_ctx->cond, NULL));
+
+    net_ctx->impl_data = shm_ctx;
+    return 0;
+}
+
+void _network_close(network_context_t *ctx)
+{
+    network_context_shm_t *shm_ctx;
+
+    assert(ctx);
+
+    shm_ctx = GET_SHM(ctx);
+    assert(shm_ctx);
+    assert(!shm_ctx->recv_thread_started);
+
+    if (shm_ctx->conn && !shm_ctx->closed)
+        _shm_close_connection(shm_ctx->conn, shm_ctx->closed_flag);
+    if (shm_ctx->conn_segment)
+        munmap(shm_ctx->conn_segment, sizeof(shm_segment_t));
+
+    if (shm_ctx->segment)
+    {
+        char name[SHM_NAME_LEN];
+
+        snprintf(name, sizeof(name), SHM_NAME_FORMAT, shm_ctx->port);
+        shm_unlink(name);
+        munmap(shm_ctx->segment, sizeof(shm_segment_t));
+    }
+    if (shm_ctx->shm_fd >= 0)
+        close(shm_ctx->shm_fd);
+
+    PTHREAD_CALL(pthread_cond_destroy(&shm_ctx->cond));
+    PTHREAD_CALL(pthread_mutex_destroy(&shm_ctx->lock));
+    free(shm_ctx);
+    ctx->impl_data = NULL;
+}
+
+const network_caps_t *_network_get_caps(network_context_t *ctx)
+{
+    assert(ctx);
+    return &shm_caps;
+}
+
+/* publish a segment for the given port (or an ephemeral port, if it's 0) */
+int _network_bind(network_context_t *ctx, struct sockaddr *addr, int addrlen)
+{
+    network_context_shm_t *shm_ctx;
+    unsigned int port, k;
+
+    assert(ctx && addr);
+
+    shm_ctx = GET_SHM(ctx);
+    assert(shm_ctx);
+
+    if (addr->sa_family != AF_INET || addrlen < (int) sizeof(struct sockaddr_in))
+    {
+        errno = EAFNOSUPPORT;
+        return -1;
+    }
+
+    if (shm_ctx->port)
+    {
+        errno = EINVAL;     /* already bound */
+        return -1;
+    }
+
+    if ((port = ntohs(((struct sockaddr_in *) addr)->sin_port)) != 0)
+        return _shm_publish(shm_ctx, port);
+
+    for (k = 0; k < SHM_NUM_PORTS - SHM_EPHEMERAL_MIN; ++k)
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&shm_lock));
+        port = next_ephemeral_port;
+        if (++next_ephemeral_port == SHM_NUM_PORTS)
+            next_ephemeral_port = SHM_EPHEMERAL_MIN;
+        PTHREAD_CALL(pthread_mutex_unlock(&shm_lock));
+
+        if (_shm_publish(shm_ctx, port) == 0)
+            return 0;
+        if (errno != EADDRINUSE)
+            return -1;
+    }
+
+    return -1;
+}
+
+int _network_listen(network_context_t *ctx, int backlog)
+{
+    assert(ctx);
+    assert(GET_SHM(ctx)->segment);
+
+    return 0;
+}
+
+int _network_get_port(network_context_t *ctx)
+{
+    assert(ctx && GET_SHM(ctx));
+    return htons(GET_SHM(ctx)->port);
+}
+
+/* everything is local */
+uint32_t _network_get_interface_ip(uint32_t peer_addr)
+{
+    return htonl(INADDR_LOOPBACK);
+}
+
+/* attach the new context to the connection slot whose SYN was dispatched
+ * (user_data is its index).
+ */
+void _network_update_passive_state(network_context_t *new_ctx,
+                                   network_context_t *accept_ctx,
+                                   void *user_data,
+                                   const void *syn_packet, size_t syn_len)
+{
+    network_context_shm_t *new_shm_ctx, *accept_shm_ctx;
+    shm_segment_t *segment;
+    int index = (int) (intptr_t) user_data;
+
+    assert(new_ctx && accept_ctx && syn_packet);
+    assert(index >= 0 && index < SHM_MAX_CONNECTIONS);
+
+    new_shm_ctx    = GET_SHM(new_ctx);
+    accept_shm_ctx = GET_SHM(accept_ctx);
+    assert(new_shm_ctx && accept_shm_ctx);
+    assert(accept_shm_ctx->segment && accept_shm_ctx->shm_fd >= 0);
+
+    /* the new context shares the listening port, as with TCP */
+    new_ctx->local_port = htons(accept_shm_ctx->port);
+
+    /* the mysocket has its own mapping, as it may outlive the listener */
+    if (!(segment = _shm_map(accept_shm_ctx->shm_fd)))
+    {
+        /* the new connection will just time out */
+        _shm_close_connection(&accept_shm_ctx->segment->connections[index],
+                              SHM_PASSIVE_CLOSED);
+        return;
+    }
+
+    _shm_attach(new_shm_ctx, segment, index, FALSE);
+}
+
+
+/* send the given packet to the peer */
+ssize_t _network_send_packet(network_context_t *ctx,
+                             const void *src, size_t len)
+{
+    struct iovec iov;
+
+    assert(src);
+
+    iov.iov_base = (void *) src;
+    iov.iov_len  = len;
+    return _network_send_packetv(ctx, &iov, 1);
+}
+
+/* write the packet gathered from the given pieces to the peer's ring,
+ * waiting for space if need be.  the first packet sent by an active
+ * mysocket (its SYN) sets up the connection.  if there's nobody to
+ * receive the packet, it's silently dropped.
+ */
+ssize_t _network_send_packetv(network_context_t *ctx,
+                              const struct iovec *iov, int iovcnt)
+{
+    network_context_shm_t *shm_ctx;
+    bool_t connecting = FALSE;
+    size_t len = 0;
+    int k;
+
+    assert(ctx && iov && iovcnt > 0);
+    assert(ctx->peer_addr_len > 0);
+    assert(ctx->peer_addr.sa_family == AF_INET);
+
+    shm_ctx = GET_SHM(ctx);
+    assert(shm_ctx);
+
+    for (k = 0; k < iovcnt; ++k)
+        len += iov[k].iov_len;
+    assert(len <= shm_caps.max_packet_len);
+
+    if (!shm_ctx->conn)
+    {
+        if (_shm_connect(ctx) < 0)
+            return len;
+        connecting = TRUE;
+    }
+
+    if (_shm_ring_put(shm_ctx, iov, iovcnt, len) && connecting)
+        _shm_kick(&shm_ctx->conn_segment->accept_doorbell);
+
+    return len;
+}
+
+/* put each of the given packets on the ring in turn */
+ssize_t _network_send_packets(network_context_t *ctx,
+                              const struct iovec *iov, int iovcnt,
+                              int num_packets)
+{
+    ssize_t total = 0;
+    int j;
+
+    assert(ctx && iov && iovcnt > 0);
+    assert(num_packets > 0 &&
+           (unsigned int) num_packets <= shm_caps.max_segments);
+
+    for (j = 0; j < num_packets; ++j, iov += iovcnt)
+    {
+        ssize_t len;
+
+        if ((len = _network_send_packetv(ctx, iov, iovcnt)) < 0)
+            return -1;
+        total += len;
+    }
+
+    return total;
+}
+
+/* packets are never held back */
+int _network_flush(network_context_t *ctx)
+{
+    assert(ctx);
+    return 0;
+}
+
+int _network_start_recv_thread(mysock_context_t *ctx)
+{
+    network_context_shm_t *shm_ctx;
+
+    assert(ctx);
+
+    shm_ctx = GET_SHM(&ctx->network_state);
+    assert(shm_ctx);
+
+    if (ctx->listening)
+    {
+        assert(shm_ctx->segment);
+        __atomic_store_n(&shm_ctx->segment->listening, 1, __ATOMIC_SEQ_CST);
+    }
+
+    shm_ctx->recv_thread = _mysock_create_thread(
+        ctx->listening ? shm_listen_thread_func : shm_recv_thread_func,
+        ctx, FALSE);
+    shm_ctx->recv_thread_started = TRUE;
+    return 0;
+}
+
+/* stop receiving packets; the peer (if any) sees EOF */
+void _network_stop_recv_thread(mysock_context_t *ctx)
+{
+    network_context_shm_t *shm_ctx;
+    shm_ring_t *rx_ring;
+    int k;
+
+    assert(ctx);
+
+    shm_ctx = GET_SHM(&ctx->network_state);
+    assert(shm_ctx);
+
+    if (!shm_ctx->recv_thread_started)
+        return;
+
+    PTHREAD_CALL(pthread_mutex_lock(&shm_ctx->lock));
+    __atomic_store_n(&shm_ctx->stopping, 1, __ATOMIC_SEQ_CST);
+    PTHREAD_CALL(pthread_cond_signal(&shm_ctx->cond));
+    rx_ring = shm_ctx->rx_ring;
+    PTHREAD_CALL(pthread_mutex_unlock(&shm_ctx->lock));
+
+    if (ctx->listening)
+    {
+        __atomic_store_n(&shm_ctx->segment->listening, 0, __ATOMIC_SEQ_CST);
+        _shm_kick(&shm_ctx->segment->accept_doorbell);
+    }
+    else if (rx_ring)
+    {
+        _shm_kick(&rx_ring->data_doorbell);
+    }
+
+    PTHREAD_CALL(pthread_join(shm_ctx->recv_thread, NULL));
+    shm_ctx->recv_thread_started = FALSE;
+
+    if (ctx->listening)
+    {
+        /* refuse any connections that were never dispatched */
+        for (k = 0; k < SHM_MAX_CONNECTIONS; ++k)
+        {
+            shm_connection_t *conn = &shm_ctx->segment->connections[k];
+            uint32_t state = SHM_CONN_CONNECTING;
+
+            if (__atomic_compare_exchange_n(&conn->state, &state,
+                                            SHM_CONN_ACCEPTED, FALSE,
+                                            __ATOMIC_SEQ_CST,
+                                            __ATOMIC_SEQ_CST))
+            {
+                _shm_close_connection(conn, SHM_PASSIVE_CLOSED);
+            }
+        }
+    }
+    else if (shm_ctx->conn && !shm_ctx->closed)
+    {
+        _shm_close_connection(shm_ctx->conn, shm_ctx->closed_flag);
+        shm_ctx->closed = TRUE;
+    }
+}
+
+
+/* packets are limited only by the size of a ring slot */
+static void _shm_init_caps(void)
+{
+    shm_caps.max_packet_len = _network_max_packet_len(SHM_MAX_PACKET_LEN);
+}
+
+/* create and map the segment for the given port */
+static int _shm_publish(network_context_shm_t *shm_ctx, unsigned int port)
+{
+    char name[SHM_NAME_LEN];
+    shm_segment_t *segment;
+    int fd, attempt;
+
+    assert(shm_ctx && !shm_ctx->segment);
+    assert(port > 0 && port < SHM_NUM_PORTS);
+
+    snprintf(name, sizeof(name), SHM_NAME_FORMAT, port);
+
+    /* a segment left behind by a process that died is reclaimed */
+    for (attempt = 0; ; ++attempt)
+    {
+        if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) >= 0 ||
+            errno != EEXIST || attempt > 0 || !_shm_is_stale(name))
+        {
+            break;
+        }
+
+        DEBUG_LOG(("reclaiming stale segment %s\n", name));
+        shm_unlink(name);
+    }
+
+    if (fd < 0)
+    {
+        if (errno == EEXIST)
+            errno = EADDRINUSE;
+        return -1;
+    }
+
+    if (ftruncate(fd, sizeof(shm_segment_t)) < 0 ||
+        !(segment = _shm_map(fd)))
+    {
+        int saved_errno = errno;
+
+        perror("_shm_publish");
+        shm_unlink(name);
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+
+    segment->owner = getpid();
+    __atomic_store_n(&segment->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+
+    shm_ctx->shm_fd  = fd;
+    shm_ctx->segment = segment;
+    shm_ctx->port    = port;
+    shm_ctx->sock_ctx->network_state.local_port = htons(port);
+    return 0;
+}
+
+/* returns TRUE if the named segment's owner has gone away */
+static bool_t _shm_is_stale(const char *name)
+{
+    shm_segment_t *segment;
+    struct stat st;
+    bool_t stale = FALSE;
+    int fd;
+
+    assert(name);
+
+    if ((fd = shm_open(name, O_RDONLY, 0)) < 0)
+        return FALSE;
+
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(shm_segment_t) &&
+        (segment = (shm_segment_t *) mmap(NULL, sizeof(shm_segment_t),
+                                          PROT_READ, MAP_SHARED,
+                                          fd, 0)) != MAP_FAILED)
+    {
+        stale = (__atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) ==
+                 SHM_MAGIC && !_shm_peer_alive(segment->owner));
+        munmap(segment, sizeof(shm_segment_t));
+    }
+
+    close(fd);
+    return stale;
+}
+
+static shm_segment_t *_shm_map(int fd)
+{
+    void *addr;
+
+    assert(fd >= 0);
+
+    addr = mmap(NULL, sizeof(shm_segment_t), PROT_READ | PROT_WRITE,
+                MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+    {
+        perror("mmap");
+        return NULL;
+    }
+
+    return (shm_segment_t *) addr;
+}
+
+/* claim a connection slot in the segment of the mysocket listening on the
+ * peer's port.  returns -1 if there isn't one, or it has no free slots.
+ */
+static int _shm_connect(network_context_t *ctx)
+{
+    network_context_shm_t *shm_ctx;
+    shm_segment_t *segment;
+    char name[SHM_NAME_LEN];
+    struct stat st;
+    int fd, k;
+
+    assert(ctx);
+
+    shm_ctx = GET_SHM(ctx);
+    assert(shm_ctx && shm_ctx->port && !shm_ctx->conn);
+
+    snprintf(name, sizeof(name), SHM_NAME_FORMAT,
+             ntohs(((struct sockaddr_in *) &ctx->peer_addr)->sin_port));
+
+    if ((fd = shm_open(name, O_RDWR, 0)) < 0)
+    {
+        DEBUG_LOG(("no segment %s\n", name));
+        return -1;
+    }
+
+    segment = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(shm_segment_t))
+        segment = _shm_map(fd);
+    close(fd);
+
+    if (!segment)
+        return -1;
+
+    if (__atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC ||
+        !__atomic_load_n(&segment->listening, __ATOMIC_SEQ_CST))
+    {
+        DEBUG_LOG(("%s isn't listening\n", name));
+        munmap(segment, sizeof(shm_segment_t));
+        return -1;
+    }
+
+    for (k = 0; k < SHM_MAX_CONNECTIONS; ++k)
+    {
+        shm_connection_t *conn = &segment->connections[k];
+        uint32_t state = SHM_CONN_FREE;
+        int j;
+
+        if (!__atomic_compare_exchange_n(&conn->state, &state,
+                                         SHM_CONN_CLAIMED, FALSE,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        {
+            continue;
+        }
+
+        for (j = 0; j < 2; ++j)
+        {
+            shm_ring_t *ring = &conn->rings[j];
+
+            ring->head = ring->tail = 0;
+            ring->data_waiting = ring->space_waiting = 0;
+        }
+        conn->closed      = 0;
+        conn->active_pid  = getpid();
+        conn->active_port = shm_ctx->port;
+        __atomic_store_n(&conn->state, SHM_CONN_CONNECTING, __ATOMIC_SEQ_CST);
+
+        /* the listener may have stopped meanwhile.  if it hasn't taken the
+         * slot back already, the connection is refused here.
+         */
+        if (!__atomic_load_n(&segment->listening, __ATOMIC_SEQ_CST))
+        {
+            state = SHM_CONN_CONNECTING;
+            if (__atomic_compare_exchange_n(&conn->state, &state,
+                                            SHM_CONN_FREE, FALSE,
+                                            __ATOMIC_SEQ_CST,
+                                            __ATOMIC_SEQ_CST))
+            {
+                munmap(segment, sizeof(shm_segment_t));
+                return -1;
+            }
+        }
+
+        _shm_attach(shm_ctx, segment, k, TRUE);
+        return 0;
+    }
+
+    DEBUG_LOG(("no free connections in %s\n", name));
+    munmap(segment, sizeof(shm_segment_t));
+    return -1;
+}
+
+/* take over our mapping of the given segment, and the given slot in it */
+static void _shm_attach(network_context_shm_t *shm_ctx,
+                        shm_segment_t *segment, int index, bool_t is_active)
+{
+    shm_connection_t *conn;
+
+    assert(shm_ctx && segment);
+    assert(index >= 0 && index < SHM_MAX_CONNECTIONS);
+    assert(!shm_ctx->conn_segment);
+
+    conn = &segment->connections[index];
+
+    PTHREAD_CALL(pthread_mutex_lock(&shm_ctx->lock));
+    shm_ctx->conn_segment = segment;
+    shm_ctx->conn         = conn;
+    if (is_active)
+    {
+        shm_ctx->rx_ring          = &conn->rings[SHM_TO_ACTIVE];
+        shm_ctx->tx_ring          = &conn->rings[SHM_TO_PASSIVE];
+        shm_ctx->closed_flag      = SHM_ACTIVE_CLOSED;
+        shm_ctx->peer_closed_flag = SHM_PASSIVE_CLOSED;
+        shm_ctx->peer_pid         = segment->owner;
+    }
+    else
+    {
+        shm_ctx->rx_ring          = &conn->rings[SHM_TO_PASSIVE];
+        shm_ctx->tx_ring          = &conn->rings[SHM_TO_ACTIVE];
+        shm_ctx->closed_flag      = SHM_PASSIVE_CLOSED;
+        shm_ctx->peer_closed_flag = SHM_ACTIVE_CLOSED;
+        shm_ctx->peer_pid         = conn->active_pid;
+    }
+    PTHREAD_CALL(pthread_cond_signal(&shm_ctx->cond));
+    PTHREAD_CALL(pthread_mutex_unlock(&shm_ctx->lock));
+}
+
+/* mark one side of the connection as finished, waking the other side.
+ * whichever side finishes last frees the slot.
+ */
+static void _shm_close_connection(shm_connection_t *conn, uint32_t flag)
+{
+    uint32_t prev;
+
+    assert(conn);
+    assert(flag == SHM_ACTIVE_CLOSED || flag == SHM_PASSIVE_CLOSED);
+
+    prev = __atomic_fetch_or(&conn->closed, flag, __ATOMIC_SEQ_CST);
+    assert(!(prev & flag));
+
+    _shm_connection_closed(conn, prev | flag);
+}
+
+/* the peer has gone away without closing its side of the connection, so
+ * close it on the peer's behalf; otherwise the slot would never be freed.
+ * either of our threads may find this out, so it's only done once.
+ */
+static void _shm_close_for_peer(network_context_shm_t *shm_ctx)
+{
+    uint32_t prev;
+
+    assert(shm_ctx && shm_ctx->conn);
+
+    prev = __atomic_fetch_or(&shm_ctx->conn->closed,
+                             shm_ctx->peer_closed_flag, __ATOMIC_SEQ_CST);
+    if (!(prev & shm_ctx->peer_closed_flag))
+    {
+        _shm_connection_closed(shm_ctx->conn,
+                               prev | shm_ctx->peer_closed_flag);
+    }
+}
+
+/* called once closed has just changed, as above */
+static void _shm_connection_closed(shm_connection_t *conn, uint32_t closed)
+{
+    int k;
+
+    assert(conn);
+
+    if (closed == (SHM_ACTIVE_CLOSED | SHM_PASSIVE_CLOSED))
+    {
+        __atomic_store_n(&conn->closed, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&conn->state, SHM_CONN_FREE, __ATOMIC_SEQ_CST);
+        return;
+    }
+
+    for (k = 0; k < 2; ++k)
+    {
+        _shm_kick(&conn->rings[k].data_doorbell);
+        _shm_kick(&conn->rings[k].space_doorbell);
+    }
+}
+
+/* write a packet to the peer, waiting while the ring is full.  returns
+ * FALSE if the packet was dropped, as the peer has gone away.
+ */
+static bool_t _shm_ring_put(network_context_shm_t *shm_ctx,
+                            const struct iovec *iov, int iovcnt, size_t len)
+{
+    shm_ring_t *ring;
+    shm_packet_t *packet;
+    uint32_t head;
+    size_t offset;
+    int k;
+
+    assert(shm_ctx && shm_ctx->conn && iov);
+
+    ring = shm_ctx->tx_ring;
+    head = ring->head;
+
+    for (;;)
+    {
+        uint32_t seq;
+
+        if (__atomic_load_n(&shm_ctx->conn->closed, __ATOMIC_ACQUIRE) &
+            shm_ctx->peer_closed_flag)
+        {
+            return FALSE;
+        }
+
+        if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) <
+            SHM_RING_LEN)
+        {
+            break;
+        }
+
+        seq = __atomic_load_n(&ring->space_doorbell, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&ring->space_waiting, 1, __ATOMIC_SEQ_CST);
+        if (head - __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) >=
+            SHM_RING_LEN &&
+            !_shm_futex_wait(&ring->space_doorbell, seq) &&
+            !_shm_peer_alive(shm_ctx->peer_pid))
+        {
+            DEBUG_LOG(("peer %d has gone away\n", (int) shm_ctx->peer_pid));
+            __atomic_store_n(&ring->space_waiting, 0, __ATOMIC_SEQ_CST);
+            _shm_close_for_peer(shm_ctx);
+            return FALSE;
+        }
+        __atomic_store_n(&ring->space_waiting, 0, __ATOMIC_SEQ_CST);
+    }
+
+    packet = &ring->packets[head % SHM_RING_LEN];
+    for (k = 0, offset = 0; k < iovcnt; ++k)
+    {
+        memcpy(packet->data + offset, iov[k].iov_base, iov[k].iov_len);
+        offset += iov[k].iov_len;
+    }
+    packet->len = len;
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    _shm_ring_doorbell(&ring->data_doorbell, &ring->data_waiting);
+    return TRUE;
+}
+
+/* return up to max_packets packets waiting in the ring, without removing
+ * them.  they're left in the ring until _shm_ring_consume().
+ */
+static int _shm_ring_peek(shm_ring_t *ring,
+                          struct iovec *packets, int max_packets)
+{
+    uint32_t tail, head;
+    int k;
+
+    assert(ring && packets);
+
+    tail = ring->tail;
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    for (k = 0; k < max_packets && tail + k != head; ++k)
+    {
+        shm_packet_t *packet = &ring->packets[(tail + k) % SHM_RING_LEN];
+
+        packets[k].iov_base = packet->data;
+        packets[k].iov_len  = MIN(packet->len, SHM_MAX_PACKET_LEN);
+    }
+
+    return k;
+}
+
+static void _shm_ring_consume(shm_ring_t *ring, int num_packets)
+{
+    assert(ring && num_packets > 0);
+
+    __atomic_store_n(&ring->tail, ring->tail + num_packets, __ATOMIC_RELEASE);
+    _shm_ring_doorbell(&ring->space_doorbell, &ring->space_waiting);
+}
+
+/* ring the doorbell, if the other side is waiting on it */
+static void _shm_ring_doorbell(uint32_t *doorbell, uint32_t *waiting)
+{
+    assert(doorbell && waiting);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST))
+        _shm_kick(doorbell);
+}
+
+/* ring the doorbell unconditionally */
+static void _shm_kick(uint32_t *doorbell)
+{
+    assert(doorbell);
+
+    __atomic_add_fetch(doorbell, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, doorbell, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/* wait for the doorbell to move on from val.  returns FALSE if it didn't
+ * within SHM_PEER_CHECK_SECS, so the caller can check on the peer.
+ */
+static bool_t _shm_futex_wait(uint32_t *addr, uint32_t val)
+{
+    struct timespec timeout = { SHM_PEER_CHECK_SECS, 0 };
+
+    assert(addr);
+
+    if (syscall(SYS_futex, addr, FUTEX_WAIT, val, &timeout, NULL, 0) < 0)
+    {
+        assert(errno == EAGAIN || errno == EINTR || errno == ETIMEDOUT);
+        return errno != ETIMEDOUT;
+    }
+
+    return TRUE;
+}
+
+static bool_t _shm_peer_alive(pid_t pid)
+{
+    return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+/* pass packets from our ring to the mysocket layer, until EOF or we're
+ * stopped.
+ */
+static void *shm_recv_thread_func(void *arg_ptr)
+{
+    mysock_context_t *ctx = (mysock_context_t *) arg_ptr;
+    network_context_shm_t *shm_ctx;
+    shm_ring_t *ring;
+
+    assert(ctx && !ctx->listening);
+
+    shm_ctx = GET_SHM(&ctx->network_state);
+    assert(shm_ctx);
+
+    /* an active mysocket's connection is only set up by its SYN */
+    PTHREAD_CALL(pthread_mutex_lock(&shm_ctx->lock));
+    while (!shm_ctx->rx_ring && !shm_ctx->stopping)
+        PTHREAD_CALL(pthread_cond_wait(&shm_ctx->cond, &shm_ctx->lock));
+    ring = shm_ctx->rx_ring;
+    PTHREAD_CALL(pthread_mutex_unlock(&shm_ctx->lock));
+
+    while (ring && !__atomic_load_n(&shm_ctx->stopping, __ATOMIC_SEQ_CST))
+    {
+        struct iovec packets[SHM_RECV_BATCH_SIZE];
+        bool_t peer_closed;
+        int num_packets;
+        uint32_t seq;
+
+        /* anything the peer sent before closing is delivered first */
+        peer_closed = (__atomic_load_n(&shm_ctx->conn->closed,
+                                       __ATOMIC_ACQUIRE) &
+                       shm_ctx->peer_closed_flag) != 0;
+
+        if ((num_packets = _shm_ring_peek(ring, packets,
+                                          SHM_RECV_BATCH_SIZE)) > 0)
+        {
+            _network_deliver(ctx, packets, num_packets);
+            _shm_ring_consume(ring, num_packets);
+            continue;
+        }
+
+        if (peer_closed)
+        {
+            _network_deliver_v(ctx, NULL, 0);
+            break;
+        }
+
+        seq = __atomic_load_n(&ring->data_doorbell, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&ring->data_waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == ring->tail &&
+            !(__atomic_load_n(&shm_ctx->conn->closed, __ATOMIC_SEQ_CST) &
+              shm_ctx->peer_closed_flag) &&
+            !__atomic_load_n(&shm_ctx->stopping, __ATOMIC_SEQ_CST) &&
+            !_shm_futex_wait(&ring->data_doorbell, seq) &&
+            !_shm_peer_alive(shm_ctx->peer_pid))
+        {
+            DEBUG_LOG(("peer %d has gone away\n", (int) shm_ctx->peer_pid));
+            __atomic_store_n(&ring->data_waiting, 0, __ATOMIC_SEQ_CST);
+            _shm_close_for_peer(shm_ctx);
+            _network_deliver_v(ctx, NULL, 0);
+            break;
+        }
+        __atomic_store_n(&ring->data_waiting, 0, __ATOMIC_SEQ_CST);
+    }
+
+    return NULL;
+}
+
+/* dispatch SYNs written to our segment's connection slots, until we're
+ * stopped.
+ */
+static void *shm_listen_thread_func(void *arg_ptr)
+{
+    mysock_context_t *ctx = (mysock_context_t *) arg_ptr;
+    network_context_shm_t *shm_ctx;
+    shm_segment_t *segment;
+    char syn_buf[SHM_MAX_PACKET_LEN];
+    size_t syn_len;
+
+    assert(ctx && ctx->listening);
+
+    shm_ctx = GET_SHM(&ctx->network_state);
+    assert(shm_ctx && shm_ctx->segment);
+    segment = shm_ctx->segment;
+
+    while (!__atomic_load_n(&shm_ctx->stopping, __ATOMIC_SEQ_CST))
+    {
+        uint32_t seq;
+        int k;
+
+        /* read before scanning, so a SYN written meanwhile isn't missed */
+        seq = __atomic_load_n(&segment->accept_doorbell, __ATOMIC_SEQ_CST);
+
+        for (k = 0; k < SHM_MAX_CONNECTIONS; ++k)
+        {
+            shm_connection_t *conn = &segment->connections[k];
+            shm_ring_t *ring = &conn->rings[SHM_TO_PASSIVE];
+            uint32_t state = SHM_CONN_CONNECTING;
+            struct sockaddr_in peer_addr;
+            struct iovec syn;
+
+            if (__atomic_load_n(&conn->state, __ATOMIC_SEQ_CST) != state ||
+                _shm_ring_peek(ring, &syn, 1) == 0 ||
+                !__atomic_compare_exchange_n(&conn->state, &state,
+                                             SHM_CONN_ACCEPTED, FALSE,
+                                             __ATOMIC_SEQ_CST,
+                                             __ATOMIC_SEQ_CST))
+            {
+                continue;
+            }
+
+            /* the SYN is copied out first, as the new mysocket's receive
+             * thread starts reading the ring straight away.
+             */
+            syn_len = syn.iov_len;
+            memcpy(syn_buf, syn.iov_base, syn_len);
+            _shm_ring_consume(ring, 1);
+
+            memset(&peer_addr, 0, sizeof(peer_addr));
+            peer_addr.sin_family      = AF_INET;
+            peer_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            peer_addr.sin_port        = htons(conn->active_port);
+
+            memcpy(&ctx->network_state.peer_addr, &peer_addr,
+                   sizeof(peer_addr));
+            ctx->network_state.peer_addr_len = sizeof(peer_addr);
+
+            if (!_mysock_enqueue_connection(ctx, syn_buf, syn_len,
+                                            (struct sockaddr *) &peer_addr,
+                                            sizeof(peer_addr),
+                                            (void *) (intptr_t) k))
+            {
+                _shm_close_connection(conn, SHM_PASSIVE_CLOSED);
+            }
+        }
+
+        if (!__atomic_load_n(&shm_ctx->stopping, __ATOMIC_SEQ_CST))
+            (void) _shm_futex_wait(&segment->accept_doorbell, seq);
+    }
+
+    return NULL;
+}
@@ -1,4 +1,4 @@
-/* routines shared amongst TCP/UDP versions of the network layer */
+/* routines shared amongst TCP/UDP/Unix versions of the network layer */
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -21,8 +21,8 @@
 
 
 
-#define EXIT_PIPE_READ_INDEX  0
-#define EXIT_PIPE_WRITE_INDEX 1
+/* maximum number of packets handled per wakeup of the receive thread */
+#define RECV_BATCH_SIZE 32
 
 #ifndef MAXHOSTNAMELEN
 #ifdef HOST_NAME_MAX
@@ -34,7 +34,7 @@
 
 
 static network_context_socket_t *
-    _network_alloc_context_socket(int socket_type, size_t ctx_len);
+    _network_alloc_context_socket(int domain, int socket_type, size_t ctx_len);
 static void _network_destroy_context_socket(network_context_socket_t *ctx);
 static void *network_recv_thread_func(void *arg_ptr);
 
@@ -51,7 +51,8 @@ void _network_close_socket(network_context_t *ctx)
 }
 
 /* return the local port associated with the given network layer context, in
- * network byte order, or 0 (reserved) on error.
+ * network byte order, or 0 (reserved) on error.  the port is looked up once
+ * it has been assigned, and cached thereafter.
  */
 int _network_get_port(network_context_t *ctx)
 {
@@ -61,13 +62,22 @@ int _network_get_port(network_context_t *ctx)
     assert(ctx);
     VERIFY_SOCKET(ctx);
 
+    if (ctx->local_port)
+        return ctx->local_port;
+
     if (getsockname(GET_SOCKET(ctx), (struct sockaddr *) &sin, &sin_len) < 0)
     {
         assert(0);
         return 0;
     }
 
-    assert(sin.sin_family == AF_INET);
+    /* a non-IP socket (see network_io_unix.c) has no port until it's
+     * bound, when the network layer sets local_port itself.
+     */
+    if (sin.sin_family != AF_INET)
+        return 0;
+
+    ctx->local_port = sin.sin_port;
     return sin.sin_port;
 }
 
@@ -164,6 +174,7 @@ void _network_stop_recv_thread(mysock_context_t *ctx)
  */
 int _network_init_socket(mysock_context_t  *sock_ctx,
                          network_context_t *net_ctx,
+                         int                domain,
                          int                type,
                          size_t             ctx_len)
 {
@@ -173,7 +184,8 @@ int _network_init_socket(mysock_context_t  *sock_ctx,
     memset(net_ctx, 0, sizeof(*net_ctx));
     net_ctx->random_seed = 0x632a;
 
-    if (!(net_ctx->impl_data = _network_alloc_context_socket(type, ctx_len)))
+    if (!(net_ctx->impl_data = _network_alloc_context_socket(domain, type,
+                                                               ctx_len)))
     {
         assert(0);
         return -1;
@@ -189,6 +201,8 @@ int _network_bind_socket(network_context_t *ctx,
 {
     assert(ctx && addr);
     VERIFY_SOCKET(ctx);
+
+    ctx->local_port = 0;    /* looked up again once needed */
     return bind(GET_SOCKET(ctx), addr, addrlen);
 }
 
@@ -207,7 +221,7 @@ int _network_bind_socket(network_context_t *ctx,
  */
 static void *network_recv_thread_func(void *arg_ptr)
 {
-    char packet_buf[MAX_IP_PAYLOAD_LEN];
+    struct iovec packets[RECV_BATCH_SIZE];
     mysock_context_t *ctx;
     network_context_socket_t *net_ctx;
 
@@ -220,7 +234,7 @@ static void *network_recv_thread_func(void *arg_ptr)
 
     for (;;)
     {
-        ssize_t bytes_read;
+        int num_packets, k;
         bool_t packet_ready = FALSE;
         bool_t done = FALSE;
         struct pollfd fds[] =
@@ -230,6 +244,16 @@ static void *network_recv_thread_func(void *arg_ptr)
         };
 
 
+        /* packets already buffered by the network layer are handled
+         * without waiting for the socket.  (there are only ever a few
+         * batches' worth, so any exit request is seen soon enough).
+         */
+        packet_ready = _network_recv_pending(&ctx->network_state);
+#ifdef TCP_IO_URING
+        if (!packet_ready && !_network_recv_wait(&ctx->network_state))
+            break;
+        packet_ready = TRUE;
+#endif
         while (!packet_ready && !done)
         {
             switch (poll(fds, sizeof(fds) / sizeof(fds[0]), -1))
@@ -244,8 +268,11 @@ static void *network_recv_thread_func(void *arg_ptr)
 
             default:
                 assert(!(fds[0].revents & POLLERR));
-                assert(!(fds[1].revents & POLLERR));
 
+                /* an error pending on the socket (e.g. an ICMP port
+                 * unreachable for a connected UDP socket) is picked up by
+                 * reading it, as for data.
+                 */
                 if (fds[0].revents)
                     done = TRUE;
                 if (fds[1].revents)
@@ -257,35 +284,47 @@ static void *network_recv_thread_func(void *arg_ptr)
         if (done)
             break;
 
-        /* block, waiting for network input.  (the system call will be
-         * interrupted by the transport layer thread if we're to exit).
-         */
-        if ((bytes_read = _network_recv_packet(&ctx->network_state,
-                                               packet_buf,
-                                               sizeof(packet_buf))) <= 0)
+        if ((num_packets = _network_recv_packets(&ctx->network_state,
+                                                 packets,
+                                                 RECV_BATCH_SIZE)) < 0)
         {
-            DEBUG_LOG(("_network_recv_packet interrupted, errno=%d\n", errno));
+            DEBUG_LOG(("_network_recv_packets interrupted, errno=%d\n",
+                       errno));
             //signal an error to the transport layer
-            _mysock_enqueue_buffer(ctx, &ctx->network_recv_queue, NULL, 0);
+            _network_deliver_v(ctx, NULL, 0);
             break;
         }
 
-        assert(bytes_read <= (int)sizeof(packet_buf));
+        assert(num_packets <= RECV_BATCH_SIZE);
+        if (num_packets == 0)
+            continue;   /* nothing usable yet */
+
         if (ctx->listening)
         {
             /* if the socket was accepting new connections, incoming
              * packets need to be demultiplexed and dispatched to the
-             * appropriate mysocket context.
+             * appropriate mysocket context.  corrupt packets are dropped,
+             * as by a real network.
              */
-            _mysock_enqueue_connection(ctx, packet_buf, bytes_read,
-                                       &ctx->network_state.peer_addr,
-                                       ctx->network_state.peer_addr_len, NULL);
+            for (k = 0; k < num_packets; ++k)
+            {
+                if (!_network_verify_packet(ctx, packets[k].iov_base,
+                                            packets[k].iov_len))
+                {
+                    continue;
+                }
+
+                _mysock_enqueue_connection(ctx, packets[k].iov_base,
+                                           packets[k].iov_len,
+                                           &ctx->network_state.peer_addr,
+                                           ctx->network_state.peer_addr_len,
+                                           NULL);
+            }
         }
         else
         {
-            /* enqueue the packet directly for this context */
-            _mysock_enqueue_buffer(ctx, &ctx->network_recv_queue,
-                                   packet_buf, bytes_read);
+            /* enqueue the packets directly for this context */
+            _network_deliver(ctx, packets, num_packets);
         }
     }
 
@@ -293,7 +332,7 @@ static void *network_recv_thread_func(void *arg_ptr)
 }
 
 static network_context_socket_t *
-_network_alloc_context_socket(int socket_type, size_t ctx_len)
+_network_alloc_context_socket(int domain, int socket_type, size_t ctx_len)
 {
     network_context_socket_t *ctx =
         (network_context_socket_t *) calloc(1, ctx_len);
@@ -302,7 +341,7 @@ _network_alloc_context_socket(int socket_type, size_t ctx_len)
 
 
     /* create the actual socket used for communication to the peer */
-    if ((ctx->socket = socket(AF_INET, socket_type, 0)) < 0)
+    if ((ctx->socket = socket(domain, socket_type, 0)) < 0)
     {
         perror("socket");
         assert(0);
@@ -16,6 +16,55 @@
 
 typedef int socket_t;
 
+/* ends of network_context_socket_t.exit_pipe */
+#define EXIT_PIPE_READ_INDEX  0
+#define EXIT_PIPE_WRITE_INDEX 1
+
+/* minimum size of the receive buffer kept by the TCP-based network layer.
+ * it's enlarged if need be to hold at least one framed packet.
+ */
+#define TCP_RECV_BUF_LEN 16384
+
+/* number of datagrams read or written per system call by the UDP-based
+ * network layer.
+ */
+#define UDP_BATCH_SIZE 32
+
+/* number of packets read per system call by the Unix domain socket network
+ * layer.
+ */
+#define UNIX_BATCH_SIZE 32
+
+#ifdef TCP_IO_URING
+#include "network_io_uring.h"
+
+/* the io_uring engine writes out whole batches (see network_io_tcp.c) */
+#ifndef TCP_SEND_BATCH
+#define TCP_SEND_BATCH
+#endif
+
+/* buffers provided to the kernel for each TCP socket's receives */
+#define URING_RECV_BUFS    16
+#define URING_RECV_BUF_LEN 4096
+
+/* data received into one of those buffers, not yet parsed */
+typedef struct
+{
+    uint16_t bid;
+    uint32_t offset, len;
+} uring_chunk_t;
+#endif
+
+#ifdef TCP_SEND_BATCH
+/* room for at least this many MAX_IP_PAYLOAD_LEN framed packets (and for
+ * one of the largest configured size) is kept by the TCP-based network
+ * layer in batching mode.
+ */
+#define TCP_SEND_BATCH_PACKETS 16
+#define TCP_SEND_BATCH_LEN \
+    (TCP_SEND_BATCH_PACKETS * (sizeof(uint16_t) + MAX_IP_PAYLOAD_LEN))
+#endif
+
 /* socket-based network layer additional state.
  * this is pointed to by impl_data in the network_context_t structure.
  */
@@ -37,8 +86,110 @@ typedef struct
     socket_t          new_socket;   /* temporary result of accept() */
     pthread_mutex_t   connect_lock;
     bool_t            connected;
+
+    /* data read from the socket but not yet returned by
+     * _network_recv_packets() is recv_buf[recv_start, recv_end).  the
+     * remaining recv_discard bytes of an oversized packet are skipped as
+     * they arrive.
+     */
+    char             *recv_buf;
+    size_t            recv_buf_len;
+    size_t            recv_start, recv_end;
+    size_t            recv_discard;
+
+#ifdef TCP_SEND_BATCH
+    /* framed packets (length prefix and packet) not yet written */
+#ifdef TCP_IO_URING
+    char             *send_batch;   /* one of send_batches */
+    char             *send_batches[2];
+#else
+    char             *send_batch;
+#endif
+    size_t            send_batch_len, send_batch_cap;
+#endif
+
+#ifdef TCP_IO_URING
+    /* the other of send_batches may still be being written, by the send
+     * submitted to send_ring by the transport thread.
+     */
+    uring_t           send_ring;
+    bool_t            send_ring_ready;
+    size_t            send_inflight_len;    /* 0 if nothing in flight */
+
+    /* ring used by the receive thread, with a multishot receive on the
+     * socket (or a poll, if it's listening) and a read on the exit pipe.
+     * received data is queued in recv_chunks, and packets are returned
+     * straight from the buffers; only a packet spanning two of them is put
+     * together in recv_buf.  the first chunk_done chunks have been parsed,
+     * but their buffers aren't given back until the packets returned from
+     * them have been consumed.
+     */
+    uring_t           recv_ring;
+    uring_buf_group_t recv_bufs;
+    bool_t            recv_ring_ready;
+    bool_t            recv_armed, poll_armed, exit_armed;
+    bool_t            recv_eof;
+    char              exit_byte;
+    uring_chunk_t     recv_chunks[URING_RECV_BUFS];
+    unsigned int      chunk_head, chunk_count, chunk_done;
+#endif
 } network_context_socket_tcp_t;
 
+typedef struct
+{
+    network_context_socket_t base;
+
+    /* additional state required by UDP-based network layer */
+    mysock_context_t *sock_ctx;
+
+    /* the peer's port (network byte order), once it's known for certain;
+     * 0 until then.  the active side learns the port of the passive side's
+     * new socket from the SYN-ACK.  only used by the receive thread.
+     */
+    uint16_t          peer_port;
+
+    /* TRUE once the socket is connected to the peer's port, after which
+     * datagrams are sent without an address.  on the active side this is
+     * set by the receive thread, so it's accessed atomically.
+     */
+    bool_t            connected;
+
+    /* datagrams read by the last recvmmsg() not yet returned by
+     * _network_recv_packets() are recv_msgs[recv_next, recv_count).
+     */
+    struct mmsghdr     recv_msgs[UDP_BATCH_SIZE];
+    struct iovec       recv_iov[UDP_BATCH_SIZE];
+    struct sockaddr_in recv_addrs[UDP_BATCH_SIZE];
+    char               recv_bufs[UDP_BATCH_SIZE][MAX_IP_PAYLOAD_LEN];
+    int                recv_next, recv_count;
+
+    /* datagrams queued for the next sendmmsg() */
+    struct mmsghdr     send_msgs[UDP_BATCH_SIZE];
+    struct iovec       send_iov[UDP_BATCH_SIZE];
+    struct sockaddr_in send_addrs[UDP_BATCH_SIZE];
+    char               send_bufs[UDP_BATCH_SIZE][MAX_IP_PAYLOAD_LEN];
+    int                send_count;
+} network_context_socket_udp_t;
+
+typedef struct
+{
+    network_context_socket_t base;
+
+    /* additional state required by Unix domain socket network layer */
+    mysock_context_t *sock_ctx;
+    socket_t          new_socket;   /* temporary result of accept() */
+    pthread_mutex_t   connect_lock;
+    bool_t            connected;
+
+    /* packets read by the last recvmmsg() not yet returned by
+     * _network_recv_packets() are recv_msgs[recv_next, recv_count).
+     */
+    struct mmsghdr     recv_msgs[UNIX_BATCH_SIZE];
+    struct iovec       recv_iov[UNIX_BATCH_SIZE];
+    char               recv_bufs[UNIX_BATCH_SIZE][MAX_IP_PAYLOAD_LEN];
+    int                recv_next, recv_count;
+} network_context_socket_unix_t;
+
 
 #define closesocket(s) close(s)
 
@@ -57,6 +208,7 @@ typedef struct
 
 int _network_init_socket(mysock_context_t  *sock_ctx,
                          network_context_t *net_ctx,
+                         int                domain,
                          int                type,
                          size_t             ctx_len);
 
@@ -67,11 +219,32 @@ int _network_bind_socket(network_context_t *ctx,
                          int                addrlen);
 
 
-/* this is not called directly.  use network_start_recv_thread() and
+/* these are not called directly.  use network_start_recv_thread() and
  * network_stop_recv_thread() instead.
+ *
+ * _network_recv_packets() is called once the socket is readable (or
+ * _network_recv_pending() is TRUE), and returns up to max_packets packets
+ * received from the peer.  it returns 0 if nothing usable has arrived yet
+ * (e.g. only part of a packet, or only packets that were dropped), or < 0
+ * on EOF or error.  the packets are left in storage belonging to the
+ * network layer, and are only valid until the next call.  packets larger
+ * than the network layer's max_packet_len are dropped.
+ *
+ * _network_recv_pending() returns TRUE if _network_recv_packets() has
+ * packets to return without reading from the socket; the socket needn't
+ * be readable in that case.
  */
-ssize_t _network_recv_packet(network_context_t *ctx,
-                             void *dst, size_t max_len);
+int _network_recv_packets(network_context_t *ctx,
+                          struct iovec *packets, int max_packets);
+bool_t _network_recv_pending(network_context_t *ctx);
+
+#ifdef TCP_IO_URING
+/* with the io_uring engine, the receive thread waits in the network layer
+ * rather than in poll().  this returns FALSE once the thread is to exit,
+ * and otherwise TRUE once _network_recv_packets() may have something.
+ */
+bool_t _network_recv_wait(network_context_t *ctx);
+#endif
 
 
 #endif  /* __NETWORK_IO_SOCKET_H__ */
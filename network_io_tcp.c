@@ -5,9 +5,15 @@
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <alloca.h>
+#include <errno.h>
+#include <poll.h>
 #include "mysock_impl.h"
 #include "network_io.h"
 #include "network_io_socket.h"
@@ -15,10 +21,45 @@
 
 #define MAX_NUM_PENDING_CONNECTIONS 10
 
+/* the kernel's TCP stream already delivers every packet intact and in
+ * order, so STCP checksums on top of it are redundant.  they're still
+ * computed and verified by default, though, as a peer built without
+ * offload would drop packets sent with th_sum left as zero; build both
+ * peers with -DCSUM_OFFLOAD to skip them.
+ */
+static network_caps_t tcp_caps =
+{
+#ifdef CSUM_OFFLOAD
+    TRUE,               /* csum_offload */
+#else
+    FALSE,              /* csum_offload */
+#endif
+    0,                  /* max_packet_len (see _tcp_init_caps()) */
+    64                  /* max_segments */
+};
+static pthread_once_t tcp_caps_once = PTHREAD_ONCE_INIT;
+
 typedef ssize_t (*io_func_t)(socket_t sd, void *buf, size_t count);
 
+static void _tcp_init_caps(void);
 static int _tcp_io(socket_t, void *, size_t, io_func_t);
+static int _tcp_writev(socket_t, struct iovec *, int);
 static int _tcp_connect(network_context_t *ctx);
+static int _tcp_parse_packets(network_context_socket_tcp_t *tcp_io_ctx,
+                              struct iovec *packets, int max_packets);
+static int _tcp_recv_one(socket_t tcp_sd, void *dst, size_t max_len);
+static void _tcp_set_nodelay(socket_t tcp_sd);
+#ifdef TCP_SEND_BATCH
+static int _tcp_flush(network_context_t *ctx);
+#endif
+#ifdef TCP_IO_URING
+static int _tcp_uring_send_wait(network_context_socket_tcp_t *tcp_io_ctx);
+static int _tcp_uring_flush(network_context_t *ctx,
+                            network_context_socket_tcp_t *tcp_io_ctx);
+static int _tcp_uring_parse(network_context_socket_tcp_t *tcp_io_ctx,
+                            struct iovec *packets, int max_packets);
+static void _tcp_uring_recycle(network_context_socket_tcp_t *tcp_io_ctx);
+#endif
 
 
 /* a few words about using TCP to emulate the underlying datagram
@@ -33,6 +74,30 @@ static int _tcp_connect(network_context_t *ctx);
  *   - the passive side dispatches the SYN packet to the right STCP
  *     context, and updates the new context's TCP socket to be that of the
  *     newly accepted (real TCP) connection.
+ *   - each packet is framed by a two byte length prefix, written together
+ *     with the packet in a single writev().  Nagle's algorithm is disabled
+ *     on the TCP socket, as STCP does its own segmentation; otherwise
+ *     small packets (e.g. ACKs) would sit in the kernel waiting for the
+ *     peer's delayed ACK.
+ *   - a run of packets handed down together (segmentation offload, see
+ *     stcp_network_send_gso()) is framed and written in one writev() too.
+ *   - as there's no MTU, packets may be as large as the two byte length
+ *     prefix allows, if configured with STCP_MTU (see network_io.h).  the
+ *     receive and send buffers are sized to match.
+ *   - if built with -DTCP_SEND_BATCH, framed packets are instead gathered
+ *     into a per-connection buffer and written out together once it
+ *     fills, or when the transport layer next waits for an event
+ *     (_network_flush()).
+ *   - if built with -DTCP_IO_URING (NETWORK_IO=uring in the Makefile),
+ *     the socket is driven through io_uring instead (see
+ *     network_io_uring.c).  the receive thread keeps a multishot receive
+ *     armed on the socket, into buffers provided to the kernel, and sleeps
+ *     in io_uring_enter() until data (or the exit request) arrives; under
+ *     load, each wakeup collects many packets and no further system calls
+ *     are needed to re-arm the receive.  packets are handed on straight
+ *     from those buffers, unless one spans two of them.  packets are sent
+ *     in batches as for -DTCP_SEND_BATCH, and each batch is submitted as
+ *     a single send without waiting for it, while the next batch fills.
  */
 
 
@@ -47,6 +112,7 @@ int _network_init(mysock_context_t *sock_ctx, network_context_t *net_ctx)
     assert(sock_ctx && net_ctx);
     if ((rc = _network_init_socket(sock_ctx,
                                    net_ctx,
+                                   AF_INET,
                                    SOCK_STREAM,
                                    sizeof(network_context_socket_tcp_t))) < 0)
         return rc;
@@ -60,6 +126,31 @@ int _network_init(mysock_context_t *sock_ctx, network_context_t *net_ctx)
 
     PTHREAD_CALL(pthread_mutex_init(&tcp_io_ctx->connect_lock, NULL));
 
+    /* the buffers must each have room for a framed packet of the largest
+     * size configured
+     */
+    PTHREAD_CALL(pthread_once(&tcp_caps_once, _tcp_init_caps));
+
+    tcp_io_ctx->recv_buf_len = MAX(TCP_RECV_BUF_LEN,
+                                   sizeof(uint16_t) + tcp_caps.max_packet_len);
+    tcp_io_ctx->recv_buf = (char *) malloc(tcp_io_ctx->recv_buf_len);
+    assert(tcp_io_ctx->recv_buf);
+
+#ifdef TCP_SEND_BATCH
+    tcp_io_ctx->send_batch_cap = MAX(TCP_SEND_BATCH_LEN,
+                                     sizeof(uint16_t) +
+                                         tcp_caps.max_packet_len);
+#ifdef TCP_IO_URING
+    tcp_io_ctx->send_batches[0] = (char *) malloc(tcp_io_ctx->send_batch_cap);
+    tcp_io_ctx->send_batches[1] = (char *) malloc(tcp_io_ctx->send_batch_cap);
+    assert(tcp_io_ctx->send_batches[0] && tcp_io_ctx->send_batches[1]);
+    tcp_io_ctx->send_batch = tcp_io_ctx->send_batches[0];
+#else
+    tcp_io_ctx->send_batch = (char *) malloc(tcp_io_ctx->send_batch_cap);
+    assert(tcp_io_ctx->send_batch);
+#endif
+#endif
+
     return 0;
 }
 
@@ -72,6 +163,24 @@ void _network_close(network_context_t *ctx)
     tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
     assert(tcp_io_ctx);
 
+#ifdef TCP_SEND_BATCH
+    if (tcp_io_ctx->connected)
+        (void) _tcp_flush(ctx);
+#endif
+
+#ifdef TCP_IO_URING
+    /* the kernel mustn't be left sending from a freed buffer */
+    (void) _tcp_uring_send_wait(tcp_io_ctx);
+    if (tcp_io_ctx->send_ring_ready)
+        _uring_destroy(&tcp_io_ctx->send_ring);
+
+    if (tcp_io_ctx->recv_ring_ready)
+    {
+        _uring_destroy(&tcp_io_ctx->recv_ring);
+        _uring_buf_group_destroy(&tcp_io_ctx->recv_bufs);
+    }
+#endif
+
     if (tcp_io_ctx->new_socket != -1)
     {
         DEBUG_LOG(("closing TCP network layer socket %d...\n",
@@ -81,9 +190,23 @@ void _network_close(network_context_t *ctx)
 
     PTHREAD_CALL(pthread_mutex_destroy(&tcp_io_ctx->connect_lock));
 
+    free(tcp_io_ctx->recv_buf);
+#ifdef TCP_IO_URING
+    free(tcp_io_ctx->send_batches[0]);
+    free(tcp_io_ctx->send_batches[1]);
+#elif defined(TCP_SEND_BATCH)
+    free(tcp_io_ctx->send_batch);
+#endif
+
     _network_close_socket(ctx);
 }
 
+const network_caps_t *_network_get_caps(network_context_t *ctx)
+{
+    assert(ctx);
+    return &tcp_caps;
+}
+
 /* set the local port associated with the given network layer context */
 int _network_bind(network_context_t *ctx, struct sockaddr *addr, int addrlen)
 {
@@ -125,6 +248,7 @@ void _network_update_passive_state(network_context_t *new_ctx,
     closesocket(new_tcp_ctx->base.socket);
     new_tcp_ctx->base.socket = accept_tcp_ctx->new_socket;
     new_tcp_ctx->connected = TRUE;
+    new_ctx->local_port = 0;
     accept_tcp_ctx->new_socket = -1;
     DEBUG_LOG(("passed accepted socket %d on to new context...\n",
                new_tcp_ctx->base.socket));
@@ -134,11 +258,43 @@ void _network_update_passive_state(network_context_t *new_ctx,
 /* send the given packet to the peer */
 ssize_t _network_send_packet(network_context_t *ctx,
                              const void *src, size_t len)
+{
+    struct iovec iov;
+
+    assert(src);
+
+    iov.iov_base = (void *) src;
+    iov.iov_len  = len;
+    return _network_send_packetv(ctx, &iov, 1);
+}
+
+/* send the packet gathered from the given pieces to the peer */
+ssize_t _network_send_packetv(network_context_t *ctx,
+                              const struct iovec *iov, int iovcnt)
+{
+    return _network_send_packets(ctx, iov, iovcnt, 1);
+}
+
+/* send the packets gathered from the given pieces to the peer.  the length
+ * prefixes and all the pieces go out in a single writev().
+ */
+ssize_t _network_send_packets(network_context_t *ctx,
+                              const struct iovec *iov, int iovcnt,
+                              int num_packets)
 {
     network_context_socket_tcp_t *tcp_io_ctx;
+#ifdef TCP_SEND_BATCH
     uint16_t packet_len;    /* network byte order */
+#else
+    uint16_t *packet_lens;  /* network byte order */
+    struct iovec *io_iov;
+#endif
+    size_t total = 0;
+    int j, k;
 
-    assert(ctx && src);
+    assert(ctx && iov && iovcnt > 0);
+    assert(num_packets > 0 &&
+           (unsigned int) num_packets <= tcp_caps.max_segments);
     assert(ctx->peer_addr_len > 0);
 
     tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
@@ -150,31 +306,92 @@ ssize_t _network_send_packet(network_context_t *ctx,
     if (_tcp_connect(ctx) < 0)
         return -1;
 
-    packet_len = htons(len);
-    if (_tcp_io(GET_SOCKET(ctx), &packet_len, sizeof(packet_len),
-                (io_func_t) write) < 0 ||
-        _tcp_io(GET_SOCKET(ctx), (void *) src, len, (io_func_t) write) < 0)
+#ifdef TCP_SEND_BATCH
+    for (j = 0; j < num_packets; ++j, iov += iovcnt)
+    {
+        size_t len = 0;
+
+        for (k = 0; k < iovcnt; ++k)
+            len += iov[k].iov_len;
+        assert(len <= tcp_caps.max_packet_len);
+
+        if (tcp_io_ctx->send_batch_len + sizeof(packet_len) + len >
+            tcp_io_ctx->send_batch_cap && _tcp_flush(ctx) < 0)
+        {
+            return -1;
+        }
+
+        packet_len = htons(len);
+        memcpy(tcp_io_ctx->send_batch + tcp_io_ctx->send_batch_len,
+               &packet_len, sizeof(packet_len));
+        tcp_io_ctx->send_batch_len += sizeof(packet_len);
+
+        for (k = 0; k < iovcnt; ++k)
+        {
+            memcpy(tcp_io_ctx->send_batch + tcp_io_ctx->send_batch_len,
+                   iov[k].iov_base, iov[k].iov_len);
+            tcp_io_ctx->send_batch_len += iov[k].iov_len;
+        }
+
+        total += len;
+    }
+#else
+    /* _tcp_writev() consumes its iovec, so work on a copy */
+    packet_lens = (uint16_t *) alloca(num_packets * sizeof(uint16_t));
+    io_iov = (struct iovec *)
+        alloca(num_packets * (iovcnt + 1) * sizeof(struct iovec));
+
+    for (j = 0; j < num_packets; ++j)
+    {
+        struct iovec *packet_iov = io_iov + j * (iovcnt + 1);
+        size_t len = 0;
+
+        for (k = 0; k < iovcnt; ++k)
+        {
+            packet_iov[k + 1] = iov[j * iovcnt + k];
+            len += packet_iov[k + 1].iov_len;
+        }
+        assert(len <= tcp_caps.max_packet_len);
+
+        packet_lens[j] = htons(len);
+        packet_iov[0].iov_base = &packet_lens[j];
+        packet_iov[0].iov_len  = sizeof(packet_lens[j]);
+
+        total += len;
+    }
+
+    if (_tcp_writev(GET_SOCKET(ctx), io_iov, num_packets * (iovcnt + 1)) < 0)
         return -1;
+#endif
 
-    return len;
+    return total;
 }
 
-/* read a packet from the peer */
-ssize_t _network_recv_packet(network_context_t *ctx, void *dst, size_t max_len)
+int _network_flush(network_context_t *ctx)
+{
+    assert(ctx);
+
+#ifdef TCP_SEND_BATCH
+    return _tcp_flush(ctx);
+#else
+    return 0;   /* packets are never held back */
+#endif
+}
+
+/* read packets from the peer */
+int _network_recv_packets(network_context_t *ctx,
+                          struct iovec *packets, int max_packets)
 {
     network_context_socket_tcp_t *tcp_io_ctx;
-    uint16_t packet_len;
-    socket_t io_socket;
-    int rc;
+    int num_packets;
 
-    assert(ctx && dst);
+    assert(ctx && packets && max_packets > 0);
 
     tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
     assert(tcp_io_ctx);
     assert(tcp_io_ctx->sock_ctx);
 
     VERIFY_SOCKET(ctx);
-    io_socket = tcp_io_ctx->base.socket;
 
     if (tcp_io_ctx->sock_ctx->is_active && _tcp_connect(ctx) < 0)
         return -1;
@@ -183,6 +400,19 @@ ssize_t _network_recv_packet(network_context_t *ctx, void *dst, size_t max_len)
         (tcp_io_ctx->sock_ctx->is_active && !tcp_io_ctx->connected)*/)
     {
         socket_t tmp_sd;
+        int rc;
+
+        /* we don't normally reenter this function until the last SYN
+         * packet has been dispatched to the right context, and that
+         * context's socket updated to be 'new_socket'.  if it was dropped
+         * instead (e.g. bad checksum, or full accept queue), the
+         * connection is abandoned.
+         */
+        if (tcp_io_ctx->new_socket != -1)
+        {
+            closesocket(tcp_io_ctx->new_socket);
+            tcp_io_ctx->new_socket = -1;
+        }
 
         ctx->peer_addr_len = sizeof(ctx->peer_addr);
         if ((tmp_sd = accept(GET_SOCKET(ctx),
@@ -196,43 +426,203 @@ ssize_t _network_recv_packet(network_context_t *ctx, void *dst, size_t max_len)
         DEBUG_LOG(("accepted from peer, tmp_sd=%d...\n", (int) tmp_sd));
 
         /* keep listening socket open for futher connection requests */
-        /* we will not reenter this function until this SYN packet has
-         * been dispatched to the right context, and that context's
-         * socket updated to be 'new_socket'
-         */
-        assert(tcp_io_ctx->new_socket == -1);
+        _tcp_set_nodelay(tmp_sd);
         tcp_io_ctx->new_socket = tmp_sd;
-        io_socket = tmp_sd;
+
+        DEBUG_PEER(ctx);
+
+        /* nothing beyond the SYN is read from the new socket, as anything
+         * following it belongs to the new context.  a peer that fails to
+         * send a SYN just loses its connection; the listening socket
+         * carries on.
+         */
+        if ((rc = _tcp_recv_one(tmp_sd, tcp_io_ctx->recv_buf,
+                                tcp_io_ctx->recv_buf_len)) <= 0)
+        {
+            closesocket(tmp_sd);
+            tcp_io_ctx->new_socket = -1;
+            return 0;
+        }
+
+        packets[0].iov_base = tcp_io_ctx->recv_buf;
+        packets[0].iov_len  = rc;
+        return 1;
     }
 
     DEBUG_PEER(ctx);
 
 #ifdef DEBUG
-    if (getpeername(io_socket, &ctx->peer_addr, &ctx->peer_addr_len) < 0)
+    if (getpeername(GET_SOCKET(ctx), &ctx->peer_addr, &ctx->peer_addr_len) < 0)
     {
         DEBUG_LOG(("getpeername failed (errno=%d)\n", errno));
         return -1;
     }
 #endif
 
-    if ((rc = _tcp_io(io_socket, &packet_len, sizeof(packet_len), read)) <= 0)
+#ifdef TCP_IO_URING
+    /* the data was received by the kernel already */
+    if ((num_packets = _tcp_uring_parse(tcp_io_ctx,
+                                        packets, max_packets)) == 0 &&
+        tcp_io_ctx->recv_eof)
+    {
+        return -1;  /* EOF or error */
+    }
+#else
+    /* packets returned by the last call have been consumed, so the buffer
+     * can be compacted before reading more.  only one read() is done, so
+     * as not to block on the rest of a partly received packet.
+     */
+    if ((num_packets = _tcp_parse_packets(tcp_io_ctx,
+                                          packets, max_packets)) == 0)
+    {
+        ssize_t rc;
+
+        if (tcp_io_ctx->recv_start > 0)
+        {
+            memmove(tcp_io_ctx->recv_buf,
+                    tcp_io_ctx->recv_buf + tcp_io_ctx->recv_start,
+                    tcp_io_ctx->recv_end - tcp_io_ctx->recv_start);
+            tcp_io_ctx->recv_end  -= tcp_io_ctx->recv_start;
+            tcp_io_ctx->recv_start = 0;
+        }
+
+        assert(tcp_io_ctx->recv_end < tcp_io_ctx->recv_buf_len);
+        if ((rc = read(GET_SOCKET(ctx),
+                       tcp_io_ctx->recv_buf + tcp_io_ctx->recv_end,
+                       tcp_io_ctx->recv_buf_len -
+                           tcp_io_ctx->recv_end)) <= 0)
+        {
+            DEBUG_LOG(("couldn't read packets: %d\n", (int) rc));
+            return -1;  /* EOF or error */
+        }
+
+        tcp_io_ctx->recv_end += rc;
+        num_packets = _tcp_parse_packets(tcp_io_ctx, packets, max_packets);
+    }
+#endif
+
+    return num_packets;
+}
+
+bool_t _network_recv_pending(network_context_t *ctx)
+{
+    network_context_socket_tcp_t *tcp_io_ctx;
+    size_t avail;
+    uint16_t packet_len;
+
+    assert(ctx);
+
+    tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
+    assert(tcp_io_ctx);
+
+#ifdef TCP_IO_URING
+    /* data waiting to be parsed, or EOF, needs no further wait */
+    if (tcp_io_ctx->chunk_count > tcp_io_ctx->chunk_done ||
+        tcp_io_ctx->recv_eof)
+    {
+        return TRUE;
+    }
+#endif
+
+    avail = tcp_io_ctx->recv_end - tcp_io_ctx->recv_start;
+    if (tcp_io_ctx->recv_discard > 0 || avail < sizeof(packet_len))
+        return FALSE;
+
+    memcpy(&packet_len, tcp_io_ctx->recv_buf + tcp_io_ctx->recv_start,
+           sizeof(packet_len));
+    packet_len = ntohs(packet_len);
+
+    /* an oversized packet is dropped without waiting for the rest of it */
+    return packet_len > tcp_caps.max_packet_len ||
+           avail >= sizeof(packet_len) + packet_len;
+}
+
+/* return up to max_packets complete packets from the receive buffer,
+ * skipping any that are oversized.
+ */
+static int _tcp_parse_packets(network_context_socket_tcp_t *tcp_io_ctx,
+                              struct iovec *packets, int max_packets)
+{
+    int num_packets = 0;
+
+    assert(tcp_io_ctx && packets);
+    assert(tcp_io_ctx->recv_buf_len >=
+           sizeof(uint16_t) + tcp_caps.max_packet_len);
+
+    while (num_packets < max_packets)
+    {
+        size_t avail = tcp_io_ctx->recv_end - tcp_io_ctx->recv_start;
+        uint16_t packet_len;
+
+        if (tcp_io_ctx->recv_discard > 0)
+        {
+            size_t len = MIN(avail, tcp_io_ctx->recv_discard);
+
+            tcp_io_ctx->recv_start   += len;
+            tcp_io_ctx->recv_discard -= len;
+            if (tcp_io_ctx->recv_discard > 0)
+                break;
+            continue;
+        }
+
+        if (avail < sizeof(packet_len))
+            break;
+
+        memcpy(&packet_len, tcp_io_ctx->recv_buf + tcp_io_ctx->recv_start,
+               sizeof(packet_len));
+        packet_len = ntohs(packet_len);
+
+        if (packet_len > tcp_caps.max_packet_len)
+        {
+            _network_report_oversized(packet_len, tcp_caps.max_packet_len);
+            tcp_io_ctx->recv_start  += sizeof(packet_len);
+            tcp_io_ctx->recv_discard = packet_len;
+            continue;
+        }
+
+        if (avail < sizeof(packet_len) + packet_len)
+            break;
+
+        packets[num_packets].iov_base =
+            tcp_io_ctx->recv_buf + tcp_io_ctx->recv_start + sizeof(packet_len);
+        packets[num_packets].iov_len = packet_len;
+        ++num_packets;
+
+        tcp_io_ctx->recv_start += sizeof(packet_len) + packet_len;
+    }
+
+    return num_packets;
+}
+
+/* read exactly one non-empty packet of at most max_len bytes into dst,
+ * without reading anything past it.  returns <= 0 if there's no such
+ * packet, including if it's oversized.
+ */
+static int _tcp_recv_one(socket_t tcp_sd, void *dst, size_t max_len)
+{
+    uint16_t packet_len;
+    int rc;
+
+    assert(dst);
+
+    if ((rc = _tcp_io(tcp_sd, &packet_len, sizeof(packet_len), read)) <= 0)
     {
         DEBUG_LOG(("couldn't read packet len: %d\n", rc));
         return rc;
     }
 
     packet_len = ntohs(packet_len);
-    if ((rc = _tcp_io(io_socket, dst, MIN(packet_len, max_len), read)) <= 0)
+    if (packet_len == 0 || packet_len > MIN(max_len, tcp_caps.max_packet_len))
     {
-        DEBUG_LOG(("couldn't read packet: %d\n", rc));
-        return rc;
+        DEBUG_LOG(("bad packet on new connection (len=%u)\n",
+                   (unsigned) packet_len));
+        return -1;
     }
 
-    if (packet_len > max_len)
+    if ((rc = _tcp_io(tcp_sd, dst, packet_len, read)) <= 0)
     {
-        /* discard unread remainder of packet */
-        char *dummy = (char *) alloca(packet_len - max_len);
-        (void) _tcp_io(io_socket, dummy, packet_len - max_len, read);
+        DEBUG_LOG(("couldn't read packet: %d\n", rc));
+        return rc;
     }
 
     return packet_len;
@@ -264,6 +654,44 @@ static int _tcp_io(socket_t tcp_sd, void *buf, size_t count, io_func_t io_func)
     return count;
 }
 
+/* write all of the given iovec, which is updated as data is written.
+ * returns the number of bytes written, or -1 if not all of them could be.
+ */
+static int _tcp_writev(socket_t tcp_sd, struct iovec *iov, int iovcnt)
+{
+    size_t count = 0;
+    int k;
+
+    assert(iov && iovcnt > 0);
+    for (k = 0; k < iovcnt; ++k)
+        count += iov[k].iov_len;
+
+    while (iovcnt > 0)
+    {
+        ssize_t rc;
+
+        if ((rc = writev(tcp_sd, iov, MIN(iovcnt, IOV_MAX))) <= 0)
+        {
+            DEBUG_LOG(("_tcp_writev rc: %d\n", (int) rc));
+            if (rc == 0)
+                errno = EPIPE;  /* nothing written; don't report success */
+            return -1;
+        }
+
+        /* skip past whatever was written */
+        for (; iovcnt > 0 && (size_t) rc >= iov->iov_len; ++iov, --iovcnt)
+            rc -= iov->iov_len;
+
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *) iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
+    }
+
+    return count;
+}
+
 static int _tcp_connect(network_context_t *ctx)
 {
     network_context_socket_tcp_t *tcp_io_ctx;
@@ -291,6 +719,7 @@ static int _tcp_connect(network_context_t *ctx)
             return -1;
         }
 
+        _tcp_set_nodelay(GET_SOCKET(ctx));
         tcp_io_ctx->connected = TRUE;
     }
     PTHREAD_CALL(pthread_mutex_unlock(&tcp_io_ctx->connect_lock));
@@ -298,3 +727,490 @@ static int _tcp_connect(network_context_t *ctx)
     return 0;
 }
 
+/* there's no MTU on a TCP connection, so packets can be as large as the
+ * length prefix allows
+ */
+static void _tcp_init_caps(void)
+{
+    tcp_caps.max_packet_len = _network_max_packet_len(MAX_JUMBO_PACKET_LEN);
+}
+
+/* disable Nagle's algorithm on the given socket.  this is just a
+ * performance tweak, so failure isn't fatal.
+ */
+static void _tcp_set_nodelay(socket_t tcp_sd)
+{
+    int on = 1;
+
+    if (setsockopt(tcp_sd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0)
+    {
+        DEBUG_LOG(("couldn't set TCP_NODELAY on socket %d (errno=%d)\n",
+                   (int) tcp_sd, errno));
+    }
+}
+
+#ifdef TCP_SEND_BATCH
+/* write out any batched packets */
+static int _tcp_flush(network_context_t *ctx)
+{
+    network_context_socket_tcp_t *tcp_io_ctx;
+    int rc;
+
+    assert(ctx);
+
+    tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
+    assert(tcp_io_ctx);
+
+    if (tcp_io_ctx->send_batch_len == 0)
+        return 0;
+
+#ifdef TCP_IO_URING
+    rc = _tcp_uring_flush(ctx, tcp_io_ctx);
+#else
+    {
+        struct iovec iov;
+
+        iov.iov_base = tcp_io_ctx->send_batch;
+        iov.iov_len  = tcp_io_ctx->send_batch_len;
+        rc = _tcp_writev(GET_SOCKET(ctx), &iov, 1);
+    }
+#endif
+
+    /* the batch is discarded even on error; the connection is dead anyway */
+    tcp_io_ctx->send_batch_len = 0;
+
+    return (rc < 0) ? -1 : 0;
+}
+#endif
+
+#ifdef TCP_IO_URING
+/* io_uring completion tags */
+#define URING_TAG_EXIT 1
+#define URING_TAG_POLL 2
+#define URING_TAG_RECV 3
+
+/* wait for the batch in flight (if any) to be written.  returns -1 if it
+ * couldn't be.
+ */
+static int _tcp_uring_send_wait(network_context_socket_tcp_t *tcp_io_ctx)
+{
+    struct io_uring_cqe *cqe;
+    int rc = 0;
+
+    assert(tcp_io_ctx);
+
+    if (tcp_io_ctx->send_inflight_len == 0)
+        return 0;
+
+    while (!(cqe = _uring_peek_cqe(&tcp_io_ctx->send_ring)))
+    {
+        if (_uring_enter(&tcp_io_ctx->send_ring, 1) < 0 && errno != EINTR)
+        {
+            perror("io_uring_enter (network_io_tcp)");
+            assert(0);
+            abort();
+        }
+    }
+
+    if (cqe->res != (int) tcp_io_ctx->send_inflight_len)
+    {
+        DEBUG_LOG(("io_uring send failed (res=%d)\n", cqe->res));
+        rc = -1;
+    }
+
+    _uring_cqe_seen(&tcp_io_ctx->send_ring);
+    tcp_io_ctx->send_inflight_len = 0;
+    return rc;
+}
+
+/* submit the batch for _tcp_flush(), once the one before it has been
+ * written.  the batch buffers are swapped, so the next batch can be
+ * gathered while this one is in flight.  returns -1 on error.
+ */
+static int _tcp_uring_flush(network_context_t *ctx,
+                            network_context_socket_tcp_t *tcp_io_ctx)
+{
+    struct io_uring_sqe *sqe;
+    int rc;
+
+    /* only one batch is in flight at a time, so they go out in order */
+    rc = _tcp_uring_send_wait(tcp_io_ctx);
+
+    if (rc == 0 && !tcp_io_ctx->send_ring_ready)
+    {
+        if (_uring_init(&tcp_io_ctx->send_ring, 2) < 0)
+        {
+            perror("io_uring_setup (network_io_tcp)");
+            assert(0);
+            rc = -1;
+        }
+        else
+        {
+            tcp_io_ctx->send_ring_ready = TRUE;
+        }
+    }
+
+    if (rc == 0)
+    {
+        sqe = _uring_get_sqe(&tcp_io_ctx->send_ring);
+        assert(sqe);
+
+        sqe->opcode    = IORING_OP_SEND;
+        sqe->fd        = GET_SOCKET(ctx);
+        sqe->addr      = (uint64_t) (uintptr_t) tcp_io_ctx->send_batch;
+        sqe->len       = tcp_io_ctx->send_batch_len;
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+
+        while ((rc = _uring_enter(&tcp_io_ctx->send_ring, 0)) < 0 &&
+               errno == EINTR)
+            ;
+
+        if (rc < 0)
+        {
+            DEBUG_LOG(("io_uring_enter failed (errno=%d)\n", errno));
+        }
+        else
+        {
+            tcp_io_ctx->send_inflight_len = tcp_io_ctx->send_batch_len;
+            tcp_io_ctx->send_batch =
+                (tcp_io_ctx->send_batch == tcp_io_ctx->send_batches[0]) ?
+                tcp_io_ctx->send_batches[1] : tcp_io_ctx->send_batches[0];
+            rc = 0;
+        }
+    }
+
+    return rc;
+}
+
+/* return up to max_packets complete packets, parsed straight from the
+ * buffers the kernel received into, as for _tcp_parse_packets().  a packet
+ * whose frame runs on into the next buffer is put together in recv_buf;
+ * only one is, per call, so that it stays put until it's been consumed.
+ */
+static int _tcp_uring_parse(network_context_socket_tcp_t *tcp_io_ctx,
+                            struct iovec *packets, int max_packets)
+{
+    bool_t reassembled = FALSE;
+    int num_packets = 0;
+
+    assert(tcp_io_ctx && packets);
+    assert(tcp_io_ctx->recv_buf_len >=
+           sizeof(uint16_t) + tcp_caps.max_packet_len);
+
+    /* packets returned by the last call have been consumed */
+    _tcp_uring_recycle(tcp_io_ctx);
+    if (tcp_io_ctx->recv_start > 0)
+    {
+        memmove(tcp_io_ctx->recv_buf,
+                tcp_io_ctx->recv_buf + tcp_io_ctx->recv_start,
+                tcp_io_ctx->recv_end - tcp_io_ctx->recv_start);
+        tcp_io_ctx->recv_end  -= tcp_io_ctx->recv_start;
+        tcp_io_ctx->recv_start = 0;
+    }
+
+    while (num_packets < max_packets &&
+           tcp_io_ctx->chunk_done < tcp_io_ctx->chunk_count)
+    {
+        uring_chunk_t *chunk = &tcp_io_ctx->recv_chunks[
+            (tcp_io_ctx->chunk_head + tcp_io_ctx->chunk_done) %
+            URING_RECV_BUFS];
+        char *data = _uring_buf(&tcp_io_ctx->recv_bufs, chunk->bid) +
+                     chunk->offset;
+        size_t avail = tcp_io_ctx->recv_end - tcp_io_ctx->recv_start;
+        size_t len;
+        uint16_t packet_len;
+
+        if (chunk->len == 0)
+        {
+            ++tcp_io_ctx->chunk_done;
+            continue;
+        }
+
+        if (tcp_io_ctx->recv_discard > 0)
+        {
+            len = MIN(chunk->len, tcp_io_ctx->recv_discard);
+            tcp_io_ctx->recv_discard -= len;
+        }
+        else if (avail > 0)
+        {
+            /* carry on with the frame begun in an earlier buffer, first
+             * with its length prefix, then up to the end of the packet
+             */
+            if (avail < sizeof(packet_len))
+            {
+                len = MIN(chunk->len, sizeof(packet_len) - avail);
+            }
+            else
+            {
+                memcpy(&packet_len,
+                       tcp_io_ctx->recv_buf + tcp_io_ctx->recv_start,
+                       sizeof(packet_len));
+                len = MIN(chunk->len,
+                          sizeof(packet_len) + ntohs(packet_len) - avail);
+            }
+
+            memcpy(tcp_io_ctx->recv_buf + tcp_io_ctx->recv_end, data, len);
+            tcp_io_ctx->recv_end += len;
+            reassembled = TRUE;
+        }
+        else
+        {
+            if (chunk->len >= sizeof(packet_len))
+            {
+                memcpy(&packet_len, data, sizeof(packet_len));
+                packet_len = ntohs(packet_len);
+
+                if (packet_len > tcp_caps.max_packet_len)
+                {
+                    _network_report_oversized(packet_len, tcp_caps.max_packet_len);
+                    tcp_io_ctx->recv_discard = packet_len;
+                    len = sizeof(packet_len);
+                }
+                else if (chunk->len >= sizeof(packet_len) + packet_len)
+                {
+                    packets[num_packets].iov_base = data + sizeof(packet_len);
+                    packets[num_packets].iov_len  = packet_len;
+                    ++num_packets;
+                    len = sizeof(packet_len) + packet_len;
+                }
+                else
+                {
+                    len = 0;    /* it runs on into the next buffer */
+                }
+            }
+            else
+            {
+                len = 0;
+            }
+
+            if (len == 0)
+            {
+                if (reassembled)
+                    break;  /* recv_buf is still in use */
+
+                len = chunk->len;
+                memcpy(tcp_io_ctx->recv_buf, data, len);
+                tcp_io_ctx->recv_start = 0;
+                tcp_io_ctx->recv_end   = len;
+                reassembled = TRUE;
+            }
+        }
+
+        chunk->offset += len;
+        chunk->len    -= len;
+
+        /* hand on the frame in recv_buf once it's complete */
+        avail = tcp_io_ctx->recv_end - tcp_io_ctx->recv_start;
+        if (avail >= sizeof(packet_len))
+        {
+            memcpy(&packet_len, tcp_io_ctx->recv_buf + tcp_io_ctx->recv_start,
+                   sizeof(packet_len));
+            packet_len = ntohs(packet_len);
+
+            if (packet_len > tcp_caps.max_packet_len)
+            {
+                _network_report_oversized(packet_len, tcp_caps.max_packet_len);
+                tcp_io_ctx->recv_discard = packet_len -
+                                           (avail - sizeof(packet_len));
+                tcp_io_ctx->recv_start = tcp_io_ctx->recv_end;
+            }
+            else if (avail == sizeof(packet_len) + packet_len)
+            {
+                packets[num_packets].iov_base = tcp_io_ctx->recv_buf +
+                                                tcp_io_ctx->recv_start +
+                                                sizeof(packet_len);
+                packets[num_packets].iov_len  = packet_len;
+                ++num_packets;
+                tcp_io_ctx->recv_start = tcp_io_ctx->recv_end;
+            }
+        }
+    }
+
+    /* nothing refers to the buffers if no packets came from them */
+    if (num_packets == 0)
+        _tcp_uring_recycle(tcp_io_ctx);
+
+    return num_packets;
+}
+
+/* give the buffers of the chunks parsed so far back to the kernel */
+static void _tcp_uring_recycle(network_context_socket_tcp_t *tcp_io_ctx)
+{
+    assert(tcp_io_ctx);
+    assert(tcp_io_ctx->chunk_done <= tcp_io_ctx->chunk_count);
+
+    for (; tcp_io_ctx->chunk_done > 0; --tcp_io_ctx->chunk_done)
+    {
+        if (_uring_buf_recycle(&tcp_io_ctx->recv_ring, &tcp_io_ctx->recv_bufs,
+                               tcp_io_ctx->recv_chunks[
+                                   tcp_io_ctx->chunk_head].bid) < 0)
+        {
+            perror("io_uring_enter (network_io_tcp)");
+            assert(0);
+            abort();
+        }
+
+        tcp_io_ctx->chunk_head = (tcp_io_ctx->chunk_head + 1) % URING_RECV_BUFS;
+        --tcp_io_ctx->chunk_count;
+    }
+}
+
+/* wait for input on the socket (or for a listening socket, a connection),
+ * or the exit request.  the receive on the socket stays armed between
+ * calls.
+ */
+bool_t _network_recv_wait(network_context_t *ctx)
+{
+    network_context_socket_tcp_t *tcp_io_ctx;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    bool_t exiting = FALSE;
+
+    assert(ctx);
+
+    tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
+    assert(tcp_io_ctx && tcp_io_ctx->sock_ctx);
+
+    VERIFY_SOCKET(ctx);
+
+    if (!tcp_io_ctx->recv_ring_ready)
+    {
+        if (_uring_init(&tcp_io_ctx->recv_ring, 16) < 0)
+        {
+            perror("io_uring_setup (network_io_tcp)");
+            assert(0);
+            return FALSE;
+        }
+
+        if (_uring_buf_group_init(&tcp_io_ctx->recv_ring,
+                                  &tcp_io_ctx->recv_bufs, 0,
+                                  URING_RECV_BUFS, URING_RECV_BUF_LEN) < 0)
+        {
+            perror("io_uring_register (network_io_tcp)");
+            assert(0);
+            _uring_destroy(&tcp_io_ctx->recv_ring);
+            return FALSE;
+        }
+
+        tcp_io_ctx->recv_ring_ready = TRUE;
+    }
+
+    /* buffers given back by _tcp_uring_recycle() are submitted first, as
+     * otherwise (if all of them were) they can leave no room in the
+     * submission queue to re-arm the receive.
+     */
+    if (_uring_enter(&tcp_io_ctx->recv_ring, 0) < 0 && errno != EINTR)
+    {
+        perror("io_uring_enter (network_io_tcp)");
+        assert(0);
+        return FALSE;
+    }
+
+    /* as with poll(), the active side connects before anything else */
+    if (tcp_io_ctx->sock_ctx->is_active && _tcp_connect(ctx) < 0)
+    {
+        tcp_io_ctx->recv_eof = TRUE;
+        return TRUE;
+    }
+
+    if (!tcp_io_ctx->exit_armed && (sqe = _uring_get_sqe(&tcp_io_ctx->recv_ring)))
+    {
+        sqe->opcode    = IORING_OP_READ;
+        sqe->fd        = tcp_io_ctx->base.exit_pipe[EXIT_PIPE_READ_INDEX];
+        sqe->addr      = (uint64_t) (uintptr_t) &tcp_io_ctx->exit_byte;
+        sqe->len       = sizeof(tcp_io_ctx->exit_byte);
+        sqe->user_data = URING_TAG_EXIT;
+        tcp_io_ctx->exit_armed = TRUE;
+    }
+
+    if (tcp_io_ctx->sock_ctx->listening)
+    {
+        if (!tcp_io_ctx->poll_armed &&
+            (sqe = _uring_get_sqe(&tcp_io_ctx->recv_ring)))
+        {
+            sqe->opcode       = IORING_OP_POLL_ADD;
+            sqe->fd           = GET_SOCKET(ctx);
+            sqe->poll32_events = POLLIN;
+            sqe->user_data    = URING_TAG_POLL;
+            tcp_io_ctx->poll_armed = TRUE;
+        }
+    }
+    else if (!tcp_io_ctx->recv_armed &&
+             (sqe = _uring_get_sqe(&tcp_io_ctx->recv_ring)))
+    {
+        sqe->opcode    = IORING_OP_RECV;
+        sqe->fd        = GET_SOCKET(ctx);
+        sqe->ioprio    = IORING_RECV_MULTISHOT;
+        sqe->flags     = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = tcp_io_ctx->recv_bufs.bgid;
+        sqe->user_data = URING_TAG_RECV;
+        tcp_io_ctx->recv_armed = TRUE;
+    }
+
+    while (!(cqe = _uring_peek_cqe(&tcp_io_ctx->recv_ring)))
+    {
+        if (_uring_enter(&tcp_io_ctx->recv_ring, 1) < 0 && errno != EINTR)
+        {
+            perror("io_uring_enter (network_io_tcp)");
+            assert(0);
+            return FALSE;
+        }
+    }
+
+    for (; cqe; cqe = _uring_peek_cqe(&tcp_io_ctx->recv_ring))
+    {
+        switch (cqe->user_data)
+        {
+        case URING_TAG_EXIT:
+            tcp_io_ctx->exit_armed = FALSE;
+            exiting = TRUE;
+            break;
+
+        case URING_TAG_POLL:
+            tcp_io_ctx->poll_armed = FALSE;
+            break;
+
+        case URING_TAG_RECV:
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+                tcp_io_ctx->recv_armed = FALSE;
+
+            if (cqe->res > 0)
+            {
+                uring_chunk_t *chunk;
+
+                assert(cqe->flags & IORING_CQE_F_BUFFER);
+                assert(tcp_io_ctx->chunk_count < URING_RECV_BUFS);
+
+                chunk = &tcp_io_ctx->recv_chunks[
+                    (tcp_io_ctx->chunk_head + tcp_io_ctx->chunk_count++) %
+                    URING_RECV_BUFS];
+                chunk->bid    = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                chunk->offset = 0;
+                chunk->len    = cqe->res;
+            }
+            else if (cqe->res != -ENOBUFS)
+            {
+                /* EOF or error.  (if the buffers ran out, the receive is
+                 * just re-armed once they've been parsed).
+                 */
+                DEBUG_LOG(("io_uring receive finished (res=%d)\n",
+                           cqe->res));
+                tcp_io_ctx->recv_eof = TRUE;
+            }
+            break;
+
+        default:
+            /* providing buffers failed */
+            assert(cqe->user_data == 0);
+            DEBUG_LOG(("io_uring couldn't provide buffers (res=%d)\n",
+                       cqe->res));
+            assert(0);
+            break;
+        }
+
+        _uring_cqe_seen(&tcp_io_ctx->recv_ring);
+    }
+
+    return !exiting;
+}
+#endif
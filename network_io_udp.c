@@ -0,0 +1,436 @@
+/* network_io_udp.c: UDP instantiation of the underlying
+ * datagram service.
+ */
+
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "mysock_impl.h"
+#include "network_io.h"
+#include "network_io_socket.h"
+
+
+/* a few words about demultiplexing over UDP...
+ *
+ * each mysocket has its own UDP socket.  a listening mysocket receives
+ * the SYNs for its port, which are demultiplexed by peer address (see
+ * connection_demux.c).  the new context for each connection connects its
+ * own, unbound, UDP socket to the peer, so is given an ephemeral port;
+ * the kernel then demultiplexes all further traffic for the connection.
+ * the active side sends its SYN to the listening port, and connects its
+ * socket to the source of the reply (the SYN-ACK) from then on.  its
+ * peer_addr (which other threads read without a lock) keeps the listening
+ * port, as seen by mygetpeername() and in STCP headers.
+ *
+ * datagrams are read with recvmmsg() and written with sendmmsg(), up to
+ * UDP_BATCH_SIZE at a time.  outgoing datagrams are held until the batch
+ * fills, or until the transport layer next waits for an event or input
+ * (_network_flush()).
+ *
+ * unlike the TCP network layer, nothing here guarantees that packets
+ * arrive intact, so STCP checksums are computed and verified.
+ */
+
+static const network_caps_t udp_caps =
+{
+    FALSE,              /* csum_offload */
+    MAX_IP_PAYLOAD_LEN, /* max_packet_len */
+    UDP_BATCH_SIZE      /* max_segments */
+};
+
+static bool_t _udp_accept_peer(network_context_t *ctx,
+                               const struct sockaddr_in *addr);
+static int _udp_flush(network_context_t *ctx);
+
+
+int _network_init(mysock_context_t *sock_ctx, network_context_t *net_ctx)
+{
+    network_context_socket_udp_t *udp_io_ctx;
+    int rc;
+
+    assert(sock_ctx && net_ctx);
+    if ((rc = _network_init_socket(sock_ctx,
+                                   net_ctx,
+                                   AF_INET,
+                                   SOCK_DGRAM,
+                                   sizeof(network_context_socket_udp_t))) < 0)
+        return rc;
+
+    udp_io_ctx = (network_context_socket_udp_t *) net_ctx->impl_data;
+    assert(udp_io_ctx);
+
+    udp_io_ctx->sock_ctx  = sock_ctx;
+    udp_io_ctx->peer_port = 0;
+    udp_io_ctx->connected = FALSE;
+
+    return 0;
+}
+
+void _network_close(network_context_t *ctx)
+{
+    assert(ctx);
+
+    (void) _udp_flush(ctx);
+    _network_close_socket(ctx);
+}
+
+const network_caps_t *_network_get_caps(network_context_t *ctx)
+{
+    assert(ctx);
+    return &udp_caps;
+}
+
+/* set the local port associated with the given network layer context */
+int _network_bind(network_context_t *ctx, struct sockaddr *addr, int addrlen)
+{
+    assert(ctx && addr);
+    VERIFY_SOCKET(ctx);
+
+    return _network_bind_socket(ctx, addr, addrlen);
+}
+
+/* datagram sockets have no backlog of their own; pending connections are
+ * limited by the mysocket layer.
+ */
+int _network_listen(network_context_t *ctx, int backlog)
+{
+    assert(ctx);
+    VERIFY_SOCKET(ctx);
+
+    return 0;
+}
+
+void _network_update_passive_state(network_context_t *new_ctx,
+                                   network_context_t *accept_ctx,
+                                   void *user_data,
+                                   const void *syn_packet, size_t syn_len)
+{
+    network_context_socket_udp_t *new_udp_ctx;
+
+    assert(new_ctx && accept_ctx && syn_packet);
+    assert(!user_data);
+    assert(new_ctx->peer_addr_valid);
+
+    new_udp_ctx = (network_context_socket_udp_t *) new_ctx->impl_data;
+    assert(new_udp_ctx);
+
+    /* the new context's socket is bound to an ephemeral port, and only
+     * sees traffic from the peer.
+     */
+    if (connect(GET_SOCKET(new_ctx), &new_ctx->peer_addr,
+                new_ctx->peer_addr_len) < 0)
+    {
+        perror("connect (network_io_udp)");
+        assert(0);
+    }
+
+    new_ctx->local_port = 0;
+    new_udp_ctx->peer_port =
+        ((struct sockaddr_in *) &new_ctx->peer_addr)->sin_port;
+    __atomic_store_n(&new_udp_ctx->connected, TRUE, __ATOMIC_RELEASE);
+}
+
+
+/* send the given packet to the peer */
+ssize_t _network_send_packet(network_context_t *ctx,
+                             const void *src, size_t len)
+{
+    struct iovec iov;
+
+    assert(src);
+
+    iov.iov_base = (void *) src;
+    iov.iov_len  = len;
+    return _network_send_packetv(ctx, &iov, 1);
+}
+
+/* queue the packet gathered from the given pieces for the next sendmmsg() */
+ssize_t _network_send_packetv(network_context_t *ctx,
+                              const struct iovec *iov, int iovcnt)
+{
+    network_context_socket_udp_t *udp_io_ctx;
+    struct mmsghdr *msg;
+    char *dst;
+    size_t len = 0;
+    int k;
+
+    assert(ctx && iov && iovcnt > 0);
+    assert(ctx->peer_addr_len > 0);
+    assert(ctx->peer_addr.sa_family == AF_INET);
+
+    udp_io_ctx = (network_context_socket_udp_t *) ctx->impl_data;
+    assert(udp_io_ctx);
+
+    VERIFY_SOCKET(ctx);
+    DEBUG_PEER(ctx);
+
+    if (udp_io_ctx->send_count == UDP_BATCH_SIZE && _udp_flush(ctx) < 0)
+        return -1;
+
+    k = udp_io_ctx->send_count;
+    dst = udp_io_ctx->send_bufs[k];
+    for (; iovcnt > 0; ++iov, --iovcnt)
+    {
+        assert(len + iov->iov_len <= udp_caps.max_packet_len);
+        memcpy(dst + len, iov->iov_base, iov->iov_len);
+        len += iov->iov_len;
+    }
+
+    udp_io_ctx->send_iov[k].iov_base = dst;
+    udp_io_ctx->send_iov[k].iov_len  = len;
+
+    msg = &udp_io_ctx->send_msgs[k];
+    memset(msg, 0, sizeof(*msg));
+    if (!__atomic_load_n(&udp_io_ctx->connected, __ATOMIC_ACQUIRE))
+    {
+        /* e.g. the SYN, which goes to the listening port */
+        udp_io_ctx->send_addrs[k] = *(struct sockaddr_in *) &ctx->peer_addr;
+        msg->msg_hdr.msg_name    = &udp_io_ctx->send_addrs[k];
+        msg->msg_hdr.msg_namelen = sizeof(udp_io_ctx->send_addrs[k]);
+    }
+    msg->msg_hdr.msg_iov     = &udp_io_ctx->send_iov[k];
+    msg->msg_hdr.msg_iovlen  = 1;
+
+    ++udp_io_ctx->send_count;
+    return len;
+}
+
+/* queue the given packets for the next sendmmsg() (see
+ * _network_send_packetv())
+ */
+ssize_t _network_send_packets(network_context_t *ctx,
+                              const struct iovec *iov, int iovcnt,
+                              int num_packets)
+{
+    ssize_t total = 0;
+    int j;
+
+    assert(ctx && iov && iovcnt > 0);
+    assert(num_packets > 0 &&
+           (unsigned int) num_packets <= udp_caps.max_segments);
+
+    for (j = 0; j < num_packets; ++j, iov += iovcnt)
+    {
+        ssize_t len;
+
+        if ((len = _network_send_packetv(ctx, iov, iovcnt)) < 0)
+            return -1;
+        total += len;
+    }
+
+    return total;
+}
+
+int _network_flush(network_context_t *ctx)
+{
+    return _udp_flush(ctx);
+}
+
+/* read datagrams from the peer (or for a listening mysocket, from anyone) */
+int _network_recv_packets(network_context_t *ctx,
+                          struct iovec *packets, int max_packets)
+{
+    network_context_socket_udp_t *udp_io_ctx;
+    bool_t listening;
+    int num_packets = 0;
+
+    assert(ctx && packets && max_packets > 0);
+
+    udp_io_ctx = (network_context_socket_udp_t *) ctx->impl_data;
+    assert(udp_io_ctx);
+    assert(udp_io_ctx->sock_ctx);
+
+    VERIFY_SOCKET(ctx);
+    listening = udp_io_ctx->sock_ctx->listening;
+
+    if (udp_io_ctx->recv_next == udp_io_ctx->recv_count)
+    {
+        int k, rc;
+
+        for (k = 0; k < UDP_BATCH_SIZE; ++k)
+        {
+            struct msghdr *hdr = &udp_io_ctx->recv_msgs[k].msg_hdr;
+
+            udp_io_ctx->recv_iov[k].iov_base = udp_io_ctx->recv_bufs[k];
+            udp_io_ctx->recv_iov[k].iov_len  = udp_caps.max_packet_len;
+
+            memset(hdr, 0, sizeof(*hdr));
+            hdr->msg_name    = &udp_io_ctx->recv_addrs[k];
+            hdr->msg_namelen = sizeof(udp_io_ctx->recv_addrs[k]);
+            hdr->msg_iov     = &udp_io_ctx->recv_iov[k];
+            hdr->msg_iovlen  = 1;
+        }
+
+        udp_io_ctx->recv_next = udp_io_ctx->recv_count = 0;
+
+        /* the socket is readable, so this doesn't block; MSG_WAITFORONE
+         * stops it waiting for the rest of the batch.
+         */
+        if ((rc = recvmmsg(GET_SOCKET(ctx), udp_io_ctx->recv_msgs,
+                           UDP_BATCH_SIZE, MSG_WAITFORONE, NULL)) < 0)
+        {
+            /* an ICMP error from an earlier send (e.g. the peer isn't up
+             * yet) is just packet loss as far as STCP is concerned.
+             */
+            if (errno == EINTR || errno == EAGAIN ||
+                errno == ECONNREFUSED || errno == EHOSTUNREACH ||
+                errno == ENETUNREACH)
+            {
+                return 0;
+            }
+
+            perror("recvmmsg (network_io_udp)");
+            return -1;
+        }
+
+        udp_io_ctx->recv_count = rc;
+    }
+
+    /* a listening mysocket has its peer address updated for each packet,
+     * so its packets are returned one at a time.
+     */
+    while (udp_io_ctx->recv_next < udp_io_ctx->recv_count &&
+           num_packets < (listening ? 1 : max_packets))
+    {
+        int k = udp_io_ctx->recv_next++;
+        struct mmsghdr *msg = &udp_io_ctx->recv_msgs[k];
+        const struct sockaddr_in *addr = &udp_io_ctx->recv_addrs[k];
+
+        if ((msg->msg_hdr.msg_flags & MSG_TRUNC) ||
+            msg->msg_hdr.msg_namelen != sizeof(*addr) ||
+            addr->sin_family != AF_INET)
+        {
+            DEBUG_LOG(("dropping bad datagram (len=%u)\n",
+                       (unsigned) msg->msg_len));
+            continue;
+        }
+
+        if (listening)
+        {
+            memset(&ctx->peer_addr, 0, sizeof(ctx->peer_addr));
+            memcpy(&ctx->peer_addr, addr, sizeof(*addr));
+            ctx->peer_addr_len = sizeof(*addr);
+        }
+        else if (!_udp_accept_peer(ctx, addr))
+        {
+            continue;
+        }
+
+        packets[num_packets].iov_base = udp_io_ctx->recv_bufs[k];
+        packets[num_packets].iov_len  = msg->msg_len;
+        ++num_packets;
+    }
+
+    return num_packets;
+}
+
+bool_t _network_recv_pending(network_context_t *ctx)
+{
+    network_context_socket_udp_t *udp_io_ctx;
+
+    assert(ctx);
+
+    udp_io_ctx = (network_context_socket_udp_t *) ctx->impl_data;
+    assert(udp_io_ctx);
+
+    return udp_io_ctx->recv_next < udp_io_ctx->recv_count;
+}
+
+
+/* returns TRUE if a datagram from the given address belongs to this
+ * connection.  on the active side, the first reply from the peer's host
+ * fixes the peer's port.  this is called by the receive thread.
+ */
+static bool_t _udp_accept_peer(network_context_t *ctx,
+                               const struct sockaddr_in *addr)
+{
+    network_context_socket_udp_t *udp_io_ctx;
+    const struct sockaddr_in *peer;
+
+    assert(ctx && addr);
+
+    udp_io_ctx = (network_context_socket_udp_t *) ctx->impl_data;
+    assert(udp_io_ctx);
+
+    if (!ctx->peer_addr_valid)
+        return FALSE;
+
+    peer = (const struct sockaddr_in *) &ctx->peer_addr;
+    if (addr->sin_addr.s_addr != peer->sin_addr.s_addr)
+        return FALSE;
+
+    if (udp_io_ctx->peer_port)
+        return addr->sin_port == udp_io_ctx->peer_port;
+
+    if (addr->sin_port != peer->sin_port)
+    {
+        DEBUG_LOG(("peer moved from port %hu to %hu\n",
+                   ntohs(peer->sin_port), ntohs(addr->sin_port)));
+    }
+    udp_io_ctx->peer_port = addr->sin_port;
+
+    /* this happens before the packet is queued for the transport layer,
+     * so anything sent in reply goes to the new port.  (only a datagram
+     * already waiting for sendmmsg() might still go to the listening port).
+     */
+    if (connect(GET_SOCKET(ctx), (const struct sockaddr *) addr,
+                sizeof(*addr)) < 0)
+    {
+        /* datagrams are then still sent to the listening port.  other
+         * peers' datagrams are filtered above either way.
+         */
+        DEBUG_LOG(("connect failed (errno=%d)\n", errno));
+    }
+    else
+    {
+        __atomic_store_n(&udp_io_ctx->connected, TRUE, __ATOMIC_RELEASE);
+    }
+
+    return TRUE;
+}
+
+/* write out any queued datagrams.  datagrams that can't be sent are
+ * dropped, as by a real network.
+ */
+static int _udp_flush(network_context_t *ctx)
+{
+    network_context_socket_udp_t *udp_io_ctx;
+    int sent = 0, rc = 0;
+
+    assert(ctx);
+
+    udp_io_ctx = (network_context_socket_udp_t *) ctx->impl_data;
+    assert(udp_io_ctx);
+
+    while (sent < udp_io_ctx->send_count)
+    {
+        int n = sendmmsg(GET_SOCKET(ctx), udp_io_ctx->send_msgs + sent,
+                         udp_io_ctx->send_count - sent, 0);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            DEBUG_LOG(("sendmmsg failed (errno=%d)\n", errno));
+            if (errno != ECONNREFUSED && errno != EHOSTUNREACH &&
+                errno != ENETUNREACH && errno != ENOBUFS)
+            {
+                rc = -1;
+            }
+
+            n = 1;  /* skip the datagram that failed */
+        }
+
+        sent += n;
+    }
+
+    udp_io_ctx->send_count = 0;
+    return rc;
+}
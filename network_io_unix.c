@@ -0,0 +1,503 @@
+/* network_io_unix.c: Unix domain socket instantiation of the underlying
+ * datagram service, for peers running on the same host.
+ */
+
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include "mysock_impl.h"
+#include "network_io.h"
+#include "network_io_socket.h"
+
+
+/* a few words about the Unix domain socket network layer...
+ *
+ * this works just like the TCP network layer (see network_io_tcp.c), but
+ * each mysocket has a SOCK_SEQPACKET Unix domain socket rather than a TCP
+ * socket.  SOCK_SEQPACKET is connection-oriented and reliable like TCP,
+ * but preserves message boundaries, so each packet is written with a
+ * single sendmsg() and read whole, without a length prefix.  the data
+ * never goes near the IP stack.
+ *
+ *   - mysockets keep their IP addresses and ports, as far as the rest of
+ *     the mysocket layer is concerned.  a port is bound by binding the
+ *     Unix socket to a name in the abstract namespace derived from it (see
+ *     UNIX_NAME_FORMAT), which vanishes as soon as the socket is closed.
+ *     the IP address is ignored; every peer is assumed to be on this host.
+ *   - on an STCP SYN, the active side connects its socket to the name of
+ *     the peer's port.  the passive side accepts the connection, reads the
+ *     SYN, and passes the accepted socket on to the new context, as for
+ *     TCP.  the peer's port is recovered from the name it's bound to.
+ *   - packets are read with recvmmsg(), up to UNIX_BATCH_SIZE at a time.
+ *     a run of packets handed down together (see stcp_network_send_gso())
+ *     is written with sendmmsg() in the same way.
+ *
+ * the kernel delivers every packet intact, so STCP checksums are skipped.
+ */
+
+#define UNIX_NAME_FORMAT        "stcp-unix.%u"
+#define UNIX_EPHEMERAL_MIN      49152
+#define UNIX_NUM_PORTS          65536
+
+static const network_caps_t unix_caps =
+{
+    TRUE,               /* csum_offload */
+    MAX_IP_PAYLOAD_LEN, /* max_packet_len */
+    UNIX_BATCH_SIZE     /* max_segments */
+};
+
+static unsigned int next_ephemeral_port = UNIX_EPHEMERAL_MIN;
+static pthread_mutex_t unix_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static socklen_t _unix_make_addr(struct sockaddr_un *sun, unsigned int port);
+static unsigned int _unix_parse_addr(const struct sockaddr_un *sun,
+                                     socklen_t sun_len);
+static int _unix_bind(network_context_t *ctx, unsigned int port);
+static int _unix_connect(network_context_t *ctx);
+
+
+/* initialise the network subsystem.  this function should be called before
+ * making use of any of the other network layer functions.
+ */
+int _network_init(mysock_context_t *sock_ctx, network_context_t *net_ctx)
+{
+    network_context_socket_unix_t *unix_io_ctx;
+    int rc;
+
+    assert(sock_ctx && net_ctx);
+    if ((rc = _network_init_socket(sock_ctx,
+                                   net_ctx,
+                                   AF_UNIX,
+                                   SOCK_SEQPACKET,
+                                   sizeof(network_context_socket_unix_t))) < 0)
+        return rc;
+
+    unix_io_ctx = (network_context_socket_unix_t *) net_ctx->impl_data;
+    assert(unix_io_ctx);
+
+    unix_io_ctx->sock_ctx = sock_ctx;
+    unix_io_ctx->new_socket = -1;
+    unix_io_ctx->connected = FALSE;
+
+    PTHREAD_CALL(pthread_mutex_init(&unix_io_ctx->connect_lock, NULL));
+
+    return 0;
+}
+
+void _network_close(network_context_t *ctx)
+{
+    network_context_socket_unix_t *unix_io_ctx;
+
+    assert(ctx);
+
+    unix_io_ctx = (network_context_socket_unix_t *) ctx->impl_data;
+    assert(unix_io_ctx);
+
+    if (unix_io_ctx->new_socket != -1)
+        closesocket(unix_io_ctx->new_socket);
+
+    PTHREAD_CALL(pthread_mutex_destroy(&unix_io_ctx->connect_lock));
+
+    _network_close_socket(ctx);
+}
+
+const network_caps_t *_network_get_caps(network_context_t *ctx)
+{
+    assert(ctx);
+    return &unix_caps;
+}
+
+/* bind the name for the given port (or an ephemeral port, if it's 0) */
+int _network_bind(network_context_t *ctx, struct sockaddr *addr, int addrlen)
+{
+    unsigned int port, k;
+
+    assert(ctx && addr);
+    VERIFY_SOCKET(ctx);
+
+    if (addr->sa_family != AF_INET || addrlen < (int) sizeof(struct sockaddr_in))
+    {
+        errno = EAFNOSUPPORT;
+        return -1;
+    }
+
+    if ((port = ntohs(((struct sockaddr_in *) addr)->sin_port)) != 0)
+        return _unix_bind(ctx, port);
+
+    for (k = 0; k < UNIX_NUM_PORTS - UNIX_EPHEMERAL_MIN; ++k)
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&unix_lock));
+        port = next_ephemeral_port;
+        if (++next_ephemeral_port == UNIX_NUM_PORTS)
+            next_ephemeral_port = UNIX_EPHEMERAL_MIN;
+        PTHREAD_CALL(pthread_mutex_unlock(&unix_lock));
+
+        if (_unix_bind(ctx, port) == 0)
+            return 0;
+        if (errno != EADDRINUSE)
+            return -1;
+    }
+
+    return -1;
+}
+
+int _network_listen(network_context_t *ctx, int backlog)
+{
+    assert(ctx);
+    VERIFY_SOCKET(ctx);
+
+    return listen(GET_SOCKET(ctx), backlog);
+}
+
+void _network_update_passive_state(network_context_t *new_ctx,
+                                   network_context_t *accept_ctx,
+                                   void *user_data,
+                                   const void *syn_packet, size_t syn_len)
+{
+    network_context_socket_unix_t *new_unix_ctx;
+    network_context_socket_unix_t *accept_unix_ctx;
+
+    assert(new_ctx && accept_ctx && syn_packet);
+    assert(!user_data);
+
+    new_unix_ctx = (network_context_socket_unix_t *) new_ctx->impl_data;
+    accept_unix_ctx = (network_context_socket_unix_t *) accept_ctx->impl_data;
+
+    assert(new_unix_ctx && accept_unix_ctx);
+    assert(!new_unix_ctx->sock_ctx->listening);
+    assert(!new_unix_ctx->sock_ctx->is_active);
+
+    /* result of accept() in listening socket is used for reading/writing
+     * by the new context, which shares the listening port, as with TCP.
+     */
+    closesocket(new_unix_ctx->base.socket);
+    new_unix_ctx->base.socket = accept_unix_ctx->new_socket;
+    new_unix_ctx->connected = TRUE;
+    new_ctx->local_port = accept_ctx->local_port;
+    accept_unix_ctx->new_socket = -1;
+}
+
+
+/* send the given packet to the peer */
+ssize_t _network_send_packet(network_context_t *ctx,
+                             const void *src, size_t len)
+{
+    struct iovec iov;
+
+    assert(src);
+
+    iov.iov_base = (void *) src;
+    iov.iov_len  = len;
+    return _network_send_packetv(ctx, &iov, 1);
+}
+
+/* send the packet gathered from the given pieces to the peer */
+ssize_t _network_send_packetv(network_context_t *ctx,
+                              const struct iovec *iov, int iovcnt)
+{
+    return _network_send_packets(ctx, iov, iovcnt, 1);
+}
+
+/* send the packets gathered from the given pieces to the peer, as one
+ * message each, with a single sendmmsg() (more, if it's interrupted part
+ * way).
+ */
+ssize_t _network_send_packets(network_context_t *ctx,
+                              const struct iovec *iov, int iovcnt,
+                              int num_packets)
+{
+    struct mmsghdr msgs[UNIX_BATCH_SIZE];
+    size_t total = 0;
+    int j, k, sent;
+
+    assert(ctx && iov && iovcnt > 0);
+    assert(num_packets > 0 &&
+           (unsigned int) num_packets <= unix_caps.max_segments);
+    assert(ctx->peer_addr_len > 0);
+
+    VERIFY_SOCKET(ctx);
+    DEBUG_PEER(ctx);
+
+    memset(msgs, 0, num_packets * sizeof(msgs[0]));
+    for (j = 0; j < num_packets; ++j)
+    {
+        size_t len = 0;
+
+        for (k = 0; k < iovcnt; ++k)
+            len += iov[j * iovcnt + k].iov_len;
+        assert(len <= unix_caps.max_packet_len);
+
+        msgs[j].msg_hdr.msg_iov    = (struct iovec *) iov + j * iovcnt;
+        msgs[j].msg_hdr.msg_iovlen = iovcnt;
+        total += len;
+    }
+
+    if (_unix_connect(ctx) < 0)
+        return -1;
+
+    for (j = 0; j < num_packets; j += sent)
+    {
+        if ((sent = sendmmsg(GET_SOCKET(ctx), msgs + j, num_packets - j,
+                             MSG_NOSIGNAL)) < 0)
+        {
+            if (errno != EINTR)
+            {
+                DEBUG_LOG(("sendmmsg failed (errno=%d)\n", errno));
+                return -1;
+            }
+            sent = 0;
+        }
+    }
+
+    return total;
+}
+
+/* packets are never held back */
+int _network_flush(network_context_t *ctx)
+{
+    assert(ctx);
+    return 0;
+}
+
+/* read packets from the peer, or for a listening mysocket, accept a new
+ * connection and read its SYN.
+ */
+int _network_recv_packets(network_context_t *ctx,
+                          struct iovec *packets, int max_packets)
+{
+    network_context_socket_unix_t *unix_io_ctx;
+    int num_packets = 0;
+
+    assert(ctx && packets && max_packets > 0);
+
+    unix_io_ctx = (network_context_socket_unix_t *) ctx->impl_data;
+    assert(unix_io_ctx);
+    assert(unix_io_ctx->sock_ctx);
+
+    VERIFY_SOCKET(ctx);
+
+    if (unix_io_ctx->sock_ctx->is_active && _unix_connect(ctx) < 0)
+        return -1;
+
+    if (unix_io_ctx->sock_ctx->listening)
+    {
+        struct sockaddr_un sun;
+        socklen_t sun_len = sizeof(sun);
+        struct sockaddr_in *peer = (struct sockaddr_in *) &ctx->peer_addr;
+        unsigned int port;
+        socket_t tmp_sd;
+        ssize_t rc;
+
+        /* as for TCP, a SYN that wasn't dispatched abandons its connection */
+        if (unix_io_ctx->new_socket != -1)
+        {
+            closesocket(unix_io_ctx->new_socket);
+            unix_io_ctx->new_socket = -1;
+        }
+
+        if ((tmp_sd = accept(GET_SOCKET(ctx), (struct sockaddr *) &sun,
+                             &sun_len)) < 0)
+        {
+            perror("accept (network_io_unix)");
+            return tmp_sd;
+        }
+
+        /* MSG_TRUNC returns the real length of an oversized packet */
+        if ((port = _unix_parse_addr(&sun, sun_len)) == 0 ||
+            (rc = recv(tmp_sd, unix_io_ctx->recv_bufs[0],
+                       unix_caps.max_packet_len, MSG_TRUNC)) <= 0 ||
+            rc > (ssize_t) unix_caps.max_packet_len)
+        {
+            DEBUG_LOG(("bad connection request\n"));
+            closesocket(tmp_sd);
+            return 0;
+        }
+
+        memset(&ctx->peer_addr, 0, sizeof(ctx->peer_addr));
+        peer->sin_family      = AF_INET;
+        peer->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        peer->sin_port        = htons(port);
+        ctx->peer_addr_len    = sizeof(*peer);
+
+        unix_io_ctx->new_socket = tmp_sd;
+        DEBUG_PEER(ctx);
+
+        packets[0].iov_base = unix_io_ctx->recv_bufs[0];
+        packets[0].iov_len  = rc;
+        return 1;
+    }
+
+    if (unix_io_ctx->recv_next == unix_io_ctx->recv_count)
+    {
+        int k, rc;
+
+        for (k = 0; k < UNIX_BATCH_SIZE; ++k)
+        {
+            struct msghdr *hdr = &unix_io_ctx->recv_msgs[k].msg_hdr;
+
+            unix_io_ctx->recv_iov[k].iov_base = unix_io_ctx->recv_bufs[k];
+            unix_io_ctx->recv_iov[k].iov_len  = unix_caps.max_packet_len;
+
+            memset(hdr, 0, sizeof(*hdr));
+            hdr->msg_iov    = &unix_io_ctx->recv_iov[k];
+            hdr->msg_iovlen = 1;
+        }
+
+        unix_io_ctx->recv_next = unix_io_ctx->recv_count = 0;
+
+        /* the socket is readable, so this doesn't block; MSG_WAITFORONE
+         * stops it waiting for the rest of the batch.
+         */
+        if ((rc = recvmmsg(GET_SOCKET(ctx), unix_io_ctx->recv_msgs,
+                           UNIX_BATCH_SIZE, MSG_WAITFORONE, NULL)) < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN)
+                return 0;
+
+            DEBUG_LOG(("recvmmsg failed (errno=%d)\n", errno));
+            return -1;
+        }
+
+        unix_io_ctx->recv_count = rc;
+    }
+
+    while (unix_io_ctx->recv_next < unix_io_ctx->recv_count &&
+           num_packets < max_packets)
+    {
+        int k = unix_io_ctx->recv_next++;
+        struct mmsghdr *msg = &unix_io_ctx->recv_msgs[k];
+
+        /* STCP never sends an empty packet, so this is EOF.  it's
+         * reported once the packets before it have been returned.
+         */
+        if (msg->msg_len == 0)
+        {
+            unix_io_ctx->recv_next = unix_io_ctx->recv_count;
+            return (num_packets > 0) ? num_packets : -1;
+        }
+
+        if (msg->msg_hdr.msg_flags & MSG_TRUNC)
+        {
+            DEBUG_LOG(("dropping oversized packet\n"));
+            continue;
+        }
+
+        packets[num_packets].iov_base = unix_io_ctx->recv_bufs[k];
+        packets[num_packets].iov_len  = msg->msg_len;
+        ++num_packets;
+    }
+
+    return num_packets;
+}
+
+bool_t _network_recv_pending(network_context_t *ctx)
+{
+    network_context_socket_unix_t *unix_io_ctx;
+
+    assert(ctx);
+
+    unix_io_ctx = (network_context_socket_unix_t *) ctx->impl_data;
+    assert(unix_io_ctx);
+
+    return unix_io_ctx->recv_next < unix_io_ctx->recv_count;
+}
+
+
+/* fill in the abstract socket name for the given port, returning its
+ * length.
+ */
+static socklen_t _unix_make_addr(struct sockaddr_un *sun, unsigned int port)
+{
+    assert(sun);
+
+    memset(sun, 0, sizeof(*sun));
+    sun->sun_family  = AF_UNIX;
+    sun->sun_path[0] = '\0';
+    snprintf(sun->sun_path + 1, sizeof(sun->sun_path) - 1,
+             UNIX_NAME_FORMAT, port);
+
+    return offsetof(struct sockaddr_un, sun_path) + 1 +
+           strlen(sun->sun_path + 1);
+}
+
+/* return the port whose name the given address is, or 0 if it isn't one */
+static unsigned int _unix_parse_addr(const struct sockaddr_un *sun,
+                                     socklen_t sun_len)
+{
+    struct sockaddr_un expected;
+    unsigned int port;
+
+    assert(sun);
+
+    if (sun_len <= offsetof(struct sockaddr_un, sun_path) + 1 ||
+        sun->sun_family != AF_UNIX || sun->sun_path[0] != '\0' ||
+        sscanf(sun->sun_path + 1, UNIX_NAME_FORMAT, &port) != 1 ||
+        port == 0 || port >= UNIX_NUM_PORTS ||
+        _unix_make_addr(&expected, port) != sun_len ||
+        memcmp(&expected, sun, sun_len) != 0)
+    {
+        return 0;
+    }
+
+    return port;
+}
+
+static int _unix_bind(network_context_t *ctx, unsigned int port)
+{
+    struct sockaddr_un sun;
+    socklen_t sun_len;
+
+    assert(ctx);
+    assert(port > 0 && port < UNIX_NUM_PORTS);
+
+    sun_len = _unix_make_addr(&sun, port);
+    if (bind(GET_SOCKET(ctx), (struct sockaddr *) &sun, sun_len) < 0)
+        return -1;
+
+    ctx->local_port = htons(port);
+    return 0;
+}
+
+static int _unix_connect(network_context_t *ctx)
+{
+    network_context_socket_unix_t *unix_io_ctx;
+
+    assert(ctx);
+
+    unix_io_ctx = (network_context_socket_unix_t *) ctx->impl_data;
+    assert(unix_io_ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&unix_io_ctx->connect_lock));
+    if (!unix_io_ctx->connected)
+    {
+        struct sockaddr_un sun;
+        socklen_t sun_len;
+
+        assert(ctx->peer_addr_valid);
+        assert(ctx->peer_addr.sa_family == AF_INET);
+        assert(((struct sockaddr_in *) &ctx->peer_addr)->sin_port > 0);
+
+        sun_len = _unix_make_addr(
+            &sun, ntohs(((struct sockaddr_in *) &ctx->peer_addr)->sin_port));
+        if (connect(GET_SOCKET(ctx), (struct sockaddr *) &sun, sun_len) < 0)
+        {
+            perror("connect (_unix_connect)");
+            PTHREAD_CALL(pthread_mutex_unlock(&unix_io_ctx->connect_lock));
+            return -1;
+        }
+
+        unix_io_ctx->connected = TRUE;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&unix_io_ctx->connect_lock));
+
+    return 0;
+}
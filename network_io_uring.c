@@ -0,0 +1,249 @@
+/* network_io_uring.c: minimal io_uring engine (see network_io_uring.h) */
+
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "network_io_uring.h"
+
+
+int _uring_init(uring_t *ring, unsigned int entries)
+{
+    struct io_uring_params params;
+    char *sq_ring, *cq_ring;
+
+    assert(ring && entries > 0);
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+
+    if ((ring->fd = syscall(__NR_io_uring_setup, entries, &params)) < 0)
+        return -1;
+
+    ring->sq_ring_len = params.sq_off.array +
+                        params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_len = params.cq_off.cqes +
+                        params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_len    = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    /* both queues' rings may share a single mapping */
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_ring_len > ring->sq_ring_len)
+            ring->sq_ring_len = ring->cq_ring_len;
+        ring->cq_ring_len = ring->sq_ring_len;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+        goto error;
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->cq_ring = ring->sq_ring;
+    }
+    else if ((ring->cq_ring = mmap(NULL, ring->cq_ring_len,
+                                   PROT_READ | PROT_WRITE,
+                                   MAP_SHARED | MAP_POPULATE, ring->fd,
+                                   IORING_OFF_CQ_RING)) == MAP_FAILED)
+    {
+        goto error;
+    }
+
+    ring->sqes = (struct io_uring_sqe *)
+        mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if ((void *) ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+        goto error;
+    }
+
+    sq_ring = (char *) ring->sq_ring;
+    ring->sq_head    = (unsigned int *) (sq_ring + params.sq_off.head);
+    ring->sq_tail    = (unsigned int *) (sq_ring + params.sq_off.tail);
+    ring->sq_mask    = (unsigned int *) (sq_ring + params.sq_off.ring_mask);
+    ring->sq_array   = (unsigned int *) (sq_ring + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->sqe_tail   = *ring->sq_tail;
+
+    cq_ring = (char *) ring->cq_ring;
+    ring->cq_head = (unsigned int *) (cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned int *) (cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *) (cq_ring + params.cq_off.ring_mask);
+    ring->cqes    = (struct io_uring_cqe *) (cq_ring + params.cq_off.cqes);
+
+    return 0;
+
+error:
+    {
+        int saved_errno = errno;
+
+        if (ring->sq_ring == MAP_FAILED)
+            ring->sq_ring = NULL;
+        if (ring->cq_ring == MAP_FAILED)
+            ring->cq_ring = NULL;
+        _uring_destroy(ring);
+        errno = saved_errno;
+    }
+    return -1;
+}
+
+void _uring_destroy(uring_t *ring)
+{
+    assert(ring);
+
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_len);
+    if (ring->sq_ring)
+        munmap(ring->sq_ring, ring->sq_ring_len);
+    if (ring->fd >= 0)
+        close(ring->fd);
+
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+struct io_uring_sqe *_uring_get_sqe(uring_t *ring)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int index;
+
+    assert(ring && ring->fd >= 0);
+
+    if (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >=
+        ring->sq_entries)
+    {
+        return NULL;
+    }
+
+    index = ring->sqe_tail++ & *ring->sq_mask;
+    ring->sq_array[index] = index;
+
+    sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int _uring_enter(uring_t *ring, unsigned int wait_nr)
+{
+    unsigned int to_submit;
+
+    assert(ring && ring->fd >= 0);
+
+    /* anything published but not yet consumed by the kernel (e.g. if the
+     * last call was interrupted) is submitted along with the new SQEs.
+     */
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    to_submit = ring->sqe_tail - __atomic_load_n(ring->sq_head,
+                                                 __ATOMIC_ACQUIRE);
+
+    if (to_submit == 0 && wait_nr == 0)
+        return 0;
+
+    return syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr,
+                   wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+struct io_uring_cqe *_uring_peek_cqe(uring_t *ring)
+{
+    unsigned int head;
+
+    assert(ring && ring->fd >= 0);
+
+    head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void _uring_cqe_seen(uring_t *ring)
+{
+    assert(ring && ring->fd >= 0);
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* queue a request giving num_bufs buffers, starting at bid, back to the
+ * kernel.  if the submission queue is full, it's flushed first.
+ */
+static int _uring_provide(uring_t *ring, uring_buf_group_t *group,
+                          uint16_t bid, unsigned int num_bufs)
+{
+    struct io_uring_sqe *sqe;
+
+    assert(ring && group && bid + num_bufs <= group->num_bufs);
+
+    while (!(sqe = _uring_get_sqe(ring)))
+    {
+        if (_uring_enter(ring, 0) < 0 && errno != EINTR)
+            return -1;
+    }
+
+    sqe->opcode    = IORING_OP_PROVIDE_BUFFERS;
+    sqe->flags     = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->fd        = num_bufs;
+    sqe->addr      = (uint64_t) (uintptr_t) _uring_buf(group, bid);
+    sqe->len       = group->buf_len;
+    sqe->off       = bid;
+    sqe->buf_group = group->bgid;
+    sqe->user_data = 0;
+    return 0;
+}
+
+int _uring_buf_group_init(uring_t *ring, uring_buf_group_t *group,
+                          uint16_t bgid, unsigned int num_bufs,
+                          unsigned int buf_len)
+{
+    assert(ring && ring->fd >= 0 && group);
+    assert(num_bufs > 0 && num_bufs <= 65536);
+
+    memset(group, 0, sizeof(*group));
+    group->num_bufs = num_bufs;
+    group->buf_len  = buf_len;
+    group->bgid     = bgid;
+
+    if (!(group->bufs = (char *) malloc((size_t) num_bufs * buf_len)))
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (_uring_provide(ring, group, 0, num_bufs) < 0)
+    {
+        int saved_errno = errno;
+
+        _uring_buf_group_destroy(group);
+        errno = saved_errno;
+        return -1;
+    }
+
+    return 0;
+}
+
+void _uring_buf_group_destroy(uring_buf_group_t *group)
+{
+    assert(group);
+
+    free(group->bufs);
+    memset(group, 0, sizeof(*group));
+}
+
+char *_uring_buf(uring_buf_group_t *group, uint16_t bid)
+{
+    assert(group && group->bufs && bid < group->num_bufs);
+    return group->bufs + (size_t) bid * group->buf_len;
+}
+
+int _uring_buf_recycle(uring_t *ring, uring_buf_group_t *group, uint16_t bid)
+{
+    return _uring_provide(ring, group, bid, 1);
+}
@@ -0,0 +1,83 @@
+/* network_io_uring.h--minimal io_uring engine, used by the TCP network
+ * layer when built with -DTCP_IO_URING (see network_io_tcp.c).  this talks
+ * to the kernel directly, so doesn't need liburing.  it's used only by the
+ * network I/O layer.
+ */
+
+#ifndef __NETWORK_IO_URING_H__
+#define __NETWORK_IO_URING_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+/* a ring, used by one thread at a time */
+typedef struct
+{
+    int fd;
+
+    /* submission queue */
+    unsigned int        *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int         sq_entries;
+    unsigned int         sqe_tail;  /* SQEs handed out by _uring_get_sqe() */
+    struct io_uring_sqe *sqes;
+
+    /* completion queue */
+    unsigned int        *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void  *sq_ring, *cq_ring;
+    size_t sq_ring_len, cq_ring_len, sqes_len;
+} uring_t;
+
+/* buffers provided to the kernel, from which it picks one for each
+ * completion of an IOSQE_BUFFER_SELECT request in group bgid.
+ */
+typedef struct
+{
+    char        *bufs;
+    unsigned int num_bufs;
+    unsigned int buf_len;
+    uint16_t     bgid;
+} uring_buf_group_t;
+
+
+/* returns 0 on success, or -1 (with errno set) on error */
+int _uring_init(uring_t *ring, unsigned int entries);
+void _uring_destroy(uring_t *ring);
+
+/* returns a cleared SQE to fill in, or NULL if the submission queue is
+ * full.  it's submitted by the next _uring_enter().
+ */
+struct io_uring_sqe *_uring_get_sqe(uring_t *ring);
+
+/* submit any new SQEs, then wait for at least wait_nr completions.
+ * returns < 0 (with errno set) on error, including EINTR.
+ */
+int _uring_enter(uring_t *ring, unsigned int wait_nr);
+
+/* returns the oldest unseen completion, or NULL if there isn't one */
+struct io_uring_cqe *_uring_peek_cqe(uring_t *ring);
+void _uring_cqe_seen(uring_t *ring);
+
+/* provide num_bufs buffers of buf_len bytes to the kernel as group bgid.
+ * this (like _uring_buf_recycle()) is only queued, for the next
+ * _uring_enter(); it completes silently unless it fails, in which case
+ * the completion has user_data 0.  returns 0 on success, or -1 (with errno
+ * set) on error.
+ */
+int _uring_buf_group_init(uring_t *ring, uring_buf_group_t *group,
+                          uint16_t bgid, unsigned int num_bufs,
+                          unsigned int buf_len);
+
+/* the buffers remain in use until the ring itself is destroyed, so this
+ * must only be called after _uring_destroy().
+ */
+void _uring_buf_group_destroy(uring_buf_group_t *group);
+
+/* address of the given buffer, and returning it to the kernel once done */
+char *_uring_buf(uring_buf_group_t *group, uint16_t bid);
+int _uring_buf_recycle(uring_t *ring, uring_buf_group_t *group,
+                       uint16_t bid);
+
+#endif  /* __NETWORK_IO_URING_H__ */
@@ -0,0 +1,132 @@
+/*
+ * sendfile_check.c
+ *
+ * Checks that a file passed to mysendfile(), and truncated before the
+ * transport layer gets around to reading it, is dropped without tearing
+ * down the connection.  Both ends of the connection are in this process:
+ * one thread queues a block of data with mywrite(), then the file, then
+ * truncates the file and ends the line; the other reads it all back with
+ * myreadline(), which should return the block and the "\r\n", with
+ * nothing from the file.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include "mysock.h"
+
+
+#define BLOCK_LEN       100000  /* queued ahead of the file */
+#define FILE_LEN        200000
+
+static struct sockaddr_in server_addr;
+static char block[BLOCK_LEN];
+
+
+static void _fail(const char *what)
+{
+    perror(what);
+    exit(EXIT_FAILURE);
+}
+
+/* connect to the listening mysocket and send everything */
+static void *_sender_func(void *arg)
+{
+    static const char file_data[] = "this should never be received ";
+    char path[] = "/tmp/sendfile_checkXXXXXX";
+    mysocket_t sd;
+    size_t k;
+    int fd;
+
+    if ((fd = mkstemp(path)) < 0)
+        _fail("mkstemp");
+    unlink(path);
+
+    for (k = 0; k < FILE_LEN; k += sizeof(file_data) - 1)
+    {
+        if (write(fd, file_data, sizeof(file_data) - 1) < 0)
+            _fail("write");
+    }
+
+    if ((sd = mysocket()) < 0)
+        _fail("mysocket");
+    if (myconnect(sd, (struct sockaddr *) &server_addr,
+                  sizeof(server_addr)) < 0)
+    {
+        _fail("myconnect");
+    }
+
+    /* the block keeps the transport busy while the file is truncated */
+    if (mywrite(sd, block, sizeof(block)) < 0)
+        _fail("mywrite");
+    if (mysendfile(sd, fd, 0, FILE_LEN) != FILE_LEN)
+        _fail("mysendfile");
+    if (ftruncate(fd, 0) < 0)
+        _fail("ftruncate");
+    close(fd);
+
+    if (mywrite(sd, "\r\n", 2) < 0)
+        _fail("mywrite");
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    static char line[BLOCK_LEN + FILE_LEN + 3];
+    struct sockaddr_in sin;
+    socklen_t sin_len = sizeof(sin);
+    int len = sizeof(sin);
+    mysocket_t bindsd, sd;
+    pthread_t sender;
+    size_t k;
+
+    for (k = 0; k < sizeof(block); ++k)
+        block[k] = 'a' + k % 26;
+
+    if ((bindsd = mysocket()) < 0)
+        _fail("mysocket");
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = htons(0);
+
+    if (mybind(bindsd, (struct sockaddr *) &sin, sizeof(sin)) < 0)
+        _fail("mybind");
+    if (mylisten(bindsd, 5) < 0)
+        _fail("mylisten");
+    if (mygetsockname(bindsd, (struct sockaddr *) &server_addr,
+                      &sin_len) < 0)
+    {
+        _fail("mygetsockname");
+    }
+    server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (pthread_create(&sender, NULL, _sender_func, NULL) != 0)
+        _fail("pthread_create");
+
+    if ((sd = myaccept(bindsd, (struct sockaddr *) &sin, &len)) < 0)
+        _fail("myaccept");
+
+    if ((len = myreadline(sd, line, sizeof(line))) < 0)
+        _fail("myreadline");
+
+    if (len != BLOCK_LEN + 2 || memcmp(line, block, BLOCK_LEN) ||
+        strcmp(line + BLOCK_LEN, "\r\n"))
+    {
+        fprintf(stderr, "sendfile_check: received %d bytes, expected %d\n",
+                len, BLOCK_LEN + 2);
+        return EXIT_FAILURE;
+    }
+
+    /* the transport layer doesn't close connections cleanly, so just exit
+     * once the data is in
+     */
+    printf("sendfile_check: truncated file dropped\n");
+    return EXIT_SUCCESS;
+}
@@ -29,7 +29,7 @@
 static char usage[] = "usage: %s \n";
 
 static void do_connection(mysocket_t bindsd);
-static int get_nvt_line(int sd, char *);
+static int get_nvt_line(int sd, char *, size_t);
 static int process_line(int sd, char *);
 static int local_name(mysocket_t sd, char *name);
 
@@ -129,7 +129,7 @@ static void do_connection(mysocket_t sd)
 
     for (;;)
     {
-        rc = get_nvt_line(sd, line);
+        rc = get_nvt_line(sd, line, sizeof(line));
         if (rc < 0 || !*line)
             goto done;
         fprintf(stderr, "client: %s\n", line);
@@ -159,38 +159,31 @@ done:
  *  -1 on failure
  */
 static int
-get_nvt_line(int sd, char *line)
+get_nvt_line(int sd, char *line, size_t line_len)
 {
-    char last_char;
-    char this_char;
     int len;
 
-    last_char = '\0';
-    for (;;)
-    {
-        len = myread(sd, &this_char, sizeof(this_char));
-        if (len < 0)
-            return -1;
+    /* the whole line is returned by a single call */
+    if ((len = myreadline(sd, line, line_len)) < 0)
+        return -1;
 
-        if (len == 0)
-        {
-            /* Connection ended before line terminator (or empty string) */
-            *line = '\0';
-            return 0;
-        }
-    /** fprintf(stderr, "read character %c\n", this_char); **/
-        if (last_char == '\r' && this_char == '\n')
+    if (len < 2 || line[len - 2] != '\r' || line[len - 1] != '\n')
+    {
+        if (len == (int) line_len - 1)
         {
-            /* Reached the end of line. Already wrote \r into string, overwrite
-             * it with a NUL */
-            line[-1] = '\0';
-            return 0;
+            errno = EMSGSIZE;
+            return -1;  /* line too long */
         }
 
-        *line++ = this_char;
-        last_char = this_char;
+        /* Connection ended before line terminator (or empty string); any
+         * partial line is returned as is
+         */
+        return 0;
     }
-    return -1;
+
+    /* Reached the end of line; overwrite the \r\n with a NUL */
+    line[len - 2] = '\0';
+    return 0;
 }
 
 /**********************************************************************/
@@ -208,7 +201,8 @@ static int
 process_line(int sd, char *line)
 {
     char resp[5000];
-    int fd = -1, length;
+    int fd = -1;
+    off_t length = 0;
 
     if (!*line || access(line, R_OK) < 0)
     {
@@ -222,8 +216,8 @@ process_line(int sd, char *line)
         }
         else
         {
-            sprintf(resp, "%s,%lu,Ok\r\n", line, lseek(fd, 0, SEEK_END));
-            lseek(fd, 0, SEEK_SET);
+            length = lseek(fd, 0, SEEK_END);
+            sprintf(resp, "%s,%lu,Ok\r\n", line, (unsigned long) length);
         }
     }
   /** fprintf(stderr, "sending to client: %s of length %d bytes\n", resp, strlen(resp)); **/
@@ -238,26 +232,12 @@ process_line(int sd, char *line)
     if (fd == -1)
         return 0;
 
-    for (;;)
+    /* the file is read by the mysocket layer as it's sent */
+    if (length > 0 && mysendfile(sd, fd, 0, length) < 0)
     {
-        length = read(fd, resp, sizeof(resp));
-        if (length == 0)
-            break;
-
-        if (length == -1)
-        {
-            perror("read");
-            close(fd);
-            return -1;
-        }
-
-        /* fwrite(resp, length, 1, stdout); */
-
-        if (mywrite(sd, resp, length) < 0)
-        {
-            close(fd);
-            return -1;
-        }
+        perror("mysendfile");
+        close(fd);
+        return -1;
     }
 
     close(fd);
@@ -3,6 +3,8 @@
 #include <pthread.h>
 #include <stdarg.h>
 #include <string.h>
+#include <alloca.h>
+#include <sys/uio.h>
 #include <errno.h>
 #include <assert.h>
 #include <netinet/in.h>
@@ -14,6 +16,10 @@
 #include "connection_demux.h"
 #include "tcp_sum.h"
 #include "transport.h"
+#include "mysock_epoll.h"
+
+
+static void _stcp_fill_header(mysock_context_t *ctx, struct tcphdr *header);
 
 
 /* called by the transport layer thread to unblock the calling application,
@@ -40,6 +46,9 @@ void stcp_unblock_application(mysocket_t sd)
     PTHREAD_CALL(pthread_mutex_unlock(&ctx->blocking_lock));
     PTHREAD_CALL(pthread_cond_signal(&ctx->blocking_cond));
 
+    /* a non-blocking myconnect() is complete once the mysocket is writable */
+    _mysock_epoll_notify(ctx);
+
     if (!ctx->is_active)
     {
         /* move from incomplete to completed connection queue */
@@ -66,6 +75,12 @@ unsigned int stcp_wait_for_event(mysocket_t             sd,
     unsigned int rc = 0;
     mysock_context_t *ctx = _mysock_get_context(sd);
 
+    /* anything held back by the network layer must go out before we
+     * (potentially) block.  this may block itself, so it's done before
+     * taking data_ready_lock.
+     */
+    (void) _network_flush(&ctx->network_state);
+
     PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
     for (;;)
     {
@@ -157,14 +172,56 @@ void *stcp_get_context(mysocket_t sd)
  */
 ssize_t stcp_network_recv(mysocket_t sd, void *dst, size_t max_len)
 {
-    ssize_t len = _network_recv(sd, dst, max_len);
-
-    /* checksum should have been verified by underlying network layer in
-     * this implementation.
+    /* packets with bad checksums have already been dropped by the
+     * underlying network layer in this implementation.
      */
-    assert(len <= 0 ||
-           _mysock_verify_checksum(_mysock_get_context(sd), dst, len));
-    return len;
+    return _network_recv(sd, dst, max_len);
+}
+
+/* stcp_network_recv_buf
+ *
+ * As stcp_network_recv(), but returns the queued datagram itself rather than
+ * a copy of it.  The buffer must be released with stcp_free_buf(), or passed
+ * up to the application with stcp_app_send_buf().
+ */
+ssize_t stcp_network_recv_buf(mysocket_t sd, void **packet)
+{
+    return _network_recv_buf(sd, packet);
+}
+
+/* stcp_network_recv_batch
+ *
+ * As stcp_network_recv_buf(), but hands over up to max_packets queued
+ * datagrams at once, taking the receive queue's lock only once.
+ */
+int stcp_network_recv_batch(mysocket_t sd, struct iovec *packets,
+                            int max_packets)
+{
+    return _network_recv_batch(sd, packets, max_packets);
+}
+
+/* take an additional reference to a buffer */
+void stcp_hold_buf(void *packet)
+{
+    _mysock_hold_node(_mysock_buffer_node(packet));
+}
+
+/* drop a reference to a buffer from stcp_network_recv_buf() or
+ * stcp_app_recv_buf()
+ */
+void stcp_free_buf(void *packet)
+{
+    if (packet)
+        _mysock_free_node(_mysock_buffer_node(packet));
+}
+
+/* largest datagram the network layer can carry to the peer */
+size_t stcp_network_max_packet_len(mysocket_t sd)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    assert(ctx);
+    return _network_get_caps(&ctx->network_state)->max_packet_len;
 }
 
 /* stcp_network_send()
@@ -187,34 +244,256 @@ ssize_t stcp_network_recv(mysocket_t sd, void *dst, size_t max_len)
  */
 ssize_t stcp_network_send(mysocket_t sd, const void *src, size_t src_len, ...)
 {
-    mysock_context_t *ctx = _mysock_get_context(sd);
-    char              packet[MAX_IP_PAYLOAD_LEN];
-    size_t            packet_len;
-    const void       *next_buf;
-    va_list           argptr;
-    struct tcphdr    *header;
+    struct iovec *iov;
+    int           iovcnt = 1;
+    const void   *next_buf;
+    va_list       argptr;
 
-    assert(ctx && src);
-
-    assert(src_len <= sizeof(packet));
-    memcpy(packet, src, src_len);
-    packet_len = src_len;
+    assert(src);
 
+    /* count the pieces, then pass them on as they are */
     va_start(argptr, src_len);
     while ((next_buf = va_arg(argptr, const void *)))
     {
-        size_t next_len = va_arg(argptr, size_t);
+        (void) va_arg(argptr, size_t);
+        ++iovcnt;
+    }
+    va_end(argptr);
 
-        assert(packet_len + next_len <= sizeof(packet));
-        memcpy(packet + packet_len, next_buf, next_len);
-        packet_len += next_len;
+    iov = (struct iovec *) alloca(iovcnt * sizeof(struct iovec));
+    iov[0].iov_base = (void *) src;
+    iov[0].iov_len  = src_len;
+
+    iovcnt = 1;
+    va_start(argptr, src_len);
+    while ((next_buf = va_arg(argptr, const void *)))
+    {
+        iov[iovcnt].iov_base = (void *) next_buf;
+        iov[iovcnt].iov_len  = va_arg(argptr, size_t);
+        ++iovcnt;
     }
     va_end(argptr);
 
-    /* fill in fields in the TCP header that aren't handled by students */
+    return stcp_network_sendv(sd, iov, iovcnt);
+}
+
+/* stcp_network_sendv()
+ *
+ * As stcp_network_send(), but the pieces of the datagram are given by an
+ * iovec.  The pieces are passed down to the network layer as they are;
+ * only the TCP header is copied, so that the fields not handled by
+ * students can be filled in.
+ */
+ssize_t stcp_network_sendv(mysocket_t sd, const struct iovec *iov, int iovcnt)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    struct tcphdr     header;
+    struct iovec     *packet_iov;
+    int               packet_iovcnt = 1;
+    size_t            header_len = 0, packet_len = sizeof(header);
+    int               k;
+
+    assert(ctx && iov && iovcnt > 0);
+
+    /* the header is normally the whole of the first piece, but it may be
+     * split across several.
+     */
+    packet_iov = (struct iovec *) alloca((iovcnt + 1) * sizeof(struct iovec));
+    packet_iov[0].iov_base = &header;
+    packet_iov[0].iov_len  = sizeof(header);
+
+    for (k = 0; k < iovcnt; ++k)
+    {
+        const char *piece     = (const char *) iov[k].iov_base;
+        size_t      piece_len = iov[k].iov_len;
+
+        assert(piece || !piece_len);
+        if (header_len < sizeof(header))
+        {
+            size_t len = MIN(piece_len, sizeof(header) - header_len);
+
+            memcpy((char *) &header + header_len, piece, len);
+            header_len += len;
+            piece      += len;
+            piece_len  -= len;
+        }
+
+        if (piece_len > 0)
+        {
+            packet_iov[packet_iovcnt].iov_base = (void *) piece;
+            packet_iov[packet_iovcnt].iov_len  = piece_len;
+            ++packet_iovcnt;
+            packet_len += piece_len;
+        }
+    }
+
+    assert(header_len == sizeof(header));
+    assert(packet_len <=
+           _network_get_caps(&ctx->network_state)->max_packet_len);
+
+    _stcp_fill_header(ctx, &header);
+    if (!_network_get_caps(&ctx->network_state)->csum_offload)
+        _mysock_set_checksum_v(ctx, packet_iov, packet_iovcnt);
+    return _network_sendv(sd, packet_iov, packet_iovcnt);
+}
+
+/* stcp_network_send_buf()
+ *
+ * As stcp_network_send(), but the datagram is sent straight from the given
+ * buffer, with the header finished in place.  The buffer is left with the
+ * caller.
+ *
+ * The payload is normally summed as mywrite() copies it into the buffer,
+ * so only the header need be checksummed here.  If the same buffer is sent
+ * again (e.g. retransmitted with a new ACK or window), the checksum is
+ * updated incrementally for whatever changed in the header (RFC 1624).
+ * None of this is needed if the network layer offloads checksums.
+ */
+ssize_t stcp_network_send_buf(mysocket_t sd, void *packet, size_t packet_len)
+{
+    mysock_context_t    *ctx = _mysock_get_context(sd);
+    packet_queue_node_t *node;
+    struct tcphdr       *header;
+    struct iovec         iov;
+
+    assert(ctx && packet);
+    node = _mysock_buffer_node(packet);
+    assert(!node->frag_list);
     assert(packet_len >= sizeof(struct tcphdr));
+    assert(packet_len <= node->data_len + STCP_HEADROOM);
+    assert(sizeof(node->sent_header) == sizeof(struct tcphdr));
+
     header = (struct tcphdr *) packet;
+    _stcp_fill_header(ctx, header);
+
+    if (_network_get_caps(&ctx->network_state)->csum_offload)
+    {
+        /* th_sum is left as 0 */
+    }
+    else if (node->sent_len == packet_len)
+    {
+        /* the payload can't have changed since it was last sent (see
+         * stcp_api.h)
+         */
+        header->th_sum = _mysock_csum_update(node->sent_sum,
+                                             node->sent_header, header,
+                                             sizeof(*header));
+    }
+    else if (_mysock_node_csum_valid(node) &&
+             node->data == (char *) packet + sizeof(*header) &&
+             node->data_len == packet_len - sizeof(*header))
+    {
+        _mysock_set_checksum_partial(ctx, packet, sizeof(*header),
+                                     packet_len, node->csum);
+    }
+    else
+    {
+        _mysock_set_checksum(ctx, packet, packet_len);
+    }
+
+    memcpy(node->sent_header, header, sizeof(*header));
+    ((struct tcphdr *) node->sent_header)->th_sum = 0;
+    node->sent_sum = header->th_sum;
+    node->sent_len = packet_len;
+
+    iov.iov_base = packet;
+    iov.iov_len  = packet_len;
+    return _network_sendv(sd, &iov, 1);
+}
+
+/* stcp_network_send_gso()
+ *
+ * Split src into mss-sized segments behind copies of the given header,
+ * and pass them to the network layer max_segments at a time.  The ports
+ * are filled in once, on the template; per segment, only th_seq (and the
+ * flags, on the first and last) change, and the checksum is made up from
+ * the header plus a sum over that segment's payload.
+ */
+ssize_t stcp_network_send_gso(mysocket_t sd, const void *header,
+                              const void *src, size_t src_len, size_t mss)
+{
+    mysock_context_t     *ctx = _mysock_get_context(sd);
+    const network_caps_t *caps;
+    struct tcphdr         template_header, *headers;
+    struct iovec         *packet_iov;
+    tcp_seq               seq;
+    uint8_t               flags;
+    size_t                num_segments, max_segments, offset = 0, syn_len;
+    ssize_t               total = 0;
+
+    assert(ctx && header && (src || !src_len) && mss > 0);
+
+    caps = _network_get_caps(&ctx->network_state);
+    assert(sizeof(template_header) + mss <= caps->max_packet_len);
+
+    memcpy(&template_header, header, sizeof(template_header));
+    _stcp_fill_header(ctx, &template_header);
+
+    seq   = ntohl(template_header.th_seq);
+    flags = template_header.th_flags;
+    template_header.th_flags &= ~(TH_SYN | TH_FIN | TH_PUSH);
+
+    /* a SYN takes up a sequence number ahead of the data */
+    syn_len = (flags & TH_SYN) ? 1 : 0;
+
+    num_segments = (src_len > 0) ? (src_len + mss - 1) / mss : 1;
+    max_segments = MIN(num_segments, MAX(caps->max_segments, 1));
+
+    headers    = (struct tcphdr *) alloca(max_segments * sizeof(*headers));
+    packet_iov = (struct iovec *)
+        alloca(2 * max_segments * sizeof(struct iovec));
+
+    while (num_segments > 0)
+    {
+        size_t batch = MIN(num_segments, max_segments), k;
+        ssize_t rc;
+
+        for (k = 0; k < batch; ++k)
+        {
+            size_t len = MIN(mss, src_len - offset);
+
+            headers[k] = template_header;
+            headers[k].th_seq = htonl(seq + offset + (offset ? syn_len : 0));
+            if (offset == 0)
+                headers[k].th_flags |= flags & TH_SYN;
+            if (k == num_segments - 1)
+                headers[k].th_flags |= flags & (TH_FIN | TH_PUSH);
+
+            packet_iov[2 * k].iov_base     = &headers[k];
+            packet_iov[2 * k].iov_len      = sizeof(headers[k]);
+            packet_iov[2 * k + 1].iov_base = (char *) src + offset;
+            packet_iov[2 * k + 1].iov_len  = len;
+
+            if (!caps->csum_offload)
+            {
+                _mysock_set_checksum_partial(ctx, &headers[k],
+                                             sizeof(headers[k]),
+                                             sizeof(headers[k]) + len,
+                                             _mysock_csum_partial(
+                                                 (char *) src + offset, len));
+            }
+
+            offset += len;
+        }
+
+        if ((rc = _network_sendv_packets(sd, packet_iov, 2, batch)) < 0)
+            return -1;
 
+        total        += rc;
+        num_segments -= batch;
+    }
+
+    return total;
+}
+
+/* fill in fields in the TCP header that aren't handled by students */
+static void _stcp_fill_header(mysock_context_t *ctx, struct tcphdr *header)
+{
+    assert(ctx && header);
+
+    /* the local port is cached by the network layer (see
+     * _network_get_port()); the peer's is read each time, as it may change
+     */
     header->th_sport = _network_get_port(&ctx->network_state);
     /* N.B. assert(header->th_sport > 0) fires in the UDP SYN-ACK case */
 
@@ -223,11 +502,8 @@ ssize_t stcp_network_send(mysocket_t sd, const void *src, size_t src_len, ...)
         ((struct sockaddr_in *) &ctx->network_state.peer_addr)->sin_port;
     assert(header->th_dport > 0);
 
-    header->th_sum = 0; /* set below */
+    header->th_sum = 0; /* set by the caller, unless offloaded */
     header->th_urp = 0; /* ignored */
-
-    _mysock_set_checksum(ctx, packet, packet_len);
-    return _network_send(sd, packet, packet_len);
 }
 
 /* receive data from the application (sent to us using mywrite()).
@@ -246,6 +522,23 @@ size_t stcp_app_recv(mysocket_t sd, void *dst, size_t max_len)
                                   dst, max_len, TRUE);
 }
 
+/* receive data from the application without copying it.  mywrite() queues
+ * its data in segments with room for the STCP header, so normally the
+ * segment at the head of the queue is handed over as is.
+ */
+size_t stcp_app_recv_buf(mysocket_t sd, void **packet, size_t max_len)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    packet_queue_node_t *node;
+
+    assert(ctx && packet && max_len > 0);
+
+    node = _mysock_dequeue_segment(ctx, &ctx->app_recv_queue,
+                                   STCP_HEADROOM, max_len);
+    *packet = node->buf;
+    return node->data_len;
+}
+
 /* pass data up to the application for consumption by myread() */
 void stcp_app_send(mysocket_t sd, const void *src, size_t src_len)
 {
@@ -259,6 +552,57 @@ void stcp_app_send(mysocket_t sd, const void *src, size_t src_len)
     }
 }
 
+/* pass part of a received datagram up to the application.  the buffer is
+ * queued as is, with only its data pointer adjusted to skip the headers.
+ * any segments coalesced with it are queued behind it in the same way.
+ */
+void stcp_app_send_buf(mysocket_t sd, void *packet, size_t offset, size_t len)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    packet_queue_node_t *node, *frag, *tail, *next;
+    size_t left;
+
+    assert(ctx && packet);
+    node = _mysock_buffer_node(packet);
+
+    if (len == 0)
+    {
+        /* a zero-length node would signal EOF */
+        _mysock_free_node(node);
+        return;
+    }
+
+    assert(offset < node->data_len);
+    DEBUG_LOG(("stcp_app_send_buf(%d):  passing %u bytes up to app\n",
+               sd, (unsigned) len));
+    node->data     += offset;
+    node->data_len -= offset;
+
+    frag = node->frag_list;
+    node->frag_list = NULL;
+
+    /* the nodes are queued as one chain, trimmed to len bytes */
+    for (tail = node, left = len - MIN(len, node->data_len);
+         left > 0; tail = frag, frag = frag->next)
+    {
+        assert(frag);
+        frag->data_len = MIN(frag->data_len, left);
+        left -= frag->data_len;
+        tail->next = frag;
+    }
+    tail->next = NULL;
+    node->data_len = MIN(node->data_len, len);
+
+    for (; frag; frag = next)
+    {
+        next = frag->next;
+        frag->next = NULL;
+        _mysock_free_node(frag);
+    }
+
+    _mysock_enqueue_chain(ctx, &ctx->app_send_queue, node);
+}
+
 void stcp_fin_received(mysocket_t sd)
 {
     mysock_context_t *ctx = _mysock_get_context(sd);
@@ -7,6 +7,7 @@
 #define __STCP_API_H__
 
 #include <time.h>   /* timespec */
+#include <sys/uio.h>    /* iovec */
 #include "mysock.h" /* mysocket_t */
 
 
@@ -81,6 +82,102 @@ void *stcp_get_context(mysocket_t my_sd);
  */
 ssize_t stcp_network_recv(mysocket_t sd, void *dst, size_t max_len);
 
+/* Receive a datagram from the peer without copying it.
+ *
+ * sd       Mysocket descriptor.
+ * packet   Set to the received datagram, or to NULL if nothing was
+ *          received.
+ *
+ * This call returns the length of the datagram.  The buffer belongs to the
+ * caller, who must either release it with stcp_free_buf() or hand it on to
+ * the application with stcp_app_send_buf().
+ *
+ * If the library is built with -DRECV_COALESCE, in-order data segments
+ * that have already arrived behind the first may be coalesced with it into
+ * a single datagram (with the first's sequence number, and the last's
+ * acknowledgement and window), up to the largest the network layer can
+ * carry.  The returned length is then that of the whole datagram, but only
+ * the header and the first segment's payload are in the buffer itself; the
+ * rest is kept with it, and is only passed on by stcp_app_send_buf().
+ * Segments with options, or with flags other than TH_ACK and TH_PUSH, are
+ * always returned as they arrived.
+ */
+ssize_t stcp_network_recv_buf(mysocket_t sd, void **packet);
+
+/* Receive several datagrams from the peer at once.
+ *
+ * sd           Mysocket descriptor.
+ * packets      An array to receive the datagrams; each entry's iov_base is
+ *              set to a datagram (or NULL), as for
+ *              stcp_network_recv_buf(), and its iov_len to the datagram's
+ *              length.
+ * max_packets  The number of entries in packets.
+ *
+ * This call blocks until at least one datagram is available, then returns
+ * as many of those waiting as fit, in the order they arrived.  Unlike
+ * stcp_network_recv_buf(), segments are never coalesced, so a burst can be
+ * processed (and acknowledged) as a whole.  Each buffer must be released
+ * with stcp_free_buf() or handed on with stcp_app_send_buf().  This call
+ * returns the number of entries filled in.
+ */
+int stcp_network_recv_batch(mysocket_t sd, struct iovec *packets,
+                            int max_packets);
+
+/* Send a datagram to the peer, from a buffer returned by
+ * stcp_app_recv_buf() (or stcp_network_recv_buf(), unless it's coalesced).
+ *
+ * sd           Mysocket descriptor
+ * packet       The datagram, starting with its STCP header
+ * packet_len   The length in bytes of the datagram
+ *
+ * The buffer is not consumed, so it may be kept (e.g. for retransmission)
+ * and sent again later.  Only the STCP header may be changed between sends
+ * of the same buffer:  if packet_len is unchanged, the payload (everything
+ * after the 20-byte header) is assumed to be too, and its checksum isn't
+ * recomputed.  Returns the number of bytes transferred on success, or -1
+ * on failure.
+ */
+ssize_t stcp_network_send_buf(mysocket_t sd, void *packet, size_t packet_len);
+
+/* Send a run of data to the peer as a series of datagrams (segmentation
+ * offload).
+ *
+ * sd           Mysocket descriptor
+ * header       STCP header (without options) for the first datagram; its
+ *              th_seq is the sequence number of the first byte of src, or
+ *              of the SYN if TH_SYN is set
+ * src          The data to send
+ * src_len      The length in bytes of the data
+ * mss          The most data to carry in each datagram
+ *
+ * The data is split into datagrams of up to mss bytes, each with a copy of
+ * the header whose sequence number is advanced to match.  TH_SYN is only
+ * kept on the first one (and, as it takes up a sequence number, the rest
+ * are numbered one further on); TH_FIN and TH_PUSH are only kept on the
+ * last one.  The datagrams are handed to the network layer in as few calls
+ * as it allows.  Returns the number of bytes transferred (headers
+ * included) on success, or -1 on failure.
+ */
+ssize_t stcp_network_send_gso(mysocket_t sd, const void *header,
+                              const void *src, size_t src_len, size_t mss);
+
+/* Returns the largest datagram (STCP header and payload) that the network
+ * layer can carry to the peer.  This is normally MAX_IP_PAYLOAD_LEN, but
+ * links without an MTU of their own can be configured for jumbo packets of
+ * up to 64 KB (see STCP_MTU in network_io.h).  This is only a limit; it
+ * isn't negotiated with the peer, and mywrite() data is still queued in
+ * segments of STCP_MAX_PAYLOAD bytes, so stcp_app_recv() returns no more
+ * than that at a time.
+ */
+size_t stcp_network_max_packet_len(mysocket_t sd);
+
+/* buffers are reference counted.  stcp_hold_buf() takes an additional
+ * reference to a buffer; stcp_free_buf() drops one, freeing the buffer once
+ * there are none left.
+ */
+void stcp_hold_buf(void *packet);
+void stcp_free_buf(void *packet);
+
 /* Send data to the peer.
  *
  * sd           Mysocket descriptor
@@ -98,12 +195,39 @@ ssize_t stcp_network_recv(mysocket_t sd, void *dst, size_t max_len);
  */
 ssize_t stcp_network_send(mysocket_t sd, const void *src, size_t src_len, ...);
 
-/* receive data from the application (sent to us using mywrite()) */
+/* as stcp_network_send(), with the pieces of the datagram given by an iovec.
+ * the pieces are sent without being copied into a contiguous buffer, so
+ * e.g. a header and payload can be sent from wherever they happen to be.
+ */
+ssize_t stcp_network_sendv(mysocket_t sd, const struct iovec *iov, int iovcnt);
+
+/* receive data from the application (sent to us using mywrite()).
+ * returns the number of bytes copied into dst, which is 0 if data queued
+ * by mysendfile() couldn't be read (e.g. the file was truncated); the rest
+ * of that file's data is dropped.
+ */
 size_t stcp_app_recv(mysocket_t sd, void *dst, size_t max_len);
 
+/* as stcp_app_recv(), but without copying the data.  *packet is set to a
+ * buffer holding up to max_len bytes of application data, starting
+ * STCP_HEADROOM bytes in, so the STCP header can be filled in ahead of it
+ * and the whole packet sent with stcp_network_send_buf().  the buffer
+ * belongs to the caller, and must be released with stcp_free_buf(), even
+ * if (as for stcp_app_recv()) no data could be read.
+ */
+size_t stcp_app_recv_buf(mysocket_t sd, void **packet, size_t max_len);
+
 /* pass data up to the application for consumption by myread() */
 void stcp_app_send(mysocket_t sd, const void *src, size_t src_len);
 
+/* pass len bytes at the given offset into a buffer returned by
+ * stcp_network_recv_buf() up to the application, without copying them.
+ * the buffer is consumed by the call (and freed if len is zero).  for a
+ * coalesced datagram, offset must lie within the first segment, but len
+ * may run on into those coalesced with it.
+ */
+void stcp_app_send_buf(mysocket_t sd, void *packet, size_t offset, size_t len);
+
 /* once you receive a FIN segment from the peer, we need to let the
  * application know there's no more data arriving (by returning 0 bytes for
  * subsequent myread() calls).  call stcp_fin_received() to indicate the
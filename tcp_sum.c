@@ -1,6 +1,7 @@
 /* TCP checksum support--this is not used directly by students */
 
 #include <stddef.h>
+#include <string.h>
 #include <assert.h>
 #include <netinet/in.h>
 #include "mysock_impl.h"
@@ -8,6 +9,31 @@
 #include "tcp_sum.h"
 
 
+/* vector checksum kernels are built for x86, and used if the CPU supports
+ * them.  define NO_SIMD_CSUM to use only the portable one.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    !defined(NO_SIMD_CSUM)
+#define CSUM_X86
+#include <immintrin.h>
+#endif
+
+
+typedef uint32_t (*sum_func_t)(const void *buf, size_t len);
+
+static uint32_t _sum_words(const void *buf, size_t len);
+static uint32_t _sum_words_64(const void *buf, size_t len);
+#ifdef CSUM_X86
+static uint32_t _sum_words_sse2(const void *buf, size_t len);
+static uint32_t _sum_words_avx2(const void *buf, size_t len);
+#endif
+static uint16_t _get_th_sum(const struct iovec *iov, int iovcnt);
+static uint32_t _pseudo_header_sum(uint32_t src_addr, uint32_t dst_addr,
+                                   size_t len);
+static INLINE uint64_t _add64(uint64_t sum, uint64_t w);
+static INLINE uint32_t _fold64(uint64_t sum);
+
+
 /* computes checksum for TCP segment, based on description in RFCs 793 and
  * 1071, and Berkeley in_cksum().
  */
@@ -15,6 +41,173 @@ uint16_t _mysock_tcp_checksum(uint32_t src_addr /*network byte order*/,
                               uint32_t dst_addr /*network byte order*/,
                               const void *packet,
                               size_t len /*host byte order*/)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *) packet;
+    iov.iov_len  = len;
+    return _mysock_tcp_checksum_v(src_addr, dst_addr, &iov, 1);
+}
+
+/* as _mysock_tcp_checksum(), but the segment is made up of iovcnt pieces,
+ * of any length or alignment.  the TCP header needn't be contiguous.
+ */
+uint16_t _mysock_tcp_checksum_v(uint32_t src_addr /*network byte order*/,
+                                uint32_t dst_addr /*network byte order*/,
+                                const struct iovec *iov,
+                                int iovcnt)
+{
+    size_t len = 0, offset = 0;
+    uint32_t sum;
+    int k;
+
+    assert(iov || !iovcnt);
+
+    for (k = 0; k < iovcnt; ++k)
+        len += iov[k].iov_len;
+    assert(len >= sizeof(struct tcphdr));
+
+    sum = _pseudo_header_sum(src_addr, dst_addr, len);
+
+    /* process TCP header and payload */
+    for (k = 0; k < iovcnt; ++k)
+    {
+        if (iov[k].iov_len == 0)
+            continue;
+
+        sum = _mysock_csum_add(sum,
+                               _sum_words(iov[k].iov_base, iov[k].iov_len),
+                               offset);
+        offset += iov[k].iov_len;
+    }
+
+    /* th_sum == 0 during checksum computation; remove whatever is there.
+     * th_sum is at an even offset, so it's always summed as a whole word.
+     */
+    assert((offsetof(struct tcphdr, th_sum) & 1) == 0);
+    sum = _mysock_csum_add(sum, (uint16_t) ~_get_th_sum(iov, iovcnt), 0);
+
+    return (uint16_t) ~sum;
+}
+
+/* as _mysock_tcp_checksum(), for a segment of len bytes in which everything
+ * after the first header_len bytes has already been summed, giving
+ * data_sum (e.g. by _mysock_csum_and_copy()).  only the header is read.
+ */
+uint16_t _mysock_tcp_checksum_partial(uint32_t src_addr /*network byte order*/,
+                                      uint32_t dst_addr /*network byte order*/,
+                                      const void *packet,
+                                      size_t header_len,
+                                      size_t len,
+                                      uint32_t data_sum)
+{
+    uint32_t sum;
+
+    assert(packet && header_len >= sizeof(struct tcphdr));
+    assert(len >= header_len && (header_len & 1) == 0);
+
+    sum = _pseudo_header_sum(src_addr, dst_addr, len);
+    sum = _mysock_csum_add(sum, _sum_words(packet, header_len), 0);
+    sum = _mysock_csum_add(sum, data_sum, 0);
+    sum = _mysock_csum_add(sum,
+                           (uint16_t) ~((const struct tcphdr *) packet)->th_sum,
+                           0);
+
+    return (uint16_t) ~sum;
+}
+
+/* returns the one's complement sum of the data (see _sum_words()) */
+uint32_t _mysock_csum_partial(const void *buf, size_t len)
+{
+    return _sum_words(buf, len);
+}
+
+/* add piece_sum, the sum of a piece of data starting offset bytes into the
+ * data summed so far, to sum.  a piece starting at an odd offset
+ * contributes its sum byte-swapped (RFC 1071, section 2(B)).
+ */
+uint32_t _mysock_csum_add(uint32_t sum, uint32_t piece_sum, size_t offset)
+{
+    assert(sum <= 0xffff && piece_sum <= 0xffff);
+
+    if (offset & 1)
+        piece_sum = ((piece_sum & 0xff) << 8) | (piece_sum >> 8);
+
+    sum += piece_sum;
+    return (sum >> 16) + (sum & 0xffff);
+}
+
+/* copy len bytes from src to dst, returning their one's complement sum (as
+ * _mysock_csum_partial()).  the data is read only once, rather than once by
+ * memcpy() and again to checksum it.
+ */
+uint32_t _mysock_csum_and_copy(void *dst, const void *src, size_t len)
+{
+    const uint8_t *s = (const uint8_t *) src;
+    uint8_t *d = (uint8_t *) dst;
+    uint64_t sum = 0, w[4];
+
+    assert((dst && src) || !len);
+
+    for (; len >= sizeof(w); s += sizeof(w), d += sizeof(w), len -= sizeof(w))
+    {
+        memcpy(w, s, sizeof(w));
+        memcpy(d, w, sizeof(w));
+        sum = _add64(sum, w[0]);
+        sum = _add64(sum, w[1]);
+        sum = _add64(sum, w[2]);
+        sum = _add64(sum, w[3]);
+    }
+
+    if (len)
+    {
+        w[0] = w[1] = w[2] = w[3] = 0;
+        memcpy(w, s, len);
+        memcpy(d, w, len);
+        sum = _add64(sum, w[0]);
+        sum = _add64(sum, w[1]);
+        sum = _add64(sum, w[2]);
+        sum = _add64(sum, w[3]);
+    }
+
+    return _fold64(sum);
+}
+
+/* update a checksum for a change to len bytes (at an even offset) of the
+ * data it covers, per RFC 1624 (eqn. 3):  HC' = ~(~HC + ~m + m').  only
+ * the words that differ are visited.
+ */
+uint16_t _mysock_csum_update(uint16_t csum,
+                             const void *old_data,
+                             const void *new_data,
+                             size_t len)
+{
+    const uint8_t *o = (const uint8_t *) old_data;
+    const uint8_t *n = (const uint8_t *) new_data;
+    uint32_t sum = (uint16_t) ~csum;
+
+    assert(old_data && new_data && (len & 1) == 0);
+
+    for (; len > 0; o += 2, n += 2, len -= 2)
+    {
+        uint16_t old_word, new_word;
+
+        memcpy(&old_word, o, sizeof(old_word));
+        memcpy(&new_word, n, sizeof(new_word));
+        if (old_word != new_word)
+        {
+            sum = _mysock_csum_add(sum, (uint16_t) ~old_word, 0);
+            sum = _mysock_csum_add(sum, new_word, 0);
+        }
+    }
+
+    return (uint16_t) ~sum;
+}
+
+/* returns the sum of the TCP pseudo header */
+static uint32_t _pseudo_header_sum(uint32_t src_addr /*network byte order*/,
+                                   uint32_t dst_addr /*network byte order*/,
+                                   size_t len)
 {
     struct
     {
@@ -23,47 +216,202 @@ uint16_t _mysock_tcp_checksum(uint32_t src_addr /*network byte order*/,
         uint8_t  zero;
         uint8_t  protocol;
         uint16_t len;
-    } __attribute__ ((packed)) pseudo_header =
-    {
-        src_addr, dst_addr, 0, IPPROTO_TCP, htons(len)
-    };
+    } __attribute__ ((packed)) pseudo_header;
 
-    unsigned int k;
-    int32_t sum = 0;
-
-    assert(packet && len >= sizeof(struct tcphdr));
     assert(sizeof(pseudo_header) == 12);
 
-
     assert(src_addr > 0);
     assert(dst_addr > 0);
 
-    /* process 96-bit pseudo header */
-    for (k = 0; k < sizeof(pseudo_header) / sizeof(uint16_t); ++k)
-        sum += ((uint16_t *) &pseudo_header)[k];
+    pseudo_header.src_addr = src_addr;
+    pseudo_header.dst_addr = dst_addr;
+    pseudo_header.zero     = 0;
+    pseudo_header.protocol = IPPROTO_TCP;
+    pseudo_header.len      = htons(len);
 
-    /* process TCP header and payload */
-    assert(((long)packet & 2) == 0);
-    assert((offsetof(struct tcphdr, th_sum) & 2) == 0);
-    for (k = 0; k < (len >> 1); ++k)
+    return _sum_words(&pseudo_header, sizeof(pseudo_header));
+}
+
+/* returns the one's complement sum of the 16-bit words in buf, folded to
+ * 16 bits (in network byte order, i.e. it may be added to other such sums
+ * as is).  an odd trailing byte is padded with zero.
+ *
+ * the sum is invariant under the width of the words being added (2^16 is
+ * congruent to 1, modulo 2^16 - 1), so the kernels below add up 64-bit (or
+ * vector) words, folding the result at the end.  the fastest kernel the
+ * CPU supports is picked on first use.
+ */
+static uint32_t _sum_words(const void *buf, size_t len)
+{
+    static sum_func_t sum_func = NULL;
+
+    assert(buf || !len);
+
+    /* racing threads just pick the same kernel */
+    if (!sum_func)
     {
-        if (k == (offsetof(struct tcphdr, th_sum) >> 1))
-            continue;   /* th_sum == 0 during checksum computation */
-        sum += ((uint16_t *) packet)[k];
+        sum_func = _sum_words_64;
+#ifdef CSUM_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            sum_func = _sum_words_avx2;
+        else if (__builtin_cpu_supports("sse2"))
+            sum_func = _sum_words_sse2;
+#endif
     }
 
-    if (len & 1)
+    return sum_func(buf, len);
+}
+
+/* add w to the 64-bit one's complement sum, with end-around carry */
+static INLINE uint64_t _add64(uint64_t sum, uint64_t w)
+{
+    sum += w;
+    return sum + (sum < w);
+}
+
+/* fold a 64-bit one's complement sum to 16 bits */
+static INLINE uint32_t _fold64(uint64_t sum)
+{
+    sum = (sum >> 32) + (sum & 0xffffffff);
+    sum = (sum >> 32) + (sum & 0xffffffff);
+    sum = (sum >> 16) + (sum & 0xffff);
+    sum = (sum >> 16) + (sum & 0xffff);
+    return (uint32_t) sum;
+}
+
+/* portable kernel:  64-bit words, four at a time */
+static uint32_t _sum_words_64(const void *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t *) buf;
+    uint64_t sum = 0, w[4];
+
+    for (; len >= sizeof(w); p += sizeof(w), len -= sizeof(w))
     {
-        uint16_t tmp = 0;
-        *(uint8_t *) &tmp = ((uint8_t *) packet)[len - 1];
-        sum += tmp;
+        memcpy(w, p, sizeof(w));    /* buf may be unaligned */
+        sum = _add64(sum, w[0]);
+        sum = _add64(sum, w[1]);
+        sum = _add64(sum, w[2]);
+        sum = _add64(sum, w[3]);
     }
 
-    /* fold 32-bit sum to 16 bits */
-    sum = (sum >> 16) + (sum & 0xffff);
-    sum += (sum >> 16);
+    for (; len >= sizeof(w[0]); p += sizeof(w[0]), len -= sizeof(w[0]))
+    {
+        memcpy(w, p, sizeof(w[0]));
+        sum = _add64(sum, w[0]);
+    }
 
-    return (uint16_t) ~sum;
+    if (len)
+    {
+        /* the remaining bytes are padded with zero, which takes care of
+         * an odd trailing byte too.
+         */
+        w[0] = 0;
+        memcpy(w, p, len);
+        sum = _add64(sum, w[0]);
+    }
+
+    return _fold64(sum);
+}
+
+#ifdef CSUM_X86
+/* the vector kernels widen each 16-bit word to a 32-bit lane, and add the
+ * lanes up in blocks short enough that they can't overflow.  (each lane
+ * gains at most 2 * 0xffff per vector.)  whatever doesn't fill a vector is
+ * left to the portable kernel.
+ */
+#define CSUM_VECTORS_PER_BLOCK 16384
+
+__attribute__ ((target("sse2")))
+static uint32_t _sum_words_sse2(const void *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t *) buf;
+    const __m128i zero = _mm_setzero_si128();
+    uint64_t sum = 0;
+
+    while (len >= sizeof(__m128i))
+    {
+        size_t n = MIN(len / sizeof(__m128i), CSUM_VECTORS_PER_BLOCK);
+        __m128i acc = zero;
+        uint32_t lanes[4];
+        unsigned int k;
+
+        len -= n * sizeof(__m128i);
+        for (; n > 0; --n, p += sizeof(__m128i))
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *) p);
+
+            acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+            acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+        }
+
+        _mm_storeu_si128((__m128i *) lanes, acc);
+        for (k = 0; k < 4; ++k)
+            sum += lanes[k];
+    }
+
+    return _fold64(_add64(sum, _sum_words_64(p, len)));
+}
+
+__attribute__ ((target("avx2")))
+static uint32_t _sum_words_avx2(const void *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t *) buf;
+    const __m256i zero = _mm256_setzero_si256();
+    uint64_t sum = 0;
+
+    while (len >= sizeof(__m256i))
+    {
+        size_t n = MIN(len / sizeof(__m256i), CSUM_VECTORS_PER_BLOCK);
+        __m256i acc = zero;
+        uint32_t lanes[8];
+        unsigned int k;
+
+        len -= n * sizeof(__m256i);
+        for (; n > 0; --n, p += sizeof(__m256i))
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *) p);
+
+            acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v, zero));
+            acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v, zero));
+        }
+
+        _mm256_storeu_si256((__m256i *) lanes, acc);
+        for (k = 0; k < 8; ++k)
+            sum += lanes[k];
+    }
+
+    return _fold64(_add64(sum, _sum_words_64(p, len)));
+}
+#endif  /* CSUM_X86 */
+
+/* returns th_sum from a TCP header split across the given pieces */
+static uint16_t _get_th_sum(const struct iovec *iov, int iovcnt)
+{
+    size_t offset = offsetof(struct tcphdr, th_sum);
+    uint16_t th_sum;
+    uint8_t *dst = (uint8_t *) &th_sum;
+    size_t copied = 0;
+    int k;
+
+    for (k = 0; k < iovcnt && copied < sizeof(th_sum); ++k)
+    {
+        const uint8_t *src = (const uint8_t *) iov[k].iov_base;
+        size_t piece_len = iov[k].iov_len;
+
+        if (offset >= piece_len)
+        {
+            offset -= piece_len;
+            continue;
+        }
+
+        for (; offset < piece_len && copied < sizeof(th_sum); ++offset)
+            dst[copied++] = src[offset];
+        offset = 0;
+    }
+
+    assert(copied == sizeof(th_sum));
+    return th_sum;
 }
 
 /* update checksum in the given STCP segment */
@@ -83,24 +431,71 @@ void _mysock_set_checksum(const mysock_context_t *ctx,
         packet, len);
 }
 
-/* returns TRUE if checksum is correct, FALSE otherwise */
-bool_t _mysock_verify_checksum(const mysock_context_t *ctx,
-                               const void *packet, size_t len)
+/* as _mysock_set_checksum(), for a segment made up of iovcnt pieces.  the
+ * first piece must hold the (complete) TCP header.
+ */
+void _mysock_set_checksum_v(const mysock_context_t *ctx,
+                            const struct iovec *iov, int iovcnt)
+{
+    assert(ctx && iov && iovcnt > 0);
+    assert(iov[0].iov_len >= sizeof(struct tcphdr));
+
+    assert(ctx->network_state.peer_addr.sa_family == AF_INET);
+
+    ((struct tcphdr *) iov[0].iov_base)->th_sum = _mysock_tcp_checksum_v(
+        _network_get_local_addr((network_context_t *)
+                                &ctx->network_state), /*src*/
+        ((struct sockaddr_in *) &ctx->network_state.peer_addr)-> /*dst*/
+            sin_addr.s_addr,
+        iov, iovcnt);
+}
+
+/* as _mysock_set_checksum(), where the data following the header_len byte
+ * header is already known to sum to data_sum
+ */
+void _mysock_set_checksum_partial(const mysock_context_t *ctx,
+                                  void *packet, size_t header_len,
+                                  size_t len, uint32_t data_sum)
 {
-    uint16_t my_sum;
+    assert(ctx && packet);
+    assert(ctx->network_state.peer_addr.sa_family == AF_INET);
+
+    ((struct tcphdr *) packet)->th_sum = _mysock_tcp_checksum_partial(
+        _network_get_local_addr((network_context_t *)
+                                &ctx->network_state), /*src*/
+        ((struct sockaddr_in *) &ctx->network_state.peer_addr)-> /*dst*/
+            sin_addr.s_addr,
+        packet, header_len, len, data_sum);
+}
+
+/* returns TRUE if the packet's checksum is correct, FALSE otherwise.  the
+ * whole packet (including th_sum) must already be known to sum to
+ * packet_sum, e.g. from _mysock_csum_and_copy() as it was received; the
+ * packet itself is only read for th_sum.
+ */
+bool_t _mysock_verify_checksum_partial(const mysock_context_t *ctx,
+                                       const void *packet, size_t len,
+                                       uint32_t packet_sum)
+{
+    uint16_t th_sum;
+    uint32_t sum;
 
     assert(ctx && packet);
     assert(len >= sizeof(struct tcphdr));
 
     assert(ctx->network_state.peer_addr.sa_family == AF_INET);
 
-    my_sum = _mysock_tcp_checksum(
+    sum = _pseudo_header_sum(
         ((struct sockaddr_in *) &ctx->network_state.peer_addr)-> /*src*/
             sin_addr.s_addr,
         _network_get_local_addr((network_context_t *)
                                 &ctx->network_state), /*dst*/
-        packet, len);
+        len);
+    sum = _mysock_csum_add(sum, packet_sum, 0);
 
-    return my_sum == ((struct tcphdr *) packet)->th_sum;
-}
+    /* compare against the sum with th_sum zeroed, as it was computed */
+    th_sum = ((const struct tcphdr *) packet)->th_sum;
+    sum = _mysock_csum_add(sum, (uint16_t) ~th_sum, 0);
 
+    return (uint16_t) ~sum == th_sum;
+}
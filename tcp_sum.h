@@ -3,6 +3,7 @@
 #ifndef __TCP_CHECKSUM_H__
 #define __TCP_CHECKSUM_H__
 
+#include <sys/uio.h>
 #include "mysock.h"
 
 struct mysock_context;
@@ -12,11 +13,42 @@ uint16_t _mysock_tcp_checksum(uint32_t src_addr /*network byte order*/,
                               const void *packet,
                               size_t len /*host byte order*/);
 
+uint16_t _mysock_tcp_checksum_v(uint32_t src_addr /*network byte order*/,
+                                uint32_t dst_addr /*network byte order*/,
+                                const struct iovec *iov,
+                                int iovcnt);
+
+uint16_t _mysock_tcp_checksum_partial(uint32_t src_addr /*network byte order*/,
+                                      uint32_t dst_addr /*network byte order*/,
+                                      const void *packet,
+                                      size_t header_len,
+                                      size_t len,
+                                      uint32_t data_sum);
+
+/* partial (16-bit one's complement) sums, which may be combined with
+ * _mysock_csum_add(), and updated with _mysock_csum_update()
+ */
+uint32_t _mysock_csum_partial(const void *buf, size_t len);
+uint32_t _mysock_csum_add(uint32_t sum, uint32_t piece_sum, size_t offset);
+uint32_t _mysock_csum_and_copy(void *dst, const void *src, size_t len);
+uint16_t _mysock_csum_update(uint16_t csum,
+                             const void *old_data,
+                             const void *new_data,
+                             size_t len);
+
 void _mysock_set_checksum(const struct mysock_context *ctx,
                           void *packet, size_t len);
 
-bool_t _mysock_verify_checksum(const mysock_context_t *ctx,
-                               const void *packet, size_t len);
+void _mysock_set_checksum_v(const struct mysock_context *ctx,
+                            const struct iovec *iov, int iovcnt);
+
+void _mysock_set_checksum_partial(const struct mysock_context *ctx,
+                                  void *packet, size_t header_len,
+                                  size_t len, uint32_t data_sum);
+
+bool_t _mysock_verify_checksum_partial(const mysock_context_t *ctx,
+                                       const void *packet, size_t len,
+                                       uint32_t packet_sum);
 
 #endif  /* __TCP_CHECKSUM_H__ */
 
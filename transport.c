@@ -89,7 +89,7 @@ void waitHandshakePacket(mysocket_t, context_t*);
 
 // application requests data, create and send packet through network then back to application
 void applEvent(mysocket_t, context_t*); // event meaning application sends us a packet
-tcphdr* createPacket(tcp_seq, tcp_seq, char*, size_t);
+tcphdr* createPacket(tcp_seq, tcp_seq, char*);
 bool netwSend(mysocket_t, context_t*, char*, size_t);
 void netwEvent(mysocket_t, context_t*); // event meaning network sends us a packet
 void applSend(mysocket_t, context_t*, char*, size_t);
@@ -216,18 +216,16 @@ tcphdr* createHandshakePacket(tcp_seq seqNum, tcp_seq ackNum, uint8_t flags) {
     return packet;
 }
 
-tcphdr* createPacket(tcp_seq seqNum, tcp_seq ackNum, char* payload, size_t pSize) {
-    unsigned int packetSize = sizeof(tcphdr) + pSize;
-    tcphdr* packet = (tcphdr*)malloc(packetSize);
+// fill in the header at the start of a buffer from stcp_app_recv_buf(), ahead of its payload
+tcphdr* createPacket(tcp_seq seqNum, tcp_seq ackNum, char* buf) {
+    tcphdr* packet = (tcphdr*)buf;
 
+    memset(packet, 0, sizeof(tcphdr));
     packet->th_seq = htonl(seqNum);
     packet->th_ack = htonl(ackNum);
     packet->th_off = htons(5); // data begins 20 bytes into the packet
     packet->th_flags = NETWORK_DATA; // packet type
     packet->th_win = htons(WINDOW_SIZE); // amount of data we (the sender) are willing to accept
-    
-    // append payload to header
-    memcpy((char*)packet + sizeof(tcphdr), payload, pSize); // 1: destination, beginning of packet offset by header, 2: source payload, 3: size
     return packet;
 }
 
@@ -288,21 +286,20 @@ void waitHandshakePacket(mysocket_t sd, context_t* ctx) {
 
 void applEvent(mysocket_t sd, context_t* ctx) { // TCP recieves write(payload), sends across network
     size_t max_payload = min(MSS, ctx->recv_windowSize) - sizeof(tcphdr);
-    char payload[max_payload];
-    ssize_t appl_bytes_recvd = stcp_app_recv(sd, payload, max_payload);
+    void* packet = NULL;
+    ssize_t appl_bytes_recvd = stcp_app_recv_buf(sd, &packet, max_payload); // payload is left room for the header, so it's never copied
 
     /* app recv testing
     printf("appl_bytes_recvd: %d\n", appl_bytes_recvd);
     printf("payload: %s\n", payload);
     */
 
-    if (appl_bytes_recvd == 0) {
-        free(ctx);
-        errno = ECONNREFUSED;
+    if (appl_bytes_recvd == 0) { // mysendfile() data that couldn't be read was dropped, nothing to send
+        stcp_free_buf(packet);
         return;
     }
 
-    netwSend(sd, ctx, payload, appl_bytes_recvd);
+    netwSend(sd, ctx, (char*)packet, appl_bytes_recvd);
     waitHandshakePacket(sd, ctx); // wait for ACK
 }
 
@@ -319,15 +316,18 @@ void applClose(mysocket_t sd, context_t* ctx) {
 void netwEvent(mysocket_t sd, context_t* ctx) { 
     bool isFIN = false;
     bool isDUP = false;
-    char payload[MSS];
+    void* buf = NULL;
 
-    ssize_t bytes_recvd = stcp_network_recv(sd, payload, MSS);
+    ssize_t bytes_recvd = stcp_network_recv_buf(sd, &buf); // buf is ours until freed or handed to the application
+    char* payload = (char*)buf;
     if(bytes_recvd < (int)sizeof(tcphdr)) { // recv error
+        stcp_free_buf(buf);
         free(ctx);
         errno = ECONNREFUSED;
         return;
     }
     if(isFIN) {
+        stcp_free_buf(buf);
         sendHandshakePacket(sd, ctx, ctx->seqNum, ctx->recv_seqNum + 1, TH_ACK);
         stcp_fin_received(sd);
         ctx->connection_state = CSTATE_CLOSED;
@@ -335,17 +335,20 @@ void netwEvent(mysocket_t sd, context_t* ctx) {
     }
     parsePacket(ctx, payload, isFIN, isDUP);
     if(isDUP) {
+        stcp_free_buf(buf);
         sendHandshakePacket(sd, ctx, ctx->seqNum, ctx->recv_seqNum + 1, TH_ACK);
         return;
     }
     if(bytes_recvd - sizeof(tcphdr)) { // data present
-        applSend(sd, ctx, payload, bytes_recvd); // send payload to application
+        applSend(sd, ctx, payload, bytes_recvd); // send payload to application (takes the buffer)
         sendHandshakePacket(sd, ctx, ctx->seqNum, ctx->recv_seqNum + 1, TH_ACK);
+    } else {
+        stcp_free_buf(buf);
     }
 }
 
 void applSend(mysocket_t sd, context_t* ctx, char* payload, size_t pSize) {
-    stcp_app_send(sd, payload + sizeof(tcphdr), pSize - sizeof(tcphdr)); // send just the payload to the application
+    stcp_app_send_buf(sd, payload, sizeof(tcphdr), pSize - sizeof(tcphdr)); // pass just the payload to the application, no copy
 }
 
 void parsePacket(context_t* ctx, char* payload, bool& isFIN, bool& isDUP) {
@@ -358,17 +361,18 @@ void parsePacket(context_t* ctx, char* payload, bool& isFIN, bool& isDUP) {
     }
 }
 
-bool netwSend(mysocket_t sd, context_t* ctx, char* payload, size_t pSize) {
-    tcphdr* packet = createPacket(ctx->seqNum, ctx->recv_seqNum + 1, payload, pSize);
+// buf is from stcp_app_recv_buf(), with pSize bytes of payload after room for the header
+bool netwSend(mysocket_t sd, context_t* ctx, char* buf, size_t pSize) {
+    tcphdr* packet = createPacket(ctx->seqNum, ctx->recv_seqNum + 1, buf);
     ctx->seqNum += pSize;
 
-    ssize_t bytes_sent = stcp_network_send(sd, packet, sizeof(tcphdr) + pSize, NULL);
+    ssize_t bytes_sent = stcp_network_send_buf(sd, packet, sizeof(tcphdr) + pSize);
+
+    stcp_free_buf(packet); // sent (or not); either way we're done with the segment
 
     if (bytes_sent > 0) { // successful
-        free(packet);
         return true;
     } else { // send error
-        free(packet);
         free(ctx);
         errno = ECONNREFUSED;
         return false;
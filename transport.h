@@ -76,6 +76,12 @@ typedef struct tcphdr
 /* STCP maximum segment size */
 #define STCP_MSS 536
 
+/* mywrite() data is queued in segments of at most STCP_MAX_PAYLOAD bytes,
+ * each with room for the STCP header ahead of it; see stcp_app_recv_buf().
+ */
+#define STCP_HEADROOM       sizeof(struct tcphdr)
+#define STCP_MAX_PAYLOAD    (STCP_MSS - STCP_HEADROOM)
+
 
 #ifndef MIN
     #define MIN(x,y)  ((x) <= (y) ? (x) : (y))